@@ -0,0 +1,224 @@
+#define _GNU_SOURCE    /* SCHED_BATCH */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pktav_cgroup.h"
+#include "pktav_sched.h"
+#include "pktav_error.h"
+#include "pktav_log.h"
+
+/* cpu.weight of every priority class (the cgroup default is 100) */
+static const int cgroup_weight[] = { 1000, 400, 100, 25 };
+
+/* Parent cgroup of the jobs (set in the daemon, inherited by the workers) */
+static char cgroup_parent[PATH_MAX] = "";
+/* Leaf of the job of this worker */
+static char cgroup_leaf[PATH_MAX] = "";
+
+/* 
+ * Workers reaped by the SIGCHLD handler whose leaf is not removed yet. The handler 
+ * only stores the pid, the daemon loop builds the path and removes the leaf.
+ */
+#define CGROUP_REAPED_MAX 256
+static volatile pid_t cgroup_reaped[CGROUP_REAPED_MAX];
+static volatile sig_atomic_t cgroup_reaped_head = 0;    /* Written by the handler */
+static sig_atomic_t cgroup_reaped_tail = 0;             /* Written by the daemon loop */
+
+static int cgroup_write(const char *dir, const char *file, const char *value) {
+    char path[PATH_MAX];
+    ssize_t len = strlen(value);
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((fd = open(path, O_WRONLY)) < 0)
+        return -1;
+    if (write(fd, value, len) != len) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+/*
+ * Value of a key in a flat keyed file (cpu.stat), or of a single value file 
+ * (memory.peak) if key is NULL. Returns -1 if it cannot be read.
+ */
+static int64_t cgroup_read(const char *file, const char *key) {
+    char path[PATH_MAX], name[64];
+    int64_t value = -1, v;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", cgroup_leaf, file);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    if (!key) {
+        if (fscanf(fp, "%" SCNd64, &v) == 1)
+            value = v;
+    } else {
+        while (fscanf(fp, "%63s %" SCNd64, name, &v) == 2) {
+            if (strcmp(name, key) == 0) {
+                value = v;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+/**
+ * @brief Set the parent cgroup (v2) of the job cgroups and enable the cpu and memory controllers for them.
+ *
+ * @param parent Path of a delegated cgroup v2 directory (like /sys/fs/cgroup/pktav). The daemon itself must
+ *               not be in it, cgroup v2 does not allow processes in a cgroup with controllers enabled for
+ *               its children.
+ *
+ * @return Returns 0 on success, or -OS_ERROR if the controllers cannot be enabled (pktav_errno is set).
+ *
+ * @note Must be called in the daemon before forking the workers.
+ */
+int pktav_cgroup_init(const char *parent) {
+    pktav_errno = 0;
+
+    if (cgroup_write(parent, "cgroup.subtree_control", "+cpu +memory") < 0) {
+        pktav_errno = errno;
+        return -OS_ERROR;
+    }
+    snprintf(cgroup_parent, sizeof(cgroup_parent), "%s", parent);
+    return 0;
+}
+
+/**
+ * @brief Move this worker to its own cgroup leaf, with CPU and memory limits derived from the job.
+ *
+ * Live and paid jobs are not capped (cpu.max), they only get a higher cpu.weight, so they keep their 
+ * throughput when the host is busy. Standard and bulk jobs are capped to 1.5x and 1x their estimated 
+ * cores. memory.max grows with the estimated cores (frames in flight), with twice the room for live 
+ * and paid jobs, which should not be killed by the OOM killer.
+ *
+ * @param priority Priority class of the job (SCHED_CLASS_*).
+ * @param cost Estimated cores of the job (pktav_sched_cost).
+ * @param batch Run bulk jobs with the SCHED_BATCH policy too (inherited by the codec threads).
+ *
+ * @return Returns 0 on success (or if cgroups are not configured), or -OS_ERROR (pktav_errno is set). 
+ *         A failure only means the job runs without limits.
+ */
+int pktav_cgroup_enter(int priority, double cost, int batch) {
+    struct sched_param param = { 0 };
+    char value[64];
+    int64_t memory;
+    int error = 0;
+
+    pktav_errno = 0;
+
+    if (batch && priority == SCHED_CLASS_BULK && sched_setscheduler(0, SCHED_BATCH, &param) < 0)
+        pktav_log(NULL, 0, "SCHED_BATCH not set: %s\n", strerror(errno));
+
+    if (!cgroup_parent[0])
+        return 0;
+    if (priority < SCHED_CLASS_LIVE || priority > SCHED_CLASS_BULK)
+        priority = SCHED_CLASS_STANDARD;
+
+    snprintf(cgroup_leaf, sizeof(cgroup_leaf), "%s/job-%d", cgroup_parent, (int)getpid());
+    if (mkdir(cgroup_leaf, 0755) < 0 && errno != EEXIST) {
+        pktav_errno = errno;
+        cgroup_leaf[0] = '\0';
+        return -OS_ERROR;
+    }
+
+    snprintf(value, sizeof(value), "%d", cgroup_weight[priority]);
+    error |= cgroup_write(cgroup_leaf, "cpu.weight", value);
+
+    if (priority <= SCHED_CLASS_PAID)
+        snprintf(value, sizeof(value), "max %d", CGROUP_CPU_PERIOD_US);
+    else
+        snprintf(value, sizeof(value), "%lld %d", (long long)ceil(cost * (priority == SCHED_CLASS_BULK ? 1.0 : 1.5) * 
+                                                                  CGROUP_CPU_PERIOD_US), CGROUP_CPU_PERIOD_US);
+    error |= cgroup_write(cgroup_leaf, "cpu.max", value);
+
+    memory = CGROUP_MEM_BASE + (int64_t)(cost * CGROUP_MEM_PER_CORE);
+    if (priority <= SCHED_CLASS_PAID)
+        memory *= 2;
+    snprintf(value, sizeof(value), "%" PRId64, memory);
+    error |= cgroup_write(cgroup_leaf, "memory.max", value);
+
+    /* Move this process, the threads created from now on are in the leaf too */
+    if (error < 0 || cgroup_write(cgroup_leaf, "cgroup.procs", "0") < 0) {
+        pktav_errno = errno;
+        rmdir(cgroup_leaf);
+        cgroup_leaf[0] = '\0';
+        return -OS_ERROR;
+    }
+    pktav_log(NULL, 0, "Cgroup %s: cpu.weight %d, cpu.max %s, memory.max %" PRId64 " MB\n", cgroup_leaf,
+                       cgroup_weight[priority], priority <= SCHED_CLASS_PAID ? "max" : "capped", memory >> 20);
+    return 0;
+}
+
+/**
+ * @brief Queue the cgroup leaf of a finished worker to be removed.
+ *
+ * @param pid Pid of the worker, already reaped (its cgroup is empty).
+ *
+ * @note Called from the SIGCHLD handler of the daemon: it only stores the pid (async-signal-safe),
+ *       the leaf is removed by pktav_cgroup_remove_reaped(). If the queue is full the leaf is left.
+ */
+void pktav_cgroup_reaped(pid_t pid) {
+    int head = cgroup_reaped_head;
+
+    if (!cgroup_parent[0] || head - cgroup_reaped_tail >= CGROUP_REAPED_MAX)
+        return;
+    cgroup_reaped[head % CGROUP_REAPED_MAX] = pid;
+    cgroup_reaped_head = head + 1;
+}
+
+/**
+ * @brief Remove the cgroup leaves of the workers reaped since the last call.
+ *
+ * @note Called from the daemon loop, never from a signal handler.
+ */
+void pktav_cgroup_remove_reaped(void) {
+    char path[PATH_MAX];
+
+    while (cgroup_reaped_tail != cgroup_reaped_head) {
+        snprintf(path, sizeof(path), "%s/job-%d", cgroup_parent, 
+                 (int)cgroup_reaped[cgroup_reaped_tail % CGROUP_REAPED_MAX]);
+        if (rmdir(path) < 0 && errno != ENOENT)
+            pktav_log(NULL, 0, "Cgroup %s not removed: %s\n", path, strerror(errno));
+        cgroup_reaped_tail++;
+    }
+}
+
+/**
+ * @brief Report the CPU and memory used by the job, read from its cgroup.
+ *
+ * @param status Pointer to the TAVStatus (FINISH) where the usage is set.
+ *
+ * @note memory.peak needs Linux 5.19, memory.current is used on older kernels.
+ */
+void pktav_cgroup_status(TAVStatus *status) {
+    int64_t usage, user, system, throttled, memory;
+
+    if (!cgroup_leaf[0] || (usage = cgroup_read("cpu.stat", "usage_usec")) < 0)
+        return;
+    user = cgroup_read("cpu.stat", "user_usec");
+    system = cgroup_read("cpu.stat", "system_usec");
+    throttled = cgroup_read("cpu.stat", "throttled_usec");
+    if ((memory = cgroup_read("memory.peak", NULL)) < 0)
+        memory = cgroup_read("memory.current", NULL);
+
+    status->cgroup = 1;
+    status->cgroup_cpu_ms = usage / 1000;
+    status->cgroup_user_ms = user > 0 ? user / 1000 : 0;
+    status->cgroup_system_ms = system > 0 ? system / 1000 : 0;
+    status->cgroup_throttled_ms = throttled > 0 ? throttled / 1000 : 0;
+    status->cgroup_memory_peak = memory > 0 ? memory : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef _PKTAV_CGROUP_H
+#define _PKTAV_CGROUP_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "pktav_types.h"
+
+#define CGROUP_CPU_PERIOD_US   100000               // cpu.max period
+#define CGROUP_MEM_BASE        (256LL << 20)        // memory.max: demuxer, muxers and buffers
+#define CGROUP_MEM_PER_CORE    (384LL << 20)        // memory.max: frames in flight per estimated core
+
+extern int  pktav_cgroup_init(const char *parent);
+extern int  pktav_cgroup_enter(int priority, double cost, int batch);
+extern void pktav_cgroup_reaped(pid_t pid);
+extern void pktav_cgroup_remove_reaped(void);
+extern void pktav_cgroup_status(TAVStatus *status);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavformat/avformat.h>
+#include <libavutil/crc.h>
+#include <libavutil/hash.h>
+#include <libavutil/mem.h>
+#include <libavutil/avstring.h>
+#include "pktav_checksum.h"
+
+static int pktav_hashio_write(void *opaque, const uint8_t *buf, int size) {
+    TAVHashIO *hio = opaque;
+
+    if (hio->valid && hio->pos != hio->hashed)
+        hio->valid = 0;     /* Bytes rewritten after a seek */
+    if (hio->valid) {
+        av_hash_update(hio->hash, buf, size);
+        hio->hashed += size;
+    }
+    hio->pos += size;
+
+    avio_write(hio->inner, buf, size);
+    avio_flush(hio->inner);
+    return hio->inner->error < 0 ? hio->inner->error : size;
+}
+
+static int64_t pktav_hashio_seek(void *opaque, int64_t offset, int whence) {
+    TAVHashIO *hio = opaque;
+    int64_t pos;
+
+    if (whence & AVSEEK_SIZE)
+        return avio_size(hio->inner);
+
+    pos = avio_seek(hio->inner, offset, whence & ~AVSEEK_FORCE);
+    if (pos >= 0)
+        hio->pos = pos;
+    return pos;
+}
+
+/**
+ * @brief Open an output and wrap it in an AVIOContext that hashes the written bytes.
+ *
+ * @param pb Where the hashing AVIOContext is stored.
+ * @param url Destination of the output.
+ * @param algo Hash algorithm, any name supported by av_hash_alloc ("MD5", "SHA256", "CRC32"...).
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note The context must be closed with pktav_hashio_close().
+ */
+int pktav_hashio_open(AVIOContext **pb, const char *url, const char *algo) {
+    TAVHashIO *hio;
+    unsigned char *buffer = NULL;
+    int error;
+
+    if ((hio = av_mallocz(sizeof(TAVHashIO))) == NULL)
+        return AVERROR(ENOMEM);
+    hio->valid = 1;
+
+    if ((error = av_hash_alloc(&hio->hash, algo)) < 0)
+        goto fail;
+    av_hash_init(hio->hash);
+
+    if ((error = avio_open(&hio->inner, url, AVIO_FLAG_WRITE)) < 0)
+        goto fail;
+
+    if ((hio->url = av_strdup(url)) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    if ((buffer = av_malloc(HASHIO_BUFFER_SIZE)) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    *pb = avio_alloc_context(buffer, HASHIO_BUFFER_SIZE, 1, hio, NULL, pktav_hashio_write, pktav_hashio_seek);
+    if (*pb == NULL) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    (*pb)->seekable = hio->inner->seekable;
+    return 0;
+
+fail:
+    av_free(buffer);
+    if (hio->inner)
+        avio_closep(&hio->inner);
+    av_hash_freep(&hio->hash);
+    av_free(hio->url);
+    av_free(hio);
+    return error;
+}
+
+/**
+ * @brief Hash the finished file reading it again from its destination.
+ *
+ * @param hio Pointer to the TAVHashIO, its destination already flushed.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code if the destination cannot be read.
+ */
+static int pktav_hashio_rehash(TAVHashIO *hio) {
+    AVIOContext *in = NULL;
+    unsigned char *buffer;
+    int error, size;
+
+    if ((buffer = av_malloc(HASHIO_BUFFER_SIZE)) == NULL)
+        return AVERROR(ENOMEM);
+    if ((error = avio_open(&in, hio->url, AVIO_FLAG_READ)) < 0) {
+        av_free(buffer);
+        return error;
+    }
+
+    av_hash_init(hio->hash);
+    while ((size = avio_read(in, buffer, HASHIO_BUFFER_SIZE)) > 0)
+        av_hash_update(hio->hash, buffer, size);
+    error = size == AVERROR_EOF || size == 0 ? 0 : size;
+
+    avio_closep(&in);
+    av_free(buffer);
+    return error;
+}
+
+/**
+ * @brief Get the hash of all the bytes written so far.
+ *
+ * @param pb Pointer to a hashing AVIOContext (pktav_hashio_open). It is flushed first.
+ * @param hex Where the hash is stored as a hexadecimal string.
+ * @param size Size of `hex`, at least twice the digest size plus one.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code if the file was not written sequentially
+ *         and cannot be read again (`hex` is set to an empty string).
+ *
+ * @note If the muxer seeked back, the streaming hash is discarded and the finished file is read 
+ *       again from its destination (one more sequential read of the file).
+ * @note The hash is finalized, no more bytes can be written after this call.
+ */
+int pktav_hashio_final(AVIOContext *pb, char *hex, int size) {
+    TAVHashIO *hio = pb->opaque;
+    int error;
+
+    avio_flush(pb);
+    if (!hio->valid || hio->pos != hio->hashed) {
+        avio_flush(hio->inner);
+        if ((error = pktav_hashio_rehash(hio)) < 0) {
+            hex[0] = '\0';
+            return error;
+        }
+    }
+    av_hash_final_hex(hio->hash, (uint8_t *)hex, size);
+    return 0;
+}
+
+/**
+ * @brief Flush and close a hashing AVIOContext and its destination.
+ *
+ * @param pb Pointer to the hashing AVIOContext, set to NULL.
+ *
+ * @return Returns 0 on success, or the negative AVERROR code of closing the destination.
+ */
+int pktav_hashio_close(AVIOContext **pb) {
+    TAVHashIO *hio;
+    int error;
+
+    if (!*pb)
+        return 0;
+
+    hio = (*pb)->opaque;
+    avio_flush(*pb);
+    error = avio_closep(&hio->inner);
+
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    av_hash_freep(&hio->hash);
+    av_free(hio->url);
+    av_free(hio);
+    return error;
+}
+
+/**
+ * @brief Update a CRC-32 (IEEE 802.3, the one of zlib) with more data.
+ *
+ * @param crc Current value, CRC32_INIT for the first call.
+ * @param data Pointer to the data.
+ * @param size Size of the data.
+ *
+ * @return Returns the updated value. The final CRC is the value XOR CRC32_INIT.
+ */
+uint32_t pktav_crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+    return av_crc(av_crc_get_table(AV_CRC_32_IEEE_LE), crc, data, size);
+}
@@ -0,0 +1,30 @@
+#ifndef _PKTAV_CHECKSUM_H
+#define _PKTAV_CHECKSUM_H 1
+
+#include <stdint.h>
+#include <libavformat/avio.h>
+
+#define HASHIO_BUFFER_SIZE 65536
+#define CRC32_INIT UINT32_MAX
+
+/*
+ * Output AVIOContext that hashes the bytes written by the muxer before passing
+ * them to the real destination. The streaming hash is only valid while the muxer
+ * writes the file sequentially: after a seek back (like the moov size of a regular
+ * MP4) the finished file is read again and hashed in pktav_hashio_final().
+ */
+typedef struct {
+    AVIOContext          *inner;     // Real destination
+    char                 *url;       // Destination, read again if the muxer seeked
+    struct AVHashContext *hash;      // Whole file hash
+    int64_t              pos;        // Write position
+    int64_t              hashed;     // Bytes hashed
+    int                  valid;      // The hash covers the file as it was written
+} TAVHashIO;
+
+extern int      pktav_hashio_open(AVIOContext **pb, const char *url, const char *algo);
+extern int      pktav_hashio_final(AVIOContext *pb, char *hex, int size);
+extern int      pktav_hashio_close(AVIOContext **pb);
+extern uint32_t pktav_crc32_update(uint32_t crc, const uint8_t *data, size_t size);
+
+#endif
@@ -5,13 +5,15 @@
 
 
 #define _PKTAV_ERROR_GLOBAL 1
-int pktav_errno;
+__thread int pktav_errno;
 char *err_str[] = {
     "Success",
     "Video Stream not found",
     "Audio Stream not found",
     "Buffer too small to save the value",
     "Key not found",
+    "Job queue full",
+    "Job cancelled",
 };
 
 #include "pktav_error.h"
@@ -8,7 +8,7 @@
 #define ERR_BUFF_SIZE 2048
 
 #ifndef _PKTAV_ERROR_GLOBAL
-    extern int pktav_errno;
+    extern __thread int pktav_errno;
     extern char err_buff[ERR_BUFF_SIZE];
     extern char *err_str[];
 #endif
@@ -19,6 +19,8 @@ extern const char *pktav_strerror(int err);
 #define PK_ERROR_ANOTFOUND   2
 #define PK_ERROR_BUFFTOSMALL 3
 #define PK_ERROR_KEYNOTFOUND 4
+#define PK_ERROR_QUEUEFULL   5
+#define PK_ERROR_CANCELLED   6
 
 #include <errno.h>
 
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include "pktav_framepool.h"
+#include "pktav_sched.h"
+#include "pktav_log.h"
+
+static void framepool_free(void *opaque, uint8_t *data) {
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+/*
+ * Map a buffer of whole huge pages. Without reserved huge pages the mapping is
+ * aligned to 2 MB, so the kernel can back it with transparent huge pages.
+ * Called by av_buffer_pool_get() with fp->lock held (pktav_framepool_get).
+ */
+static AVBufferRef *framepool_alloc(void *opaque, size_t size) {
+    TAVFramePool *fp = opaque;
+    size_t len = FFALIGN(size, FRAMEPOOL_HUGE_PAGE), head;
+    AVBufferRef *buf;
+    uint8_t *ptr;
+
+    ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        fp->hugetlb++;
+    } else {
+        ptr = mmap(NULL, len + FRAMEPOOL_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            return NULL;
+        /* Trim the mapping to a 2 MB boundary */
+        head = FFALIGN((uintptr_t)ptr, FRAMEPOOL_HUGE_PAGE) - (uintptr_t)ptr;
+        if (head)
+            munmap(ptr, head);
+        munmap(ptr + head + len, FRAMEPOOL_HUGE_PAGE - head);
+        ptr += head;
+        if (madvise(ptr, len, MADV_HUGEPAGE) == 0)
+            fp->thp++;
+    }
+
+    buf = av_buffer_create(ptr, size, framepool_free, (void *)(uintptr_t)len, 0);
+    if (!buf) {
+        munmap(ptr, len);
+        return NULL;
+    }
+    fp->buffers++;
+    fp->bytes += len;
+    return buf;
+}
+
+/*
+ * Plane layout of the frames of the pool, the pool is rebuilt when it changes.
+ * The buffers of the old pool are freed when their frames are unreferenced.
+ */
+static int framepool_layout(TAVFramePool *fp, int format, int width, int height) {
+    ptrdiff_t linesizes[4];
+    size_t sizes[4];
+    int i, error;
+
+    if (fp->pool && fp->format == format && fp->width == width && fp->height == height)
+        return 0;
+
+    av_buffer_pool_uninit(&fp->pool);
+    if ((error = av_image_fill_linesizes(fp->linesize, format, width)) < 0)
+        return error;
+    for (i = 0; i < 4; i++) {
+        fp->linesize[i] = FFALIGN(fp->linesize[i], FRAMEPOOL_ALIGN);
+        linesizes[i] = fp->linesize[i];
+    }
+    if ((error = av_image_fill_plane_sizes(sizes, format, height, linesizes)) < 0)
+        return error;
+
+    fp->size = 0;
+    for (i = 0; i < 4; i++) {
+        fp->offset[i] = fp->size;
+        fp->size += FFALIGN(sizes[i], FRAMEPOOL_ALIGN);
+    }
+    fp->size += 16 + FRAMEPOOL_ALIGN - 1;     /* Overread of the SIMD code */
+
+    fp->pool = av_buffer_pool_init2(fp->size, fp, framepool_alloc, NULL);
+    if (!fp->pool)
+        return AVERROR(ENOMEM);
+    fp->format = format;
+    fp->width = width;
+    fp->height = height;
+    return 0;
+}
+
+/*
+ * get_buffer2 of the decoder: the pool for the software video frames, the
+ * default allocator for everything else.
+ */
+static int framepool_get_buffer2(AVCodecContext *ctx, AVFrame *frame, int flags) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int width = frame->width, height = frame->height;
+    int align[AV_NUM_DATA_POINTERS];
+
+    if (!ctx->opaque || ctx->codec_type != AVMEDIA_TYPE_VIDEO || !desc || 
+        (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)))
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+
+    /* Decoder thread: the memory policy of the job placement, the new buffers are node-local */
+    pktav_sched_thread_policy();
+
+    /* Padding the decoder needs (edges, macroblock rows) */
+    avcodec_align_dimensions2(ctx, &width, &height, align);
+    if (pktav_framepool_get(ctx->opaque, frame, width, height) < 0)
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    return 0;
+}
+
+/**
+ * @brief Initialize a frame pool (empty, the buffers are mapped on demand).
+ *
+ * @param fp Pointer to the TAVFramePool structure to be initialized.
+ */
+void pktav_framepool_init(TAVFramePool *fp) {
+    memset(fp, 0, sizeof(TAVFramePool));
+    pthread_mutex_init(&fp->lock, NULL);
+}
+
+/**
+ * @brief Allocate the buffer of a video frame from the pool.
+ *
+ * @param fp Pointer to the TAVFramePool.
+ * @param frame Pointer to the AVFrame, with its format set. Its data and linesize are set.
+ * @param width Width of the buffer, the frame width or more (padding).
+ * @param height Height of the buffer, the frame height or more (padding).
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+int pktav_framepool_get(TAVFramePool *fp, AVFrame *frame, int width, int height) {
+    AVBufferRef *buf = NULL;
+    int i, error;
+
+    pthread_mutex_lock(&fp->lock);
+    if ((error = framepool_layout(fp, frame->format, width, height)) == 0 && 
+        (buf = av_buffer_pool_get(fp->pool)) == NULL)
+        error = AVERROR(ENOMEM);
+    if (error == 0)
+        fp->frames++;
+    pthread_mutex_unlock(&fp->lock);
+    if (error < 0)
+        return error;
+
+    frame->buf[0] = buf;
+    for (i = 0; i < 4; i++) {
+        frame->linesize[i] = fp->linesize[i];
+        frame->data[i] = fp->linesize[i] ? buf->data + fp->offset[i] : NULL;
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+/**
+ * @brief Use the pool for the frames of a video decoder.
+ *
+ * @param fp Pointer to the TAVFramePool.
+ * @param dec Pointer to the decoder context. Decoders without direct rendering (AV_CODEC_CAP_DR1) keep 
+ *            their own buffers.
+ *
+ * @note The decoder uses its opaque field for the pool.
+ */
+void pktav_framepool_attach(TAVFramePool *fp, AVCodecContext *dec) {
+    if (!dec->codec || !(dec->codec->capabilities & AV_CODEC_CAP_DR1))
+        return;
+    dec->opaque = fp;
+    dec->get_buffer2 = framepool_get_buffer2;
+}
+
+/**
+ * @brief Release the pool. The buffers still referenced by frames are unmapped when they are unreferenced.
+ *
+ * @param fp Pointer to the TAVFramePool.
+ */
+void pktav_framepool_close(TAVFramePool *fp) {
+    if (fp->buffers > 0)
+        pktav_log(NULL, 0, "Frame pool: %" PRId64 " frames, %" PRId64 " buffers (%" PRId64 " MB), %" PRId64 
+                           " hugetlb, %" PRId64 " thp\n", fp->frames, fp->buffers, fp->bytes >> 20, fp->hugetlb, fp->thp);
+    av_buffer_pool_uninit(&fp->pool);
+    pthread_mutex_destroy(&fp->lock);
+    memset(fp, 0, sizeof(TAVFramePool));
+}
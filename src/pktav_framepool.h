@@ -0,0 +1,40 @@
+#ifndef _PKTAV_FRAMEPOOL_H
+#define _PKTAV_FRAMEPOOL_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+
+#define FRAMEPOOL_HUGE_PAGE  (2 << 20)  // Huge page size (x86-64/arm64 PMD)
+#define FRAMEPOOL_ALIGN      64         // Linesize alignment (AVX-512)
+
+/*
+ * Pool of video frame buffers backed by 2 MB huge pages: MAP_HUGETLB when the
+ * host has huge pages reserved, otherwise a 2 MB aligned mapping with
+ * MADV_HUGEPAGE for transparent huge pages. Every buffer holds all the planes
+ * of one frame, the pool is rebuilt if the format or the size of the frames
+ * changes.
+ */
+typedef struct TAVFramePool {
+    pthread_mutex_t lock;           // Decoder threads get buffers concurrently
+    AVBufferPool   *pool;
+    int            format;          // Frames of the pool (padded size)
+    int            width;
+    int            height;
+    int            linesize[4];
+    size_t         offset[4];
+    size_t         size;
+    int64_t        frames;          // Frames served
+    int64_t        buffers;         // Buffers mapped
+    int64_t        hugetlb;         // Buffers backed by MAP_HUGETLB
+    int64_t        thp;             // Buffers advised as transparent huge pages
+    int64_t        bytes;           // Bytes mapped
+} TAVFramePool;
+
+extern void pktav_framepool_init(TAVFramePool *fp);
+extern int  pktav_framepool_get(TAVFramePool *fp, AVFrame *frame, int width, int height);
+extern void pktav_framepool_attach(TAVFramePool *fp, AVCodecContext *dec);
+extern void pktav_framepool_close(TAVFramePool *fp);
+
+#endif
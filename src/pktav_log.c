@@ -1,31 +1,333 @@
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include <libavutil/log.h>
 #include "pktav_log.h"
 
-void pktav_log_callback(void* ptr, int level, const char* fmt, va_list vl) {
-    pid_t id;
-    if (level <= av_log_get_level()) {
-        id = getpid();
+/*
+ * Asynchronous logging: every thread formats its messages into its own ring
+ * (single producer, single consumer, no locks) and a background writer thread
+ * drains the rings to logFile with the timestamp, pid and job of each message.
+ * A full ring drops messages instead of blocking the caller, and repeated or
+ * excessive libav messages (like the warnings of a corrupt stream) are counted
+ * and summarized instead of being written. The messages of the daemon itself
+ * (pktav_log) are never rate limited nor deduplicated.
+ */
+typedef struct {
+    int64_t ts_us;              // CLOCK_REALTIME of the message
+    int     tid;
+    char    msg[LOG_MSG_SIZE];
+} TAVLogEntry;
+
+typedef struct TAVLogRing {
+    uint32_t      head;         // Written by the producer (atomic)
+    uint32_t      tail;         // Written by the writer (atomic)
+    int           dead;         // The thread exited, freed by the writer once empty (atomic)
+    int           busy;         // The producer is writing (reentrancy from a signal handler)
+    int           tid;
+    /* Producer only */
+    char          last_msg[LOG_MSG_SIZE];   // Repeated messages (formatted)
+    int64_t       last_us;
+    int           repeats;
+    int           suppressed;
+    double        tokens;       // Rate limit
+    int64_t       tokens_us;
+    int           rate_dropped;
+    int           ring_dropped; // Full ring
+    struct TAVLogRing *next;
+    TAVLogEntry   entries[LOG_RING_SLOTS];
+} TAVLogRing;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;   // Ring list and writer start only
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static __thread TAVLogRing *log_ring = NULL;
+static TAVLogRing *log_rings = NULL;
+static pthread_t log_writer;
+static int log_writer_running = 0;
+static int log_stop = 0;
+static pid_t log_pid = 0;
+static char log_job[64] = "-";
+
+static int64_t log_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Write the entries of a ring. Only the writer thread (or the exit handler,
+ * once the writer stopped) consumes.
+ */
+static int log_drain(TAVLogRing *r, char *out, size_t size, size_t *len) {
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    TAVLogEntry *e;
+    struct tm tm;
+    time_t sec;
+    int n = 0;
+
+    for (; tail != head; tail++, n++) {
+        e = &r->entries[tail & (LOG_RING_SLOTS - 1)];
+        if (*len + LOG_MSG_SIZE + 128 > size) {
+            fwrite(out, 1, *len, logFile);
+            *len = 0;
+        }
+        sec = e->ts_us / 1000000;
+        gmtime_r(&sec, &tm);
+        *len += strftime(out + *len, size - *len, "[%Y-%m-%d %H:%M:%S", &tm);
+        *len += snprintf(out + *len, size - *len, ".%06d +0000 UTC] Pid: %lu Tid: %d Job: %s - %s", 
+                         (int)(e->ts_us % 1000000), (unsigned long)log_pid, e->tid, log_job, e->msg);
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * Drain all the rings, free the rings of the threads that exited.
+ */
+static int log_drain_all(void) {
+    static char out[1 << 16];
+    TAVLogRing **pr, *r;
+    size_t len = 0;
+    int n = 0;
+
+    pthread_mutex_lock(&log_lock);
+    for (pr = &log_rings; (r = *pr) != NULL; ) {
+        n += log_drain(r, out, sizeof(out), &len);
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) && 
+            __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+            *pr = r->next;
+            free(r);
+        } else {
+            pr = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (len > 0) {
+        fwrite(out, 1, len, logFile);
+        fflush(logFile);
+    }
+    return n;
+}
+
+static void *log_writer_thread(void *arg) {
+    struct timespec idle = { 0, LOG_WRITER_SLEEP_MS * 1000000L };
+
+    while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+        if (log_drain_all() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/* The thread of the ring exited */
+static void log_thread_exit(void *arg) {
+    TAVLogRing *r = arg;
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * After fork the child has no writer thread and the rings hold the messages
+ * of the parent: only the ring of the forking thread is kept (emptied).
+ */
+static void log_atfork_child(void) {
+    pthread_mutex_init(&log_lock, NULL);
+    log_rings = log_ring;
+    if (log_ring) {
+        log_ring->next = NULL;
+        log_ring->head = log_ring->tail = 0;
+    }
+    log_writer_running = 0;
+    log_stop = 0;
+    log_pid = getpid();
+}
+
+static void log_init(void) {
+    log_pid = getpid();
+    pthread_key_create(&log_key, log_thread_exit);
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    atexit(pktav_log_flush);
+}
+
+/*
+ * Start the writer of this process (again after a fork).
+ */
+static void log_start_writer(void) {
+    pthread_mutex_lock(&log_lock);
+    if (!log_writer_running && !log_stop && pthread_create(&log_writer, NULL, log_writer_thread, NULL) == 0)
+        __atomic_store_n(&log_writer_running, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * Ring of the calling thread, created on its first message.
+ */
+static TAVLogRing *log_get_ring(void) {
+    TAVLogRing *r;
 
-        time_t rawtime;
-        struct tm *timeinfo;
-        char buffer[80];
+    if (log_ring)
+        return log_ring;
+    pthread_once(&log_once, log_init);
+    if ((r = calloc(1, sizeof(TAVLogRing))) == NULL)
+        return NULL;
+    r->tid = (int)syscall(SYS_gettid);
+    r->tokens = LOG_RATE_BURST;
+    pthread_setspecific(log_key, r);
 
-        time(&rawtime);
-        timeinfo = gmtime(&rawtime);
+    pthread_mutex_lock(&log_lock);
+    r->next = log_rings;
+    log_rings = r;
+    pthread_mutex_unlock(&log_lock);
+    log_ring = r;
+    return r;
+}
+
+/*
+ * Queue a message, dropped if the ring is full.
+ */
+static void log_push(TAVLogRing *r, int64_t now_us, const char *fmt, va_list vl) {
+    uint32_t head = r->head;
+    TAVLogEntry *e;
+
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        r->ring_dropped++;
+        return;
+    }
+    e = &r->entries[head & (LOG_RING_SLOTS - 1)];
+    e->ts_us = now_us;
+    e->tid = r->tid;
+    vsnprintf(e->msg, LOG_MSG_SIZE, fmt, vl);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void log_pushf(TAVLogRing *r, int64_t now_us, const char *fmt, ...) {
+    va_list vl;
+    va_start(vl, fmt);
+    log_push(r, now_us, fmt, vl);
+    va_end(vl);
+}
+
+/*
+ * Synchronous write: messages of a signal handler that interrupted the thread
+ * while it was queuing a message, without a ring, or after the writer stopped.
+ */
+static void log_direct(const char *fmt, va_list vl) {
+    char buffer[LOG_MSG_SIZE + 128];
+    int64_t now_us = log_now_us();
+    time_t sec = now_us / 1000000;
+    struct tm tm;
+    size_t len;
+
+    gmtime_r(&sec, &tm);
+    len = strftime(buffer, sizeof(buffer), "[%Y-%m-%d %H:%M:%S", &tm);
+    len += snprintf(buffer + len, sizeof(buffer) - len, ".%06d +0000 UTC] Pid: %lu Tid: %d Job: %s - ", 
+                    (int)(now_us % 1000000), (unsigned long)getpid(), (int)syscall(SYS_gettid), log_job);
+    vsnprintf(buffer + len, sizeof(buffer) - len, fmt, vl);
+    if (write(fileno(logFile), buffer, strlen(buffer)) < 0)
+        return;
+}
+
+/*
+ * Queue a message of the calling thread. With limit (libav messages) the
+ * repeated messages (same text in a row) and the excess over the rate limit
+ * are counted instead of queued.
+ */
+static void log_message(int limit, const char *fmt, va_list vl) {
+    char msg[LOG_MSG_SIZE];
+    TAVLogRing *r;
+    int64_t now_us;
+
+    if ((r = log_get_ring()) == NULL || r->busy || __atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+        log_direct(fmt, vl);
+        return;
+    }
+    r->busy = 1;
+    if (!__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE))
+        log_start_writer();
+    now_us = log_now_us();
+    if (!limit) {
+        log_push(r, now_us, fmt, vl);
+        goto done;
+    }
+    vsnprintf(msg, sizeof(msg), fmt, vl);
 
-        strftime(buffer, sizeof(buffer), "[%Y-%m-%d %H:%M:%S.000000 +0000 UTC]", timeinfo);
-        fprintf(logFile, "%s Pid: %lu - ", buffer, (unsigned long) id);
-        vfprintf(logFile, fmt, vl);
+    /* Repeated messages: the same text in a row */
+    if (strcmp(msg, r->last_msg) == 0 && now_us - r->last_us < LOG_REPEAT_WINDOW_US) {
+        r->last_us = now_us;
+        if (++r->repeats > LOG_REPEAT_MAX) {
+            r->suppressed++;
+            goto done;
+        }
+    } else {
+        if (r->suppressed > 0)
+            log_pushf(r, now_us, "Last message repeated %d more times\n", r->suppressed);
+        memcpy(r->last_msg, msg, sizeof(msg));
+        r->last_us = now_us;
+        r->repeats = 1;
+        r->suppressed = 0;
     }
+    /* Rate limit: token bucket per thread, the repeated messages are not counted */
+    r->tokens += (now_us - r->tokens_us) * (LOG_RATE_PER_S / 1e6);
+    if (r->tokens > LOG_RATE_BURST)
+        r->tokens = LOG_RATE_BURST;
+    r->tokens_us = now_us;
+    if (r->tokens < 1) {
+        r->rate_dropped++;
+        goto done;
+    }
+    r->tokens--;
+
+    if (r->rate_dropped > 0 || r->ring_dropped > 0) {
+        log_pushf(r, now_us, "%d messages dropped (rate limit), %d dropped (ring full)\n", r->rate_dropped, r->ring_dropped);
+        r->rate_dropped = r->ring_dropped = 0;
+    }
+    log_pushf(r, now_us, "%s", msg);
+
+done:
+    r->busy = 0;
+}
+
+void pktav_log_callback(void* ptr, int level, const char* fmt, va_list vl) {
+    if (level > av_log_get_level())
+        return;
+    log_message(1, fmt, vl);
 }
 
 void pktav_log(void *ptr, int level, const char* fmt, ...) {
     va_list args;
+
+    if (level > av_log_get_level())
+        return;
     va_start(args, fmt);
-    pktav_log_callback(NULL, level, fmt, args);
+    log_message(0, fmt, args);
     va_end(args);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Set the job id written with every message of this process.
+ *
+ * @param job_id Id of the job (the client job_id), truncated to 63 characters.
+ */
+void pktav_log_set_job(const char *job_id) {
+    snprintf(log_job, sizeof(log_job), "%s", job_id && job_id[0] ? job_id : "-");
+}
+
+/**
+ * @brief Stop the writer thread and write the queued messages. Called at exit.
+ */
+void pktav_log_flush(void) {
+    pthread_mutex_lock(&log_lock);
+    __atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&log_lock);
+    if (log_writer_running) {
+        pthread_join(log_writer, NULL);
+        log_writer_running = 0;
+    }
+    log_drain_all();
+}
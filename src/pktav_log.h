@@ -6,7 +6,17 @@
 
 #define logFile stderr
 
+#define LOG_RING_SLOTS       128        // Messages queued per thread (power of 2)
+#define LOG_MSG_SIZE         368        // Longer messages are truncated
+#define LOG_WRITER_SLEEP_MS  10         // The writer drains the rings every 10 ms when idle
+#define LOG_REPEAT_MAX       3          // Same libav message (text) logged at most 3 times...
+#define LOG_REPEAT_WINDOW_US 1000000    // ...in a row within 1 s, the rest are counted
+#define LOG_RATE_PER_S       200        // libav messages per second and thread (token bucket)
+#define LOG_RATE_BURST       400
+
 extern void pktav_log_callback(void* ptr, int level, const char* fmt, va_list vl);
 
 extern void pktav_log(void *ptr, int level, const char* fmt, ...);
-#endif
\ No newline at end of file
+extern void pktav_log_set_job(const char *job_id);
+extern void pktav_log_flush(void);
+#endif
@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <libavutil/mem.h>
+#include <libavutil/samplefmt.h>
+#include "pktav_loudness.h"
+
+#define LOUDNESS_HIST_MIN    -70.0
+#define LOUDNESS_HIST_STEP   0.1
+#define LOUDNESS_ABS_GATE    -70.0
+#define LOUDNESS_REL_GATE    -10.0   // Integrated loudness
+#define LOUDNESS_LRA_GATE    -20.0   // Loudness range
+
+static double energy_to_lufs(double energy) {
+    return -0.691 + 10.0 * log10(energy);
+}
+
+static double lufs_to_energy(double lufs) {
+    return pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+static int lufs_to_bin(double lufs) {
+    int bin = (int)((lufs - LOUDNESS_HIST_MIN) / LOUDNESS_HIST_STEP);
+    return bin < 0 ? 0 : bin >= LOUDNESS_HIST_BINS ? LOUDNESS_HIST_BINS - 1 : bin;
+}
+
+static double bin_to_lufs(int bin) {
+    return LOUDNESS_HIST_MIN + (bin + 0.5) * LOUDNESS_HIST_STEP;
+}
+
+/*
+ * K-weighting filters of BS.1770 for any sample rate (same coefficients as
+ * the 48 kHz ones of the recommendation).
+ */
+static void pktav_loudness_filters(TAVLoudness *meter) {
+    double f0 = 1681.974450955533, G = 3.999843853973347, Q = 0.7071752369554196;
+    double K = tan(M_PI * f0 / meter->sample_rate);
+    double Vh = pow(10.0, G / 20.0);
+    double Vb = pow(Vh, 0.4996667741545416);
+    double a0 = 1.0 + K / Q + K * K;
+
+    meter->pre_b[0] = (Vh + Vb * K / Q + K * K) / a0;
+    meter->pre_b[1] = 2.0 * (K * K - Vh) / a0;
+    meter->pre_b[2] = (Vh - Vb * K / Q + K * K) / a0;
+    meter->pre_a[0] = 1.0;
+    meter->pre_a[1] = 2.0 * (K * K - 1.0) / a0;
+    meter->pre_a[2] = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q  = 0.5003270373238773;
+    K  = tan(M_PI * f0 / meter->sample_rate);
+    a0 = 1.0 + K / Q + K * K;
+
+    meter->rlb_b[0] = 1.0;
+    meter->rlb_b[1] = -2.0;
+    meter->rlb_b[2] = 1.0;
+    meter->rlb_a[0] = 1.0;
+    meter->rlb_a[1] = 2.0 * (K * K - 1.0) / a0;
+    meter->rlb_a[2] = (1.0 - K / Q + K * K) / a0;
+}
+
+/*
+ * True peak: polyphase windowed-sinc interpolator, LOUDNESS_TP_PHASES
+ * phases of LOUDNESS_TP_TAPS taps, every phase with unity gain.
+ */
+static void pktav_loudness_tp_filter(TAVLoudness *meter) {
+    int n = LOUDNESS_TP_PHASES * LOUDNESS_TP_TAPS;
+    double center = (n - 1) / 2.0, x, sum;
+    int p, k, i;
+
+    for (p = 0; p < LOUDNESS_TP_PHASES; p++) {
+        sum = 0;
+        for (k = 0; k < LOUDNESS_TP_TAPS; k++) {
+            i = p + k * LOUDNESS_TP_PHASES;
+            x = (i - center) / LOUDNESS_TP_PHASES;
+            meter->tp_coef[p][k] = (float)((x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x)) *
+                                           (0.5 - 0.5 * cos(2.0 * M_PI * (i + 0.5) / n)));
+            sum += meter->tp_coef[p][k];
+        }
+        for (k = 0; k < LOUDNESS_TP_TAPS; k++)
+            meter->tp_coef[p][k] /= sum;
+    }
+}
+
+/**
+ * @brief Initialize a loudness meter.
+ *
+ * @param meter Pointer to the TAVLoudness structure to be initialized.
+ * @param layout Channel layout of the frames (used for the channel weights).
+ * @param sample_rate Sample rate of the frames.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+int pktav_loudness_init(TAVLoudness *meter, const AVChannelLayout *layout, int sample_rate) {
+    enum AVChannel channel;
+    int i;
+
+    memset(meter, 0, sizeof(TAVLoudness));
+    if (layout->nb_channels <= 0 || sample_rate <= 0)
+        return AVERROR(EINVAL);
+
+    meter->channels = layout->nb_channels;
+    meter->sample_rate = sample_rate;
+    meter->samples_100ms = (sample_rate + 5) / 10;
+
+    meter->weight = av_calloc(meter->channels, sizeof(double));
+    meter->state  = av_calloc(meter->channels * 4, sizeof(double));
+    meter->tp_history = av_calloc(meter->channels * 2 * LOUDNESS_TP_TAPS, sizeof(double));
+    meter->tp_pos = av_calloc(meter->channels, sizeof(int));
+    if (!meter->weight || !meter->state || !meter->tp_history || !meter->tp_pos) {
+        pktav_loudness_close(meter);
+        return AVERROR(ENOMEM);
+    }
+
+    /* BS.1770: LFE is not measured, the surround channels weight +1.5 dB */
+    for (i = 0; i < meter->channels; i++) {
+        channel = av_channel_layout_channel_from_index(layout, i);
+        if (channel == AV_CHAN_LOW_FREQUENCY || channel == AV_CHAN_LOW_FREQUENCY_2)
+            meter->weight[i] = 0.0;
+        else if (channel == AV_CHAN_SIDE_LEFT || channel == AV_CHAN_SIDE_RIGHT ||
+                 channel == AV_CHAN_BACK_LEFT || channel == AV_CHAN_BACK_RIGHT)
+            meter->weight[i] = 1.41;
+        else
+            meter->weight[i] = 1.0;
+    }
+
+    pktav_loudness_filters(meter);
+    pktav_loudness_tp_filter(meter);
+    return 0;
+}
+
+/*
+ * Copy the samples of a frame (any sample format) as planar float.
+ */
+static int pktav_loudness_convert(TAVLoudness *meter, const AVFrame *frame) {
+    enum AVSampleFormat fmt = av_get_packed_sample_fmt(frame->format);
+    int planar = av_sample_fmt_is_planar(frame->format);
+    int n = frame->nb_samples, ch, i, src_ch, step;
+    const uint8_t *src;
+    float *dst;
+
+    if (meter->samples_size < n) {
+        av_freep(&meter->samples);
+        if ((meter->samples = av_malloc_array((size_t)n * meter->channels, sizeof(float))) == NULL)
+            return AVERROR(ENOMEM);
+        meter->samples_size = n;
+    }
+
+    for (ch = 0; ch < meter->channels; ch++) {
+        src    = frame->extended_data[planar ? ch : 0];
+        src_ch = planar ? 0 : ch;
+        step   = planar ? 1 : meter->channels;
+        dst    = meter->samples + (size_t)ch * n;
+
+        switch (fmt) {
+        case AV_SAMPLE_FMT_U8:
+            for (i = 0; i < n; i++)
+                dst[i] = (src[i * step + src_ch] - 128) * (1.0f / 128);
+            break;
+        case AV_SAMPLE_FMT_S16:
+            for (i = 0; i < n; i++)
+                dst[i] = ((const int16_t *)src)[i * step + src_ch] * (1.0f / 32768);
+            break;
+        case AV_SAMPLE_FMT_S32:
+            for (i = 0; i < n; i++)
+                dst[i] = ((const int32_t *)src)[i * step + src_ch] * (1.0f / 2147483648.0f);
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            for (i = 0; i < n; i++)
+                dst[i] = ((const float *)src)[i * step + src_ch];
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            for (i = 0; i < n; i++)
+                dst[i] = (float)((const double *)src)[i * step + src_ch];
+            break;
+        default:
+            return AVERROR(ENOSYS);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Filter and accumulate the energy of `n` samples of every channel, starting at `offset`.
+ */
+static void pktav_loudness_accumulate(TAVLoudness *meter, int offset, int n, int frame_samples) {
+    double b0 = meter->pre_b[0], b1 = meter->pre_b[1], b2 = meter->pre_b[2];
+    double a1 = meter->pre_a[1], a2 = meter->pre_a[2];
+    double r1 = meter->rlb_a[1], r2 = meter->rlb_a[2];
+    double x, y, z, sum;
+    double *s;
+    const float *in;
+    int ch, i;
+
+    for (ch = 0; ch < meter->channels; ch++) {
+        if (meter->weight[ch] == 0.0)
+            continue;
+        in  = meter->samples + (size_t)ch * frame_samples + offset;
+        s   = meter->state + ch * 4;
+        sum = 0;
+        for (i = 0; i < n; i++) {
+            /* Direct form II transposed, shelf then high pass */
+            x    = in[i];
+            y    = b0 * x + s[0];
+            s[0] = b1 * x - a1 * y + s[1];
+            s[1] = b2 * x - a2 * y;
+            z    = y + s[2];
+            s[2] = -2.0 * y - r1 * z + s[3];
+            s[3] = y - r2 * z;
+            sum += z * z;
+        }
+        meter->sub_sum += meter->weight[ch] * sum;
+    }
+}
+
+/*
+ * End of a 100 ms sub-block: update the 400 ms (integrated) and 3 s (range) blocks.
+ */
+static void pktav_loudness_sub_block(TAVLoudness *meter) {
+    double energy = 0;
+    int i, n, bin;
+
+    meter->sub_energy[meter->sub_count % 30] = meter->sub_sum / meter->samples_100ms;
+    meter->sub_count++;
+    meter->sub_sum = 0;
+    meter->sub_samples = 0;
+
+    if (meter->sub_count >= 4) {
+        for (i = 1; i <= 4; i++)
+            energy += meter->sub_energy[(meter->sub_count - i) % 30];
+        energy /= 4;
+        if (energy > 0 && energy_to_lufs(energy) >= LOUDNESS_ABS_GATE) {
+            bin = lufs_to_bin(energy_to_lufs(energy));
+            meter->block_energy[bin] += energy;
+            meter->block_count[bin]++;
+        }
+    }
+
+    if (meter->sub_count >= 30) {
+        energy = 0;
+        for (n = 0; n < 30; n++)
+            energy += meter->sub_energy[n];
+        energy /= 30;
+        if (energy > 0 && energy_to_lufs(energy) >= LOUDNESS_ABS_GATE) {
+            meter->st_count[lufs_to_bin(energy_to_lufs(energy))]++;
+            meter->st_energy += energy;
+            meter->st_total++;
+        }
+    }
+}
+
+/*
+ * True peak of `n` samples of every channel.
+ */
+static void pktav_loudness_true_peak_update(TAVLoudness *meter, int n) {
+    double peak = meter->peak, v;
+    double *h;
+    const float *in;
+    int ch, i, p, k, pos;
+
+    for (ch = 0; ch < meter->channels; ch++) {
+        in  = meter->samples + (size_t)ch * n;
+        h   = meter->tp_history + ch * 2 * LOUDNESS_TP_TAPS;
+        pos = meter->tp_pos[ch];
+        for (i = 0; i < n; i++) {
+            pos = (pos + 1) % LOUDNESS_TP_TAPS;
+            h[pos] = h[pos + LOUDNESS_TP_TAPS] = in[i];
+            for (p = 0; p < LOUDNESS_TP_PHASES; p++) {
+                v = 0;
+                for (k = 0; k < LOUDNESS_TP_TAPS; k++)
+                    v += meter->tp_coef[p][k] * h[pos + LOUDNESS_TP_TAPS - k];
+                v = fabs(v);
+                if (v > peak)
+                    peak = v;
+            }
+        }
+        meter->tp_pos[ch] = pos;
+    }
+    meter->peak = peak;
+}
+
+/**
+ * @brief Measure a decoded audio frame.
+ *
+ * @param meter Pointer to the TAVLoudness structure.
+ * @param frame Pointer to the decoded AVFrame, with the layout and sample rate of the meter.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+int pktav_loudness_add(TAVLoudness *meter, const AVFrame *frame) {
+    int offset = 0, n, error;
+
+    if (frame->ch_layout.nb_channels != meter->channels)
+        return AVERROR(EINVAL);
+    if ((error = pktav_loudness_convert(meter, frame)) < 0)
+        return error;
+
+    while (offset < frame->nb_samples) {
+        n = FFMIN(frame->nb_samples - offset, meter->samples_100ms - meter->sub_samples);
+        pktav_loudness_accumulate(meter, offset, n, frame->nb_samples);
+        meter->sub_samples += n;
+        offset += n;
+        if (meter->sub_samples == meter->samples_100ms)
+            pktav_loudness_sub_block(meter);
+    }
+
+    pktav_loudness_true_peak_update(meter, frame->nb_samples);
+    return 0;
+}
+
+/**
+ * @brief Get the integrated loudness (gated, BS.1770-4).
+ *
+ * @return Returns the integrated loudness in LUFS, or -HUGE_VAL if nothing was measured above the absolute gate.
+ */
+double pktav_loudness_integrated(TAVLoudness *meter) {
+    double energy = 0, gate;
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < LOUDNESS_HIST_BINS; i++) {
+        energy += meter->block_energy[i];
+        count  += meter->block_count[i];
+    }
+    if (count == 0)
+        return -HUGE_VAL;
+
+    gate = energy_to_lufs(energy / count) + LOUDNESS_REL_GATE;
+    energy = 0;
+    count  = 0;
+    for (i = lufs_to_bin(gate); i < LOUDNESS_HIST_BINS; i++) {
+        energy += meter->block_energy[i];
+        count  += meter->block_count[i];
+    }
+    return count > 0 ? energy_to_lufs(energy / count) : -HUGE_VAL;
+}
+
+/**
+ * @brief Get the loudness range (EBU Tech 3342).
+ *
+ * @return Returns the loudness range in LU (distance between the 10th and the 95th percentiles of
+ *         the gated short-term loudness).
+ */
+double pktav_loudness_range(TAVLoudness *meter) {
+    uint64_t count = 0, low_pos, high_pos, seen = 0;
+    int i, start, low = -1, high = -1;
+
+    if (meter->st_total == 0)
+        return 0;
+
+    start = lufs_to_bin(energy_to_lufs(meter->st_energy / meter->st_total) + LOUDNESS_LRA_GATE);
+    for (i = start; i < LOUDNESS_HIST_BINS; i++)
+        count += meter->st_count[i];
+    if (count == 0)
+        return 0;
+
+    low_pos  = (uint64_t)(count * 0.10);
+    high_pos = (uint64_t)(count * 0.95);
+    for (i = start; i < LOUDNESS_HIST_BINS && high < 0; i++) {
+        seen += meter->st_count[i];
+        if (low < 0 && seen > low_pos)
+            low = i;
+        if (seen > high_pos)
+            high = i;
+    }
+    if (high < 0)
+        high = LOUDNESS_HIST_BINS - 1;
+    return bin_to_lufs(high) - bin_to_lufs(low);
+}
+
+/**
+ * @brief Get the true peak (4x oversampled).
+ *
+ * @return Returns the true peak in dBTP, or -HUGE_VAL for digital silence.
+ */
+double pktav_loudness_true_peak(TAVLoudness *meter) {
+    return meter->peak > 0 ? 20.0 * log10(meter->peak) : -HUGE_VAL;
+}
+
+/**
+ * @brief Free all the resources of a loudness meter.
+ */
+void pktav_loudness_close(TAVLoudness *meter) {
+    av_freep(&meter->weight);
+    av_freep(&meter->state);
+    av_freep(&meter->samples);
+    av_freep(&meter->tp_history);
+    av_freep(&meter->tp_pos);
+    meter->samples_size = 0;
+}
+
+/**
+ * @brief Apply a gain to a decoded audio frame.
+ *
+ * @param frame Pointer to the decoded AVFrame. It is made writable if it is shared.
+ * @param gain_db Gain in dB.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note The integer formats are clipped.
+ */
+int pktav_audio_apply_gain(AVFrame *frame, double gain_db) {
+    enum AVSampleFormat fmt = av_get_packed_sample_fmt(frame->format);
+    int planes = av_sample_fmt_is_planar(frame->format) ? frame->ch_layout.nb_channels : 1;
+    int n = frame->nb_samples * (planes == 1 ? frame->ch_layout.nb_channels : 1);
+    float gain = (float)pow(10.0, gain_db / 20.0);
+    double dgain = pow(10.0, gain_db / 20.0);
+    int p, i, error;
+
+    if ((error = av_frame_make_writable(frame)) < 0)
+        return error;
+
+    for (p = 0; p < planes; p++) {
+        uint8_t *data = frame->extended_data[p];
+        switch (fmt) {
+        case AV_SAMPLE_FMT_U8:
+            for (i = 0; i < n; i++)
+                data[i] = av_clip_uint8((int)lrintf((data[i] - 128) * gain) + 128);
+            break;
+        case AV_SAMPLE_FMT_S16:
+            for (i = 0; i < n; i++)
+                ((int16_t *)data)[i] = av_clip_int16((int)lrintf(((int16_t *)data)[i] * gain));
+            break;
+        case AV_SAMPLE_FMT_S32:
+            for (i = 0; i < n; i++)
+                ((int32_t *)data)[i] = av_clipl_int32(llrint(((int32_t *)data)[i] * dgain));
+            break;
+        case AV_SAMPLE_FMT_FLT:
+            for (i = 0; i < n; i++)
+                ((float *)data)[i] *= gain;
+            break;
+        case AV_SAMPLE_FMT_DBL:
+            for (i = 0; i < n; i++)
+                ((double *)data)[i] *= dgain;
+            break;
+        default:
+            return AVERROR(ENOSYS);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _PKTAV_LOUDNESS_H
+#define _PKTAV_LOUDNESS_H 1
+
+#include <stdint.h>
+#include <libavutil/frame.h>
+#include <libavutil/channel_layout.h>
+
+#define LOUDNESS_HIST_BINS  1000    // 0.1 LU bins from -70 to +30 LUFS
+#define LOUDNESS_TP_PHASES  4       // True peak: 4x oversampling
+#define LOUDNESS_TP_TAPS    12      // True peak: taps per phase
+
+/*
+ * Streaming EBU R128 (ITU-R BS.1770-4) loudness meter: integrated loudness,
+ * loudness range and true peak. The gating blocks are kept in histograms, so
+ * the memory does not grow with the length of the input.
+ */
+typedef struct TAVLoudness {
+    int      channels;
+    int      sample_rate;
+    int      samples_100ms;                 // Samples in a 100 ms sub-block
+    double   pre_b[3], pre_a[3];            // K-weighting: high shelf
+    double   rlb_b[3], rlb_a[3];            // K-weighting: high pass (RLB)
+    double   *weight;                       // Weight of every channel (0 for LFE)
+    double   *state;                        // Filter state, 4 values per channel
+    float    *samples;                      // Planar float copy of the frame
+    int      samples_size;                  // Samples per channel in `samples`
+    double   *tp_history;                   // True peak: last samples of every channel (twice)
+    int      *tp_pos;
+    float    tp_coef[LOUDNESS_TP_PHASES][LOUDNESS_TP_TAPS];
+    double   peak;                          // True peak (linear)
+    double   sub_sum;                       // Energy of the current sub-block
+    int      sub_samples;                   // Samples in the current sub-block
+    double   sub_energy[30];                // Last 3 s of sub-blocks
+    int64_t  sub_count;                     // Sub-blocks completed
+    double   block_energy[LOUDNESS_HIST_BINS]; // Integrated: energy of the 400 ms blocks in every bin
+    uint64_t block_count[LOUDNESS_HIST_BINS];
+    uint64_t st_count[LOUDNESS_HIST_BINS];  // Loudness range: 3 s blocks in every bin
+    double   st_energy;                     // Loudness range: energy of the 3 s blocks above -70 LUFS
+    uint64_t st_total;
+} TAVLoudness;
+
+extern int    pktav_loudness_init(TAVLoudness *meter, const AVChannelLayout *layout, int sample_rate);
+extern int    pktav_loudness_add(TAVLoudness *meter, const AVFrame *frame);
+extern double pktav_loudness_integrated(TAVLoudness *meter);
+extern double pktav_loudness_range(TAVLoudness *meter);
+extern double pktav_loudness_true_peak(TAVLoudness *meter);
+extern void   pktav_loudness_close(TAVLoudness *meter);
+extern int    pktav_audio_apply_gain(AVFrame *frame, double gain_db);
+
+#endif
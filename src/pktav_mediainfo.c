@@ -136,6 +136,13 @@ int pktav_extract_mediainfo_from_file(const char *filename, TAVInfo **mi) {
         double duration = 0;
         int audio_pkts  = 0;
         int video_pkts  = 0;
+        int i;
+
+        /* Only the packets of the first audio and video streams are counted */
+        for (i = 0; i < fmt->nb_streams; i++) {
+            if (i != (*mi)->video_index && i != (*mi)->audio_index)
+                fmt->streams[i]->discard = AVDISCARD_ALL;
+        }
         ret = pktav_count_packets(fmt, (*mi)->video_index, (*mi)->audio_index, &duration, &audio_pkts, &video_pkts);
         if (ret >= 0) {
             (*mi)->audio_packets = audio_pkts;
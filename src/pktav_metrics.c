@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "pktav_metrics.h"
+#include "pktav_netutils.h"
+#include "pktav_error.h"
+#include "pktav_log.h"
+
+static const char *metrics_results[METRICS_RESULTS] = { "finished", "failed", "cancelled", "crashed" };
+static const char *metrics_classes[] = { "live", "paid", "standard", "bulk" };
+static const char *metrics_states[] = { "free", "queued", "running", "paused" };
+
+/* Shared counters (set in the daemon, inherited by the workers) */
+static TAVMetrics *metrics = NULL;
+/* Slot of the job of this worker, NULL until it is submitted */
+static TAVMetricsSlot *metrics_slot = NULL;
+/* Media time of the slot when the job was submitted (speed of the job) */
+static int64_t metrics_media_base = 0;
+
+/* Single writer: a relaxed store is enough, the scraper never sees a torn value */
+#define METRICS_ADD(field, n) \
+    __atomic_store_n(&metrics_slot->field, metrics_slot->field + (n), __ATOMIC_RELAXED)
+
+/**
+ * @brief Create the shared metrics of the daemon.
+ *
+ * @param sched Scheduler of the daemon, the queue depths and the workers are read from it at every scrape.
+ *
+ * @return Returns a pointer to the TAVMetrics, or NULL on failure (pktav_errno is set).
+ *
+ * @note Must be called in the daemon before forking the workers.
+ */
+TAVMetrics *pktav_metrics_create(TAVScheduler *sched) {
+    TAVMetrics *m;
+
+    m = mmap(NULL, sizeof(TAVMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        pktav_errno = errno;
+        return NULL;
+    }
+    memset(m, 0, sizeof(TAVMetrics));
+    m->sched = sched;
+    metrics = m;
+
+    pktav_errno = 0;
+    return m;
+}
+
+/**
+ * @brief Open the listener of the metrics endpoint.
+ *
+ * @param address Path of a Unix socket, or a TCP port (only numbers) bound to the loopback.
+ *
+ * @return Returns the socket descriptor, or -OS_ERROR on failure (pktav_errno is set).
+ */
+int pktav_metrics_listener(const char *address) {
+    if (address[0] != '\0' && strspn(address, "0123456789") == strlen(address))
+        return tcp_listener(atoi(address));
+    return unix_listener(address);
+}
+
+/**
+ * @brief Set the scheduler slot of the job of this worker, its counters are updated from now on.
+ *
+ * @param slot Slot returned by pktav_sched_submit().
+ */
+void pktav_metrics_job(int slot) {
+    if (!metrics || slot < 0 || slot >= SCHED_MAX_JOBS)
+        return;
+    metrics_slot = &metrics->slots[slot];
+    metrics_media_base = metrics_slot->media_us;
+    __atomic_store_n(&metrics_slot->speed_milli, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics->jobs_submitted, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count the end of a job.
+ *
+ * @param result METRICS_FINISHED, METRICS_FAILED, METRICS_CANCELLED or METRICS_CRASHED.
+ *
+ * @note Async-signal-safe, METRICS_CRASHED is counted in the SIGCHLD handler of the daemon.
+ */
+void pktav_metrics_result(int result) {
+    if (!metrics || result < 0 || result >= METRICS_RESULTS)
+        return;
+    __atomic_fetch_add(&metrics->jobs[result], 1, __ATOMIC_RELAXED);
+}
+
+void pktav_metrics_probe(long time_ms) {
+    if (!metrics)
+        return;
+    __atomic_fetch_add(&metrics->probes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics->probe_ms, time_ms, __ATOMIC_RELAXED);
+}
+
+void pktav_metrics_read(int64_t bytes) {
+    if (!metrics_slot)
+        return;
+    METRICS_ADD(bytes_read, bytes);
+}
+
+/**
+ * @brief Count a packet produced by an encoder.
+ *
+ * @param video The packet is video (otherwise audio).
+ * @param bytes Size of the packet.
+ * @param duration_us Media time of the packet (video only, 0 for audio).
+ */
+void pktav_metrics_encoded(int video, int64_t bytes, int64_t duration_us) {
+    if (!metrics_slot)
+        return;
+    if (video) {
+        METRICS_ADD(frames_video, 1);
+        METRICS_ADD(media_us, duration_us);
+    } else {
+        METRICS_ADD(frames_audio, 1);
+    }
+    METRICS_ADD(bytes_encoded, bytes);
+}
+
+/**
+ * @brief Update the encode speed of the job: media time encoded since the submission over the run time.
+ *
+ * @param run_ms Time the job has been running (without the pauses).
+ */
+void pktav_metrics_speed(long run_ms) {
+    if (!metrics_slot || run_ms <= 0)
+        return;
+    __atomic_store_n(&metrics_slot->speed_milli, (metrics_slot->media_us - metrics_media_base) / run_ms, 
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * Resident memory of a worker (/proc/<pid>/statm), -1 if it is gone.
+ */
+static int64_t metrics_rss(pid_t pid) {
+    char path[64];
+    long size, resident;
+    FILE *fp;
+    int ret;
+
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    ret = fscanf(fp, "%ld %ld", &size, &resident);
+    fclose(fp);
+    return ret == 2 ? (int64_t)resident * sysconf(_SC_PAGESIZE) : -1;
+}
+
+static void metrics_printf(char *buffer, size_t *len, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (*len >= METRICS_BUFFER_SIZE - 1)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(buffer + *len, METRICS_BUFFER_SIZE - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *len = *len + n < METRICS_BUFFER_SIZE - 1 ? *len + n : METRICS_BUFFER_SIZE - 1;
+}
+
+/*
+ * Prometheus text format (0.0.4) of the counters and of the scheduler. The
+ * counters of the slots are summed, the scheduler is read without its lock:
+ * a scrape may see a job in the middle of a state change, never a torn value.
+ */
+static size_t metrics_render(char *buffer) {
+    TAVScheduler *s = metrics->sched;
+    int64_t frames_video = 0, frames_audio = 0, bytes_read = 0, bytes_encoded = 0, media_us = 0;
+    int jobs[4][4];
+    double capacity, used;
+    size_t len = 0;
+    int i, j, state, priority;
+
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < SCHED_MAX_JOBS; i++) {
+        TAVMetricsSlot *slot = &metrics->slots[i];
+        frames_video += __atomic_load_n(&slot->frames_video, __ATOMIC_RELAXED);
+        frames_audio += __atomic_load_n(&slot->frames_audio, __ATOMIC_RELAXED);
+        bytes_read += __atomic_load_n(&slot->bytes_read, __ATOMIC_RELAXED);
+        bytes_encoded += __atomic_load_n(&slot->bytes_encoded, __ATOMIC_RELAXED);
+        media_us += __atomic_load_n(&slot->media_us, __ATOMIC_RELAXED);
+
+        state = __atomic_load_n(&s->jobs[i].state, __ATOMIC_RELAXED);
+        priority = __atomic_load_n(&s->jobs[i].priority, __ATOMIC_RELAXED);
+        if (state > SCHED_FREE && state <= SCHED_PAUSED && priority >= 0 && priority <= SCHED_CLASS_BULK)
+            jobs[state][priority]++;
+    }
+
+    metrics_printf(buffer, &len, "# HELP pktav_jobs_submitted_total Jobs accepted by the scheduler.\n"
+                                 "# TYPE pktav_jobs_submitted_total counter\n"
+                                 "pktav_jobs_submitted_total %" PRId64 "\n",
+                   __atomic_load_n(&metrics->jobs_submitted, __ATOMIC_RELAXED));
+
+    metrics_printf(buffer, &len, "# HELP pktav_jobs_total Jobs ended, by result.\n"
+                                 "# TYPE pktav_jobs_total counter\n");
+    for (i = 0; i < METRICS_RESULTS; i++)
+        metrics_printf(buffer, &len, "pktav_jobs_total{result=\"%s\"} %" PRId64 "\n", metrics_results[i],
+                       __atomic_load_n(&metrics->jobs[i], __ATOMIC_RELAXED));
+
+    metrics_printf(buffer, &len, "# HELP pktav_jobs Jobs in the scheduler, by state and priority class.\n"
+                                 "# TYPE pktav_jobs gauge\n");
+    for (i = SCHED_QUEUED; i <= SCHED_PAUSED; i++) {
+        for (j = SCHED_CLASS_LIVE; j <= SCHED_CLASS_BULK; j++)
+            metrics_printf(buffer, &len, "pktav_jobs{state=\"%s\",class=\"%s\"} %d\n", metrics_states[i],
+                           metrics_classes[j], jobs[i][j]);
+    }
+
+    __atomic_load(&s->capacity, &capacity, __ATOMIC_RELAXED);
+    __atomic_load(&s->used, &used, __ATOMIC_RELAXED);
+    metrics_printf(buffer, &len, "# HELP pktav_sched_capacity_cores Cores available for the jobs.\n"
+                                 "# TYPE pktav_sched_capacity_cores gauge\n"
+                                 "pktav_sched_capacity_cores %g\n"
+                                 "# HELP pktav_sched_used_cores Estimated cores of the running jobs.\n"
+                                 "# TYPE pktav_sched_used_cores gauge\n"
+                                 "pktav_sched_used_cores %g\n", capacity, used);
+
+    metrics_printf(buffer, &len, "# HELP pktav_frames_encoded_total Frames encoded.\n"
+                                 "# TYPE pktav_frames_encoded_total counter\n"
+                                 "pktav_frames_encoded_total{stream=\"video\"} %" PRId64 "\n"
+                                 "pktav_frames_encoded_total{stream=\"audio\"} %" PRId64 "\n"
+                                 "# HELP pktav_read_bytes_total Input bytes demuxed.\n"
+                                 "# TYPE pktav_read_bytes_total counter\n"
+                                 "pktav_read_bytes_total %" PRId64 "\n"
+                                 "# HELP pktav_encoded_bytes_total Bytes produced by the encoders.\n"
+                                 "# TYPE pktav_encoded_bytes_total counter\n"
+                                 "pktav_encoded_bytes_total %" PRId64 "\n"
+                                 "# HELP pktav_media_seconds_total Media time encoded, its rate is the aggregate speed (x realtime).\n"
+                                 "# TYPE pktav_media_seconds_total counter\n"
+                                 "pktav_media_seconds_total %.3f\n",
+                   frames_video, frames_audio, bytes_read, bytes_encoded, media_us / 1000000.0);
+
+    metrics_printf(buffer, &len, "# HELP pktav_probe_duration_seconds Complexity probes of the inputs.\n"
+                                 "# TYPE pktav_probe_duration_seconds summary\n"
+                                 "pktav_probe_duration_seconds_sum %.3f\n"
+                                 "pktav_probe_duration_seconds_count %" PRId64 "\n",
+                   __atomic_load_n(&metrics->probe_ms, __ATOMIC_RELAXED) / 1000.0,
+                   __atomic_load_n(&metrics->probes, __ATOMIC_RELAXED));
+
+    /* Workers of the jobs in the scheduler */
+    metrics_printf(buffer, &len, "# HELP pktav_encode_speed Encode speed of the running jobs (x realtime).\n"
+                                 "# TYPE pktav_encode_speed gauge\n");
+    for (i = 0; i < SCHED_MAX_JOBS; i++) {
+        if (__atomic_load_n(&s->jobs[i].state, __ATOMIC_RELAXED) == SCHED_RUNNING)
+            metrics_printf(buffer, &len, "pktav_encode_speed{slot=\"%d\"} %.3f\n", i,
+                           __atomic_load_n(&metrics->slots[i].speed_milli, __ATOMIC_RELAXED) / 1000.0);
+    }
+    metrics_printf(buffer, &len, "# HELP pktav_worker_rss_bytes Resident memory of the workers.\n"
+                                 "# TYPE pktav_worker_rss_bytes gauge\n");
+    for (i = 0; i < SCHED_MAX_JOBS; i++) {
+        pid_t pid = __atomic_load_n(&s->jobs[i].pid, __ATOMIC_RELAXED);
+        int64_t rss;
+
+        state = __atomic_load_n(&s->jobs[i].state, __ATOMIC_RELAXED);
+        if (state == SCHED_FREE || state > SCHED_PAUSED || (rss = metrics_rss(pid)) < 0)
+            continue;
+        metrics_printf(buffer, &len, "pktav_worker_rss_bytes{slot=\"%d\",state=\"%s\"} %" PRId64 "\n", i,
+                       metrics_states[state], rss);
+    }
+
+    return len;
+}
+
+static int metrics_write(int socket, const char *buffer, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(socket, buffer, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Answer a scrape and close the connection.
+ *
+ * An HTTP GET gets an HTTP/1.0 response (Prometheus, curl --unix-socket), any other client (or one that 
+ * sends nothing in METRICS_TIMEOUT_MS) gets the bare text (nc -U, socat).
+ *
+ * @param client Socket descriptor of the scraper, it is closed.
+ *
+ * @note Called in a child forked by the accept loop of the daemon, so waiting for the request and the 
+ *       writes do not delay the jobs. The writes time out after one second, a stuck scraper does not 
+ *       leave the child behind.
+ */
+void pktav_metrics_serve(int client) {
+    static char buffer[METRICS_BUFFER_SIZE];
+    struct timeval tv = { 1, 0 };
+    struct pollfd pfd = { client, POLLIN, 0 };
+    char request[512], header[256];
+    ssize_t n = 0;
+    size_t len;
+    int http = 0;
+
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (poll(&pfd, 1, METRICS_TIMEOUT_MS) > 0 && (n = read(client, request, sizeof(request) - 1)) > 0) {
+        request[n] = '\0';
+        http = strncmp(request, "GET ", 4) == 0;
+    }
+
+    len = metrics_render(buffer);
+    if (http) {
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                         "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                         "Content-Length: %zu\r\n"
+                                         "Connection: close\r\n\r\n", len);
+        if (metrics_write(client, header, strlen(header)) < 0)
+            goto end;
+    }
+    if (metrics_write(client, buffer, len) < 0)
+        pktav_log(NULL, 0, "Metrics scrape not sent: %s\n", strerror(errno));
+end:
+    close(client);
+}
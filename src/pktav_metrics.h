@@ -0,0 +1,57 @@
+#ifndef _PKTAV_METRICS_H
+#define _PKTAV_METRICS_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "pktav_sched.h"
+#include "pktav_types.h"
+
+#define METRICS_BUFFER_SIZE   (64 * 1024)   // Text of one scrape
+#define METRICS_TIMEOUT_MS    100           // Wait for the request of the scraper (HTTP or raw)
+
+/* Result of a job (pktav_jobs_total) */
+#define METRICS_FINISHED   0
+#define METRICS_FAILED     1
+#define METRICS_CANCELLED  2
+#define METRICS_CRASHED    3                // Worker killed by a signal (SIGCHLD)
+#define METRICS_RESULTS    4
+
+/*
+ * Counters of the job that holds a scheduler slot. Only that worker writes
+ * them (plain relaxed stores, no read-modify-write) and they are never reset:
+ * the next job of the slot keeps counting, so they are monotonic for the
+ * scraper. One cache line each, the workers do not share lines.
+ */
+typedef struct {
+    int64_t frames_video;       // Video frames encoded
+    int64_t frames_audio;       // Audio frames encoded
+    int64_t bytes_read;         // Input bytes demuxed
+    int64_t bytes_encoded;      // Bytes produced by the encoders (once, not per output)
+    int64_t media_us;           // Media time encoded (video)
+    int64_t speed_milli;        // Encode speed of the current job (x realtime * 1000), 0 if idle
+} __attribute__((aligned(64))) TAVMetricsSlot;
+
+/*
+ * Daemon metrics, in an anonymous shared mapping created before forking so
+ * every worker updates the same counters without locks.
+ */
+typedef struct {
+    int64_t jobs_submitted;                 // Jobs accepted by the scheduler
+    int64_t jobs[METRICS_RESULTS];          // Jobs ended, by result
+    int64_t probes;                         // Complexity probes
+    int64_t probe_ms;                       // Time spent in the probes
+    TAVScheduler  *sched;                   // Queue depths and workers (read without its lock)
+    TAVMetricsSlot slots[SCHED_MAX_JOBS];
+} TAVMetrics;
+
+extern TAVMetrics *pktav_metrics_create(TAVScheduler *sched);
+extern int  pktav_metrics_listener(const char *address);
+extern void pktav_metrics_serve(int client);
+extern void pktav_metrics_job(int slot);
+extern void pktav_metrics_result(int result);
+extern void pktav_metrics_probe(long time_ms);
+extern void pktav_metrics_read(int64_t bytes);
+extern void pktav_metrics_encoded(int video, int64_t bytes, int64_t duration_us);
+extern void pktav_metrics_speed(long run_ms);
+
+#endif
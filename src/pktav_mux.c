@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+#include "pktav_mux.h"
+#include "pktav_checksum.h"
+#include "pktav_log.h"
+#include "pktav_error.h"
+#include "pktav_trace.h"
+#include "pktav_sched.h"
+
+/**
+ * @brief Initialize a TAVOutput structure for an already opened output context.
+ *
+ * @param out Pointer to the TAVOutput structure to be initialized.
+ * @param config Pointer to the TAVConfigFormat used to open the output.
+ * @param ofc Pointer to the output AVFormatContext (header already written).
+ */
+void pktav_output_init(TAVOutput *out, TAVConfigFormat *config, AVFormatContext *ofc) {
+    memset(out, 0, sizeof(TAVOutput));
+    out->config = config;
+    out->ofc = ofc;
+    out->crc32[0] = CRC32_INIT;
+    out->crc32[1] = CRC32_INIT;
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->cond, NULL);
+}
+
+/**
+ * @brief Take the next packet from the output queue, waiting if the queue is empty.
+ *
+ * @param out Pointer to the TAVOutput structure.
+ *
+ * @return Returns the next packet, or NULL when the queue is empty and no more packets will be queued
+ *         or the output was disabled.
+ */
+static AVPacket *pktav_output_pop(TAVOutput *out) {
+    AVPacket *packet = NULL;
+
+    pthread_mutex_lock(&out->lock);
+    while (out->count == 0 && !out->eof && out->error == 0)
+        pthread_cond_wait(&out->cond, &out->lock);
+
+    if (out->count > 0 && out->error == 0) {
+        packet = out->queue[out->head];
+        out->head = (out->head + 1) % MUX_QUEUE_SIZE;
+        out->count--;
+        pthread_cond_broadcast(&out->cond);
+    }
+    pthread_mutex_unlock(&out->lock);
+    return packet;
+}
+
+/**
+ * @brief Add a packet to the output queue, waiting if the queue is full.
+ *
+ * @param out Pointer to the TAVOutput structure.
+ * @param packet Pointer to the packet. The queue takes the ownership of the packet.
+ *
+ * @return Returns 0 on success, or the error of the output if it was disabled (the packet is freed).
+ */
+static int pktav_output_push(TAVOutput *out, AVPacket *packet) {
+    int error;
+
+    pthread_mutex_lock(&out->lock);
+    while (out->count == MUX_QUEUE_SIZE && out->error == 0)
+        pthread_cond_wait(&out->cond, &out->lock);
+
+    error = out->error;
+    if (error == 0) {
+        out->queue[(out->head + out->count) % MUX_QUEUE_SIZE] = packet;
+        out->count++;
+        pthread_cond_broadcast(&out->cond);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    if (error < 0)
+        av_packet_free(&packet);
+    return error;
+}
+
+/**
+ * @brief Get the error of an output, set by its muxing thread.
+ *
+ * @param out Pointer to the TAVOutput structure.
+ *
+ * @return Returns 0 if the output is alive, or the negative AVERROR code that disabled it.
+ */
+int pktav_output_error(TAVOutput *out) {
+    int error;
+
+    pthread_mutex_lock(&out->lock);
+    error = out->error;
+    pthread_mutex_unlock(&out->lock);
+    return error;
+}
+
+/**
+ * @brief Disable an output after a muxing error and drop its queued packets.
+ *
+ * @param out Pointer to the TAVOutput structure.
+ * @param error The negative AVERROR code returned by the muxer.
+ */
+static void pktav_output_fail(TAVOutput *out, int error) {
+    pthread_mutex_lock(&out->lock);
+    out->error = error;
+    while (out->count > 0) {
+        av_packet_free(&out->queue[out->head]);
+        out->head = (out->head + 1) % MUX_QUEUE_SIZE;
+        out->count--;
+    }
+    pthread_cond_broadcast(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+
+    pktav_log(NULL, 0, "Output %s failed: %s, the job continues with the other outputs\n",
+                       out->config->dst, av_err2str(error));
+}
+
+/**
+ * @brief Account the latency of a packet handed to the muxer (live mode only).
+ *
+ * The latency is the time elapsed between the moment the input pts of the packet was due
+ * (latency_origin_us + pts) and the moment the packet reaches the muxer.
+ *
+ * @param out Pointer to the TAVOutput structure.
+ * @param packet Pointer to the packet, with timestamps in the time base of its output stream.
+ */
+static void pktav_output_account_latency(TAVOutput *out, AVPacket *packet) {
+    int64_t latency;
+
+    if (out->latency_origin_us == 0 || packet->pts == AV_NOPTS_VALUE)
+        return;
+
+    latency = av_gettime_relative() - out->latency_origin_us -
+              av_rescale_q(packet->pts, out->ofc->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+
+    pthread_mutex_lock(&out->lock);
+    out->latency_sum_us += latency;
+    out->latency_max_us  = FFMAX(out->latency_max_us, latency);
+    out->latency_count++;
+    pthread_mutex_unlock(&out->lock);
+}
+
+static void *pktav_output_thread(void *arg) {
+    TAVOutput *out = arg;
+    AVPacket *packet;
+    int64_t start_us, write_us;
+    int stream, error;
+    int64_t pts;
+
+    pktav_trace_thread_name(out->config->dst_type ? out->config->dst_type : "mux");
+    while ((packet = pktav_output_pop(out)) != NULL) {
+        pktav_sched_thread_policy();
+        pktav_output_account_latency(out, packet);
+        if (out->config->checksum && packet->stream_index < 2)
+            out->crc32[packet->stream_index] = pktav_crc32_update(out->crc32[packet->stream_index], 
+                                                                  packet->data, packet->size);
+        stream = packet->stream_index;
+        pts = packet->pts;
+        start_us = av_gettime_relative();
+        error = av_interleaved_write_frame(out->ofc, packet);
+        write_us = av_gettime_relative() - start_us;
+        pktav_hist_add(&out->mux_hist, write_us);
+        out->mux_wall_us += write_us;
+        PKTAV_TRACE_END(TRACE_MUX, start_us, stream, pts);
+        av_packet_free(&packet);
+        if (error < 0) {
+            pktav_output_fail(out, error);
+            out->mux_cpu_us = pktav_thread_cpu_us();
+            return NULL;
+        }
+    }
+
+    if (pktav_output_error(out) == 0 && (error = av_write_trailer(out->ofc)) < 0)
+        pktav_output_fail(out, error);
+    out->mux_cpu_us = pktav_thread_cpu_us();
+    return NULL;
+}
+
+/**
+ * @brief Start the muxing thread of an output.
+ *
+ * @param out Pointer to the TAVOutput structure.
+ *
+ * @return Returns 0 on success, or -OS_ERROR if the thread cannot be created (pktav_errno is set).
+ */
+int pktav_output_start(TAVOutput *out) {
+    int error;
+
+    error = pthread_create(&out->thread, NULL, pktav_output_thread, out);
+    if (error != 0) {
+        pktav_errno = error;
+        return -OS_ERROR;
+    }
+    out->running = 1;
+    return 0;
+}
+
+/**
+ * @brief Send an encoded packet to every output of the job.
+ *
+ * Every output receives its own reference of the packet (the data is not copied) with the timestamps
+ * rescaled to the time base of its stream. The packet is queued and written by the muxing thread of the output.
+ *
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to the encoded AVPacket. The caller keeps the ownership of the packet.
+ * @param time_base Time base of the packet timestamps.
+ *
+ * @return Returns the number of outputs still working, or a negative AVERROR code when all the outputs
+ *         failed (the error of the last output).
+ *
+ * @note A failing output is disabled and stops receiving packets, the other outputs are not affected.
+ */
+int pktav_output_send(TAVOutput *outs, int nb_outputs, AVPacket *packet, AVRational time_base) {
+    AVPacket *copy;
+    int i, alive = 0, error = AVERROR_EOF;
+
+    for (i = 0; i < nb_outputs; i++) {
+        if ((error = pktav_output_error(&outs[i])) < 0)
+            continue;
+
+        copy = av_packet_clone(packet);
+        if (!copy)
+            return AVERROR(ENOMEM);
+
+        av_packet_rescale_ts(copy, time_base, outs[i].ofc->streams[copy->stream_index]->time_base);
+        if ((error = pktav_output_push(&outs[i], copy)) == 0)
+            alive++;
+    }
+    return alive > 0 ? alive : error;
+}
+
+/**
+ * @brief Get the latency from input pts to mux time of all the outputs (live mode).
+ *
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param avg_ms Where the average latency in milliseconds is stored.
+ * @param max_ms Where the maximum latency in milliseconds is stored.
+ */
+void pktav_output_latency(TAVOutput *outs, int nb_outputs, long *avg_ms, long *max_ms) {
+    int64_t sum = 0, max = 0;
+    int i, count = 0;
+
+    for (i = 0; i < nb_outputs; i++) {
+        pthread_mutex_lock(&outs[i].lock);
+        sum  += outs[i].latency_sum_us;
+        count += outs[i].latency_count;
+        max   = FFMAX(max, outs[i].latency_max_us);
+        pthread_mutex_unlock(&outs[i].lock);
+    }
+    *avg_ms = count > 0 ? sum / count / 1000 : 0;
+    *max_ms = max / 1000;
+}
+
+/**
+ * @brief Add the muxing stage of all the outputs: write time of every packet, wall and CPU time of the threads.
+ *
+ * @param outs Array of TAVOutput structures, after pktav_output_finish().
+ * @param nb_outputs Number of outputs in the array.
+ * @param stages Pointer to the TAVStages of the job.
+ */
+void pktav_output_stages(TAVOutput *outs, int nb_outputs, TAVStages *stages) {
+    int i;
+
+    for (i = 0; i < nb_outputs; i++) {
+        pktav_hist_merge(&stages->hist[STAGE_MUX], &outs[i].mux_hist);
+        stages->wall_us[STAGE_MUX] += outs[i].mux_wall_us;
+        stages->cpu_us[STAGE_MUX] += outs[i].mux_cpu_us;
+    }
+}
+
+/**
+ * @brief Get the checksums of a finished output.
+ *
+ * @param out Pointer to the TAVOutput structure, after pktav_output_finish().
+ * @param checksum Where the checksums are stored.
+ *
+ * @note The file hash is empty if the output is not a file written by the job (like HLS/DASH, 
+ *       that write their own files). If the muxer seeked back while writing, the hash is of the 
+ *       finished file read again, and empty only if it cannot be read.
+ */
+void pktav_output_checksum(TAVOutput *out, TAVChecksum *checksum) {
+    int error;
+
+    checksum->algo = out->config->checksum;
+    checksum->video_crc32 = out->crc32[VIDEO_INDEX] ^ CRC32_INIT;
+    checksum->audio_crc32 = out->crc32[AUDIO_INDEX] ^ CRC32_INIT;
+    checksum->file_hash[0] = '\0';
+
+    if (!out->config->checksum || (out->ofc->oformat->flags & AVFMT_NOFILE))
+        return;
+    if ((error = pktav_hashio_final(out->ofc->pb, checksum->file_hash, sizeof(checksum->file_hash))) < 0)
+        pktav_log(NULL, 0, "Output %s: cannot read the file again, no %s of the file (%s)\n", 
+                           out->config->dst, out->config->checksum, av_err2str(error));
+}
+
+/**
+ * @brief Flush the queue of an output, write the trailer and stop its muxing thread.
+ *
+ * @param out Pointer to the TAVOutput structure.
+ *
+ * @return Returns 0 on success, or the negative AVERROR code of the first error of the output.
+ */
+int pktav_output_finish(TAVOutput *out) {
+    if (!out->running)
+        return out->error;
+
+    pthread_mutex_lock(&out->lock);
+    out->eof = 1;
+    pthread_cond_broadcast(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+
+    pthread_join(out->thread, NULL);
+    out->running = 0;
+    return out->error;
+}
+
+/**
+ * @brief Close an output and free all its resources.
+ *
+ * @param out Pointer to the TAVOutput structure. The muxing thread is stopped if it is still running.
+ */
+void pktav_output_close(TAVOutput *out) {
+    if (out->running) {
+        pthread_mutex_lock(&out->lock);
+        if (out->error == 0)
+            out->error = AVERROR_EXIT;
+        pthread_mutex_unlock(&out->lock);
+        pktav_output_finish(out);
+    }
+
+    while (out->count > 0) {
+        av_packet_free(&out->queue[out->head]);
+        out->head = (out->head + 1) % MUX_QUEUE_SIZE;
+        out->count--;
+    }
+
+    if (out->ofc) {
+        if (!(out->ofc->oformat->flags & AVFMT_NOFILE) && out->config->checksum)
+            pktav_hashio_close(&out->ofc->pb);
+        else if (!(out->ofc->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&out->ofc->pb);
+        avformat_free_context(out->ofc);
+        out->ofc = NULL;
+    }
+    pthread_cond_destroy(&out->cond);
+    pthread_mutex_destroy(&out->lock);
+}
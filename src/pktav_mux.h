@@ -0,0 +1,47 @@
+#ifndef _PKTAV_MUX_H
+#define _PKTAV_MUX_H 1
+
+#include <pthread.h>
+#include "pktav_types.h"
+#include "pktav_stages.h"
+
+#define MUX_QUEUE_SIZE 1024
+
+/*
+ * One output of the job. Every output has its own AVFormatContext, its own
+ * packet queue and its own muxing thread, so a slow or failing destination
+ * does not stop the others.
+ */
+typedef struct {
+    TAVConfigFormat *config;         // Configuration of this output
+    AVFormatContext *ofc;            // Output Format Context
+    pthread_t       thread;          // Muxing thread
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    AVPacket        *queue[MUX_QUEUE_SIZE];
+    int             head;            // Index of the first packet in the queue
+    int             count;           // Packets in the queue
+    int             eof;             // No more packets will be queued
+    int             running;         // The muxing thread was started
+    int             error;           // First error of this output (the output is disabled)
+    int64_t         latency_origin_us; // Live: wall clock (us) of the input pts 0, 0 if not live
+    int64_t         latency_sum_us;  // Live: latency from input pts to mux time
+    int64_t         latency_max_us;
+    int             latency_count;
+    uint32_t        crc32[2];        // Checksum: CRC32 of the packets of every stream (see pktav_crc32_update)
+    TAVHistogram    mux_hist;        // Time of every packet write (muxing thread only)
+    int64_t         mux_wall_us;
+    int64_t         mux_cpu_us;      // CPU of the muxing thread, set when it ends
+} TAVOutput;
+
+extern void pktav_output_init(TAVOutput *out, TAVConfigFormat *config, AVFormatContext *ofc);
+extern int  pktav_output_start(TAVOutput *out);
+extern int  pktav_output_error(TAVOutput *out);
+extern int  pktav_output_send(TAVOutput *outs, int nb_outputs, AVPacket *packet, AVRational time_base);
+extern int  pktav_output_finish(TAVOutput *out);
+extern void pktav_output_close(TAVOutput *out);
+extern void pktav_output_latency(TAVOutput *outs, int nb_outputs, long *avg_ms, long *max_ms);
+extern void pktav_output_checksum(TAVOutput *out, TAVChecksum *checksum);
+extern void pktav_output_stages(TAVOutput *outs, int nb_outputs, TAVStages *stages);
+
+#endif
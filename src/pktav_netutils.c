@@ -1,11 +1,13 @@
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "pktav_error.h"
+#include "pktav_netutils.h"
 
 int unix_listener(const char *socket_path) {
     int server_sock;
@@ -41,6 +43,41 @@ int unix_listener(const char *socket_path) {
     return server_sock; 
 }
 
+/*
+ * TCP listener bound to the loopback (127.0.0.1), only reachable from the host.
+ */
+int tcp_listener(int port) {
+    int server_sock, on = 1;
+    struct sockaddr_in addr;
+
+    pktav_errno = 0;
+
+    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        pktav_errno = errno;
+        return -OS_ERROR;
+    }
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(server_sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
+        close(server_sock);
+        pktav_errno = errno;
+        return -OS_ERROR;
+    }
+
+    if (listen(server_sock, 5) < 0) {
+        close(server_sock);
+        pktav_errno = errno;
+        return -OS_ERROR;
+    }
+
+    return server_sock;
+}
+
 int unix_accept(int sd) {
     int ret;
 
@@ -93,4 +130,57 @@ ssize_t send_str(int socket, const char *buffer) {
     }
 
     return total_bytes_written;
-}
\ No newline at end of file
+}
+
+/*
+ * Check if a complete message of the socket is already buffered.
+ */
+int msg_pending(TAVMsgBuffer *mb, int socket) {
+    return mb->socket == socket && memchr(mb->data, '\0', mb->len) != NULL;
+}
+
+/*
+ * Receive the next NUL terminated message of a socket without blocking. The bytes
+ * after the message are kept in `mb` for the next call, and a partial message waits
+ * there until the rest arrives. A message longer than the buffer is dropped.
+ *
+ * Returns the length of the message copied to `msg` (NUL included), 0 if there is no
+ * complete message yet, or -1 if the peer closed the connection (errno 0) or the socket failed.
+ */
+ssize_t recv_msg(int socket, TAVMsgBuffer *mb, char *msg, size_t max_len) {
+    ssize_t bytes_read;
+    char *end;
+    size_t len;
+
+    if (mb->socket != socket) {
+        mb->socket = socket;
+        mb->len = 0;
+    }
+
+    if (!msg_pending(mb, socket)) {
+        if (mb->len == sizeof(mb->data))
+            mb->len = 0;
+        while ((bytes_read = recv(socket, mb->data + mb->len, sizeof(mb->data) - mb->len, MSG_DONTWAIT)) < 0 && 
+               errno == EINTR);
+        if (bytes_read == 0) {
+            errno = 0;
+            return -1;
+        }
+        if (bytes_read < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        mb->len += bytes_read;
+    }
+
+    if ((end = memchr(mb->data, '\0', mb->len)) == NULL)
+        return 0;
+    len = end - mb->data + 1;
+    if (len <= max_len) {
+        memcpy(msg, mb->data, len);
+    } else {
+        memcpy(msg, mb->data, max_len - 1);
+        msg[max_len - 1] = '\0';
+    }
+    memmove(mb->data, mb->data + len, mb->len - len);
+    mb->len -= len;
+    return len;
+}
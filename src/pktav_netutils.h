@@ -4,10 +4,24 @@
 #include <stdlib.h>
 
 #define DEFAULT_SOCKET_FILE "unix.socket"
+#define MSG_BUFFER_SIZE 4096
+
+/*
+ * Bytes received from a socket that are not a complete message yet, or that
+ * are the messages after the one returned (several messages in one read).
+ */
+typedef struct {
+    int    socket;                  // Socket of the buffered bytes, -1 if none
+    size_t len;                     // Bytes buffered
+    char   data[MSG_BUFFER_SIZE];
+} TAVMsgBuffer;
 
 extern int unix_accept(int sd);
 extern int unix_listener(const char *socket_path);
+extern int tcp_listener(int port);
 extern ssize_t recv_str(int socket, char *buffer, size_t max_len);
 extern ssize_t send_str(int socket, const char *buffer);
+extern ssize_t recv_msg(int socket, TAVMsgBuffer *mb, char *msg, size_t max_len);
+extern int     msg_pending(TAVMsgBuffer *mb, int socket);
 
 #endif
\ No newline at end of file
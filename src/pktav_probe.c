@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include "pktav_probe.h"
+#include "pktav_video.h"
+#include "pktav_log.h"
+
+#define PROBE_DEFAULT_WINDOW_MS  2000
+#define PROBE_DEFAULT_WIDTH      480
+#define PROBE_DEFAULT_CRF        23      // Quality target of the bitrate mode
+#define PROBE_ENCODE_CRF         23      // crf of the probe encode
+#define PROBE_PRESET             "superfast"
+#define PROBE_PRESET_FACTOR      0.85    // The probe preset spends ~15% more bits than the slower ones
+#define PROBE_CRF_STEP           6.0     // x264/x265: 6 crf steps halve (or double) the bitrate
+#define PROBE_CRF_MAX            51
+
+/*
+ * Send a frame (NULL to flush) to the probe encoder and count the bytes of the packets.
+ */
+static int pktav_probe_encode(AVCodecContext *enc, const AVFrame *frame, AVPacket *packet, TAVProbe *probe) {
+    int error;
+
+    if ((error = avcodec_send_frame(enc, frame)) < 0)
+        return error;
+    while ((error = avcodec_receive_packet(enc, packet)) == 0) {
+        probe->bytes += packet->size;
+        av_packet_unref(packet);
+    }
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+/*
+ * Scale a decoded frame to the probe size and encode it. The frames are numbered
+ * consecutively, so the windows are seen by the encoder as scene cuts.
+ */
+static int pktav_probe_frame(AVCodecContext *enc, struct SwsContext **sws, AVFrame *frame, AVFrame *scaled,
+                             AVPacket *packet, TAVProbe *probe) {
+    int error;
+
+    *sws = sws_getCachedContext(*sws, frame->width, frame->height, frame->format,
+                                enc->width, enc->height, enc->pix_fmt, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    if (!*sws)
+        return AVERROR(EINVAL);
+
+    scaled->format = enc->pix_fmt;
+    scaled->width  = enc->width;
+    scaled->height = enc->height;
+    if ((error = av_frame_get_buffer(scaled, 0)) < 0)
+        return error;
+    sws_scale(*sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+              scaled->data, scaled->linesize);
+    scaled->pts = probe->frames++;
+
+    error = pktav_probe_encode(enc, scaled, packet, probe);
+    av_frame_unref(scaled);
+    return error;
+}
+
+/*
+ * Decode the input from the current position and encode the frames in [start, end).
+ *
+ * Returns 0 when the window is complete, AVERROR_EOF at the end of the input or a
+ * negative AVERROR code on failure.
+ */
+static int pktav_probe_window(AVFormatContext *ifc, AVStream *stream, AVCodecContext *dec, AVCodecContext *enc,
+                              struct SwsContext **sws, AVFrame *frame, AVFrame *scaled, AVPacket *packet,
+                              TAVProbe *probe, int64_t start, int64_t end) {
+    int64_t pts;
+    int error, eof = 0;
+
+    while (1) {
+        error = av_read_frame(ifc, packet);
+        if (error == AVERROR_EOF) {
+            avcodec_send_packet(dec, NULL);
+            eof = 1;
+        } else if (error < 0) {
+            return error;
+        } else if (packet->stream_index != stream->index) {
+            av_packet_unref(packet);
+            continue;
+        } else {
+            error = avcodec_send_packet(dec, packet);
+            av_packet_unref(packet);
+            /* Broken references after a seek are not an error of the probe */
+            if (error < 0 && error != AVERROR_INVALIDDATA)
+                return error;
+        }
+
+        while ((error = avcodec_receive_frame(dec, frame)) == 0) {
+            pts = frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE && pts >= end) {
+                av_frame_unref(frame);
+                return 0;
+            }
+            if (pts != AV_NOPTS_VALUE && pts >= start)
+                error = pktav_probe_frame(enc, sws, frame, scaled, packet, probe);
+            av_frame_unref(frame);
+            if (error < 0)
+                return error;
+        }
+        if (error != AVERROR(EAGAIN) && error != AVERROR_EOF)
+            return error;
+        if (eof)
+            return AVERROR_EOF;
+    }
+}
+
+/**
+ * @brief Estimate the complexity of the input encoding a few short windows at a fast preset and low resolution.
+ *
+ * The windows are spread over the duration of the input and every one of them is reached with a seek,
+ * so the cost of the probe depends on the number and length of the windows, not on the input.
+ * Inputs without a known duration are probed from the beginning.
+ *
+ * @param input Path or URL of the input.
+ * @param config Pointer to the TAVConfigVideo of the job (codec, track, frame rate, pixel format, GOP and probe settings).
+ * @param probe Pointer to the TAVProbe where the result is stored.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *         - AVERROR(ENOSYS) if the encoder has no crf option.
+ *         - AVERROR_EOF if no frame could be encoded.
+ */
+int pktav_probe_complexity(const char *input, TAVConfigVideo *config, TAVProbe *probe) {
+    AVFormatContext *ifc = NULL;
+    AVStream *stream = NULL;
+    AVCodecContext *dec = NULL, *enc = NULL;
+    const AVCodec *codec;
+    struct SwsContext *sws = NULL;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL, *scaled = NULL;
+    int64_t start_us = av_gettime_relative();
+    int64_t offset, duration, window, ts;
+    int i, width, windows, error;
+
+    memset(probe, 0, sizeof(TAVProbe));
+    windows = config->probe.windows;
+
+    if ((error = pktav_open_input_context(input, &ifc, NULL)) < 0)
+        return error;
+    if (pktva_get_video_stream(ifc, config->track, &stream) == -1) {
+        error = AVERROR_STREAM_NOT_FOUND;
+        goto cleanup;
+    }
+    for (i = 0; i < ifc->nb_streams; i++) {
+        if (ifc->streams[i] != stream)
+            ifc->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    /* Decoder */
+    if ((codec = avcodec_find_decoder(stream->codecpar->codec_id)) == NULL) {
+        error = AVERROR_DECODER_NOT_FOUND;
+        goto cleanup;
+    }
+    if ((dec = avcodec_alloc_context3(codec)) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    if ((error = avcodec_parameters_to_context(dec, stream->codecpar)) < 0 ||
+        (error = avcodec_open2(dec, codec, NULL)) < 0)
+        goto cleanup;
+    if (dec->width <= 0 || dec->height <= 0) {
+        error = AVERROR_INVALIDDATA;
+        goto cleanup;
+    }
+
+    /* Probe encoder: same codec as the job, fast preset, fixed crf, low resolution */
+    if ((codec = avcodec_find_encoder_by_name(config->codec)) == NULL) {
+        error = AVERROR_ENCODER_NOT_FOUND;
+        goto cleanup;
+    }
+    if ((enc = avcodec_alloc_context3(codec)) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    width = FFMIN(config->probe.width > 0 ? config->probe.width : PROBE_DEFAULT_WIDTH, dec->width);
+    enc->width = FFMAX(2, width & ~1);
+    enc->height = FFMAX(2, (int)av_rescale(enc->width, dec->height, dec->width) & ~1);
+    enc->pix_fmt = config->pix_fmt;
+    enc->time_base = av_inv_q(config->framerate);
+    enc->framerate = config->framerate;
+    enc->gop_size = config->gop_size;
+    av_opt_set(enc->priv_data, "preset", PROBE_PRESET, 0);
+    if (av_opt_set_int(enc->priv_data, "crf", PROBE_ENCODE_CRF, 0) < 0) {
+        error = AVERROR(ENOSYS);
+        goto cleanup;
+    }
+    if ((error = avcodec_open2(enc, codec, NULL)) < 0)
+        goto cleanup;
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    scaled = av_frame_alloc();
+    if (!packet || !frame || !scaled) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    offset = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    duration = stream->duration != AV_NOPTS_VALUE ? stream->duration :
+               ifc->duration != AV_NOPTS_VALUE ? av_rescale_q(ifc->duration, AV_TIME_BASE_Q, stream->time_base) : 0;
+    window = av_rescale_q(config->probe.window_ms > 0 ? config->probe.window_ms : PROBE_DEFAULT_WINDOW_MS,
+                          (AVRational){1, 1000}, stream->time_base);
+
+    ts = offset;
+    for (i = 0, error = 0; i < windows && error == 0; i++) {
+        if (duration > window) {
+            /* Centered in every 1/windows of the input */
+            ts = offset + duration * (2 * i + 1) / (2 * windows) - window / 2;
+            if (ts < offset)
+                ts = offset;
+            avcodec_flush_buffers(dec);
+            if (avformat_seek_file(ifc, stream->index, INT64_MIN, ts, ts, 0) < 0)
+                duration = 0;   /* Not seekable: the rest of the windows follow this one */
+        }
+        error = pktav_probe_window(ifc, stream, dec, enc, &sws, frame, scaled, packet, probe, ts, ts + window);
+        ts += window;
+        /* The end of the input is not the end of the probe if the next window is seeked */
+        if (error == AVERROR_EOF && duration > window)
+            error = 0;
+    }
+    if (error < 0 && error != AVERROR_EOF)
+        goto cleanup;
+
+    if ((error = pktav_probe_encode(enc, NULL, packet, probe)) < 0)
+        goto cleanup;
+    if (probe->frames == 0) {
+        error = AVERROR_EOF;
+        goto cleanup;
+    }
+
+    probe->width = enc->width;
+    probe->height = enc->height;
+    probe->bpp = probe->bytes * 8.0 / ((double)probe->frames * enc->width * enc->height);
+
+cleanup:
+    probe->time_ms = (av_gettime_relative() - start_us) / 1000;
+    sws_freeContext(sws);
+    av_frame_free(&scaled);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&enc);
+    avcodec_free_context(&dec);
+    avformat_close_input(&ifc);
+    return error;
+}
+
+/**
+ * @brief Choose the crf or the bitrate of the job from the result of the complexity probe.
+ *
+ * The bits per pixel of the probe are scaled to the output resolution (the bitrate grows with
+ * pixels^0.75) and frame rate, which predicts the bitrate of the job at any crf.
+ *
+ * - CRF mode: the configured crf is kept unless its predicted bitrate is outside the bitrate bounds,
+ *   then it is moved (6 crf steps per doubling) within [crf_min, crf_max].
+ * - Bitrate mode: the bitrate is the one predicted at the probe crf, within the bitrate bounds. The
+ *   configured bitrate_bps is the upper bound when probe.bitrate_max_bps is not set, so simple titles
+ *   get less bits and complex ones never more than before.
+ *
+ * @param config Pointer to the TAVConfigVideo of the job. Its crf or bitrate_bps is updated.
+ * @param probe Pointer to the TAVProbe with the result of pktav_probe_complexity.
+ *
+ * @note Every rung of a ladder is a job with its own resolution, so every rung gets its own bitrate.
+ */
+void pktav_probe_choose(TAVConfigVideo *config, TAVProbe *probe) {
+    double out_pixels = (double)config->width * config->height;
+    double probe_pixels = (double)probe->width * probe->height;
+    double fps = av_q2d(config->framerate);
+    double bps, predicted;
+    int crf, target, min_bps, max_bps;
+
+    if (probe->frames == 0 || out_pixels <= 0 || probe_pixels <= 0 || fps <= 0)
+        return;
+
+    /* Predicted bitrate at the probe crf */
+    bps = probe->bpp * PROBE_PRESET_FACTOR * pow(probe_pixels / out_pixels, 0.25) * out_pixels * fps;
+    min_bps = config->probe.bitrate_min_bps;
+
+    if (config->crf != -1) {
+        max_bps = config->probe.bitrate_max_bps;
+        crf = config->crf;
+        predicted = bps * pow(2.0, (PROBE_ENCODE_CRF - crf) / PROBE_CRF_STEP);
+        if (max_bps > 0 && predicted > max_bps)
+            crf += (int)ceil(PROBE_CRF_STEP * log2(predicted / max_bps));
+        else if (min_bps > 0 && predicted < min_bps)
+            crf -= (int)floor(PROBE_CRF_STEP * log2(min_bps / predicted));
+        if (config->probe.crf_min > 0 && crf < config->probe.crf_min)
+            crf = config->probe.crf_min;
+        if (config->probe.crf_max > 0 && crf > config->probe.crf_max)
+            crf = config->probe.crf_max;
+        config->crf = av_clip(crf, 0, PROBE_CRF_MAX);
+        pktav_log(NULL, 0, "Probe: %.4f bpp, %.0f bps predicted, crf %d\n", probe->bpp, predicted, config->crf);
+    } else {
+        max_bps = config->probe.bitrate_max_bps > 0 ? config->probe.bitrate_max_bps : config->bitrate_bps;
+        target = config->probe.crf > 0 ? config->probe.crf : PROBE_DEFAULT_CRF;
+        predicted = bps * pow(2.0, (PROBE_ENCODE_CRF - target) / PROBE_CRF_STEP);
+        if (max_bps > 0 && predicted > max_bps)
+            predicted = max_bps;
+        if (min_bps > 0 && predicted < min_bps)
+            predicted = min_bps;
+        config->bitrate_bps = (int)predicted;
+        pktav_log(NULL, 0, "Probe: %.4f bpp, %d bps\n", probe->bpp, config->bitrate_bps);
+    }
+}
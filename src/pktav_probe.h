@@ -0,0 +1,22 @@
+#ifndef _PKTAV_PROBE_H
+#define _PKTAV_PROBE_H 1
+
+#include "pktav_types.h"
+
+/*
+ * Result of the complexity probe: bits needed by the probe encode at a fixed
+ * crf, normalized per pixel so it can be scaled to any output resolution.
+ */
+typedef struct {
+    int     width;          // Size of the probe encode
+    int     height;
+    int     frames;         // Frames encoded
+    int64_t bytes;          // Bytes produced
+    double  bpp;            // Bits per pixel at the probe crf
+    long    time_ms;        // Time spent in the probe
+} TAVProbe;
+
+extern int  pktav_probe_complexity(const char *input, TAVConfigVideo *config, TAVProbe *probe);
+extern void pktav_probe_choose(TAVConfigVideo *config, TAVProbe *probe);
+
+#endif
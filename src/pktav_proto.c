@@ -1,3 +1,7 @@
+#include <pthread.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <libavutil/parseutils.h>
 #include "pktav_proto.h"
 #include "pktav_keyvalue.h"
 #include "pktav_mediainfo.h"
@@ -5,13 +9,57 @@
 #include "pktav_types.h"
 #include "pktav_error.h"
 
+/* Status messages can be sent from the muxing threads too */
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *pktav_config_format_value(KeyValueList *kv_list, const char *prefix, const char *name) {
+    char key[64];
+    snprintf(key, sizeof(key), "%s_%s", prefix, name);
+    return get_value_from_kv_list(kv_list, key);
+}
+
+/*
+ * Load the configuration of one output. The first output uses the "format_"
+ * keys and the additional outputs the "format<N>_" keys.
+ */
+static void pktav_config_format_load(KeyValueList *kv_list, const char *prefix, TAVConfigFormat *format_config) {
+    const char *value;
+
+    value = pktav_config_format_value(kv_list, prefix, "dst");
+    if (value) format_config->dst = strdup(value);
+
+    value = pktav_config_format_value(kv_list, prefix, "dst_type");
+    if (value) format_config->dst_type = strdup(value);
+
+    value = pktav_config_format_value(kv_list, prefix, "kv_opts");
+    if (value) format_config->kv_opts = strdup(value);
+
+    value = pktav_config_format_value(kv_list, prefix, "frag_duration_ms");
+    if (value) format_config->frag_duration_ms = atoi(value);
+
+    value = pktav_config_format_value(kv_list, prefix, "segment_duration_ms");
+    if (value) format_config->segment_duration_ms = atoi(value);
+
+    value = pktav_config_format_value(kv_list, prefix, "segment_type");
+    if (value) format_config->segment_type = strdup(value);
+
+    value = pktav_config_format_value(kv_list, prefix, "checksum");
+    if (value) format_config->checksum = strdup(value);
+}
+
 static void pktav_config_kv_load(KeyValueList *kv_list, TAVConfigFormat *format_config, TAVConfigVideo *video_config, TAVConfigAudio *audio_config) {
     const char *value;
+    TAVConfigFormat *output, *last = format_config;
+    char prefix[16], key[64];
+    int i;
 
     // Audio configuration
     value = get_value_from_kv_list(kv_list, "audio_codec");
     if (value) audio_config->codec = strdup(value);
 
+    value = get_value_from_kv_list(kv_list, "audio_track");
+    if (value) audio_config->track = strdup(value);
+
     value = get_value_from_kv_list(kv_list, "audio_bitrate_bps");
     if (value) audio_config->bitrate_bps = atoi(value);
 
@@ -21,10 +69,22 @@ static void pktav_config_kv_load(KeyValueList *kv_list, TAVConfigFormat *format_
     value = get_value_from_kv_list(kv_list, "audio_sample_rate");
     if (value) audio_config->sample_rate = atoi(value);
 
+    value = get_value_from_kv_list(kv_list, "audio_loudness");
+    if (value) audio_config->loudness = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "audio_loudness_target");
+    if (value) audio_config->loudness_target = atof(value);
+
+    value = get_value_from_kv_list(kv_list, "audio_gain_db");
+    if (value) audio_config->gain_db = atof(value);
+
     // Video configuration
     value = get_value_from_kv_list(kv_list, "video_codec");
     if (value) video_config->codec = strdup(value);
 
+    value = get_value_from_kv_list(kv_list, "video_track");
+    if (value) video_config->track = strdup(value);
+
     value = get_value_from_kv_list(kv_list, "video_width");
     if (value) video_config->width = atoi(value);
 
@@ -34,6 +94,70 @@ static void pktav_config_kv_load(KeyValueList *kv_list, TAVConfigFormat *format_
     value = get_value_from_kv_list(kv_list, "video_gop_size");
     if (value) video_config->gop_size = atoi(value);
 
+    value = get_value_from_kv_list(kv_list, "video_framerate");
+    if (value && av_parse_video_rate(&video_config->output_framerate, value) < 0)
+        video_config->output_framerate = (AVRational){0, 0};
+
+    value = get_value_from_kv_list(kv_list, "video_dup_threshold");
+    if (value) video_config->dup_threshold = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "video_dup_max_skip");
+    if (value) video_config->dup_max_skip = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "video_quality_interval");
+    if (value) video_config->quality_interval = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_windows");
+    if (value) video_config->probe.windows = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_window_ms");
+    if (value) video_config->probe.window_ms = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_width");
+    if (value) video_config->probe.width = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_crf");
+    if (value) video_config->probe.crf = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_crf_min");
+    if (value) video_config->probe.crf_min = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_crf_max");
+    if (value) video_config->probe.crf_max = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_bitrate_min_bps");
+    if (value) video_config->probe.bitrate_min_bps = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "probe_bitrate_max_bps");
+    if (value) video_config->probe.bitrate_max_bps = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_interval_ms");
+    if (value) video_config->thumbs.interval_ms = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_width");
+    if (value) video_config->thumbs.width = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_height");
+    if (value) video_config->thumbs.height = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_cols");
+    if (value) video_config->thumbs.cols = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_rows");
+    if (value) video_config->thumbs.rows = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_codec");
+    if (value) video_config->thumbs.codec = strdup(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_dst");
+    if (value) video_config->thumbs.dst = strdup(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_vtt");
+    if (value) video_config->thumbs.vtt = strdup(value);
+
+    value = get_value_from_kv_list(kv_list, "thumbs_only");
+    if (value) video_config->thumbs.only = atoi(value);
+
     value = get_value_from_kv_list(kv_list, "video_pix_fmt");
     if (value) video_config->pix_fmt = atoi(value);
 
@@ -43,21 +167,84 @@ static void pktav_config_kv_load(KeyValueList *kv_list, TAVConfigFormat *format_
     value = get_value_from_kv_list(kv_list, "video_preset");
     if (value) video_config->preset = strdup(value);
 
+    value = get_value_from_kv_list(kv_list, "video_tune");
+    if (value) video_config->tune = strdup(value);
+
+    value = get_value_from_kv_list(kv_list, "video_lookahead");
+    if (value) video_config->lookahead = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "video_threads");
+    if (value) video_config->threads = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "video_hugepages");
+    if (value) video_config->hugepages = atoi(value);
+
     value = get_value_from_kv_list(kv_list, "video_crf");
     if (value) video_config->crf = atoi(value);
 
     value = get_value_from_kv_list(kv_list, "video_bitrate_bps");
     if (value) video_config->bitrate_bps = atoi(value);
 
+    value = get_value_from_kv_list(kv_list, "video_speed_target");
+    if (value) video_config->speed_target = atof(value);
+
+    value = get_value_from_kv_list(kv_list, "video_deadline_ms");
+    if (value) video_config->deadline_ms = atoi(value);
+
     // Format configuration
-    value = get_value_from_kv_list(kv_list, "format_dst");
-    if (value) format_config->dst = strdup(value);
+    pktav_config_format_load(kv_list, "format", format_config);
 
-    value = get_value_from_kv_list(kv_list, "format_dst_type");
-    if (value) format_config->dst_type = strdup(value);
+    value = get_value_from_kv_list(kv_list, "live");
+    if (value) format_config->live = atoi(value);
 
-    value = get_value_from_kv_list(kv_list, "format_kv_opts");
-    if (value) format_config->kv_opts = strdup(value);
+    value = get_value_from_kv_list(kv_list, "live_max_latency_ms");
+    if (value) format_config->live_max_latency_ms = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "start_ms");
+    if (value) format_config->start_ms = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "end_ms");
+    if (value) format_config->end_ms = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "smart_cut");
+    if (value) format_config->smart_cut = atoi(value);
+
+    value = get_value_from_kv_list(kv_list, "priority");
+    if (value) format_config->priority = strdup(value);
+
+    value = get_value_from_kv_list(kv_list, "job_id");
+    if (value) format_config->job_id = strdup(value);
+
+    value = get_value_from_kv_list(kv_list, "trace_file");
+    if (value) format_config->trace_file = strdup(value);
+
+    // Additional outputs (format1_dst, format1_dst_type, ...)
+    for (i = 1; i < MAX_OUTPUTS; i++) {
+        snprintf(prefix, sizeof(prefix), "format%d", i);
+        snprintf(key, sizeof(key), "%s_dst", prefix);
+        if (!get_value_from_kv_list(kv_list, key))
+            break;
+
+        output = calloc(1, sizeof(TAVConfigFormat));
+        if (!output)
+            break;
+        pktav_config_format_load(kv_list, prefix, output);
+        last->next = output;
+        last = output;
+    }
+}
+
+/*
+ * Reset the configuration to its defaults before loading the keys sent by the
+ * client, so any key that is not present in the message has a known value.
+ */
+static void pktav_config_defaults(TAVConfigFormat *format_config, TAVConfigVideo *video_config, TAVConfigAudio *audio_config) {
+    memset(format_config, 0, sizeof(TAVConfigFormat));
+    memset(video_config, 0, sizeof(TAVConfigVideo));
+    memset(audio_config, 0, sizeof(TAVConfigAudio));
+
+    video_config->crf = -1;
+    video_config->lookahead = -1;
 }
 
 
@@ -113,6 +300,9 @@ static void pktav_mediainfo_kv_dump(KeyValueList **kv_list, TAVInfo *info) {
 
 static void pktav_status_kv_dump(KeyValueList **kv_list, const TAVStatus *status) {
     char buffer[MAX_BUFFER_SIZE];
+    const TAVChecksum *checksum;
+    char key[64];
+    int i;
 
     // status
     snprintf(buffer, sizeof(buffer), "%d", status->status);
@@ -129,6 +319,14 @@ static void pktav_status_kv_dump(KeyValueList **kv_list, const TAVStatus *status
     snprintf(buffer, sizeof(buffer), "%ld", status->time_left_ms);
     add_to_kv_list(kv_list, "time_left_ms", buffer);
 
+    // queue_position and expected_start_ms (QUEUED only)
+    if (status->queue_position > 0) {
+        snprintf(buffer, sizeof(buffer), "%d", status->queue_position);
+        add_to_kv_list(kv_list, "queue_position", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->expected_start_ms);
+        add_to_kv_list(kv_list, "expected_start_ms", buffer);
+    }
+
     // progress_pct
     snprintf(buffer, sizeof(buffer), "%d", status->progress_pct);
     add_to_kv_list(kv_list, "progress_pct", buffer);
@@ -143,6 +341,196 @@ static void pktav_status_kv_dump(KeyValueList **kv_list, const TAVStatus *status
 
     // err_msg
     add_to_kv_list(kv_list, "err_msg", status->err_msg);
+
+    // segment
+    if (status->segment)
+        add_to_kv_list(kv_list, "segment", status->segment);
+
+    // outputs_failed
+    snprintf(buffer, sizeof(buffer), "%d", status->outputs_failed);
+    add_to_kv_list(kv_list, "outputs_failed", buffer);
+
+    // frames_dropped
+    snprintf(buffer, sizeof(buffer), "%d", status->frames_dropped);
+    add_to_kv_list(kv_list, "frames_dropped", buffer);
+
+    // frames_skipped
+    snprintf(buffer, sizeof(buffer), "%d", status->frames_skipped);
+    add_to_kv_list(kv_list, "frames_skipped", buffer);
+
+    // thumbnails
+    if (status->thumbnails > 0) {
+        snprintf(buffer, sizeof(buffer), "%d", status->thumbnails);
+        add_to_kv_list(kv_list, "thumbnails", buffer);
+    }
+
+    // quality metrics
+    if (status->quality_frames > 0) {
+        snprintf(buffer, sizeof(buffer), "%d", status->quality_frames);
+        add_to_kv_list(kv_list, "quality_frames", buffer);
+        snprintf(buffer, sizeof(buffer), "%.2f", status->psnr);
+        add_to_kv_list(kv_list, "psnr", buffer);
+        snprintf(buffer, sizeof(buffer), "%.2f", status->psnr_y);
+        add_to_kv_list(kv_list, "psnr_y", buffer);
+        snprintf(buffer, sizeof(buffer), "%.2f", status->psnr_min);
+        add_to_kv_list(kv_list, "psnr_min", buffer);
+        snprintf(buffer, sizeof(buffer), "%.4f", status->ssim);
+        add_to_kv_list(kv_list, "ssim", buffer);
+        snprintf(buffer, sizeof(buffer), "%.4f", status->ssim_min);
+        add_to_kv_list(kv_list, "ssim_min", buffer);
+    }
+
+    // complexity probe
+    if (status->probe) {
+        snprintf(buffer, sizeof(buffer), "%.4f", status->probe_bpp);
+        add_to_kv_list(kv_list, "probe_bpp", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->probe_time_ms);
+        add_to_kv_list(kv_list, "probe_time_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%d", status->video_crf);
+        add_to_kv_list(kv_list, "video_crf", buffer);
+        snprintf(buffer, sizeof(buffer), "%d", status->video_bitrate_bps);
+        add_to_kv_list(kv_list, "video_bitrate_bps", buffer);
+    }
+
+    // speed controller
+    if (status->speed > 0) {
+        snprintf(buffer, sizeof(buffer), "%.2f", status->speed);
+        add_to_kv_list(kv_list, "speed", buffer);
+        add_to_kv_list(kv_list, "preset", status->preset);
+        snprintf(buffer, sizeof(buffer), "%d", status->lookahead);
+        add_to_kv_list(kv_list, "lookahead", buffer);
+        snprintf(buffer, sizeof(buffer), "%d", status->preset_changes);
+        add_to_kv_list(kv_list, "preset_changes", buffer);
+    }
+
+    // pause/resume
+    if (status->pauses > 0) {
+        snprintf(buffer, sizeof(buffer), "%d", status->pauses);
+        add_to_kv_list(kv_list, "pauses", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->paused_ms);
+        add_to_kv_list(kv_list, "paused_ms", buffer);
+    }
+
+    // huge page frame pools
+    if (status->frame_buffers > 0) {
+        snprintf(buffer, sizeof(buffer), "%" PRId64, status->frame_buffers);
+        add_to_kv_list(kv_list, "frame_buffers", buffer);
+        snprintf(buffer, sizeof(buffer), "%" PRId64, status->frame_buffers_hugetlb);
+        add_to_kv_list(kv_list, "frame_buffers_hugetlb", buffer);
+        snprintf(buffer, sizeof(buffer), "%" PRId64, status->frame_buffers_thp);
+        add_to_kv_list(kv_list, "frame_buffers_thp", buffer);
+    }
+
+    // placement
+    if (status->cpus) {
+        snprintf(buffer, sizeof(buffer), "%d", status->numa_node);
+        add_to_kv_list(kv_list, "numa_node", buffer);
+        add_to_kv_list(kv_list, "cpus", status->cpus);
+    }
+
+    // cgroup usage (FINISH only)
+    if (status->cgroup) {
+        snprintf(buffer, sizeof(buffer), "%ld", status->cgroup_cpu_ms);
+        add_to_kv_list(kv_list, "cgroup_cpu_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->cgroup_user_ms);
+        add_to_kv_list(kv_list, "cgroup_user_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->cgroup_system_ms);
+        add_to_kv_list(kv_list, "cgroup_system_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->cgroup_throttled_ms);
+        add_to_kv_list(kv_list, "cgroup_throttled_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%" PRId64, status->cgroup_memory_peak);
+        add_to_kv_list(kv_list, "cgroup_memory_peak", buffer);
+    }
+
+    // loudness (FINISH only)
+    if (status->loudness) {
+        snprintf(buffer, sizeof(buffer), "%.1f", status->loudness_i);
+        add_to_kv_list(kv_list, "loudness_i", buffer);
+        snprintf(buffer, sizeof(buffer), "%.1f", status->loudness_lra);
+        add_to_kv_list(kv_list, "loudness_lra", buffer);
+        snprintf(buffer, sizeof(buffer), "%.1f", status->loudness_tp);
+        add_to_kv_list(kv_list, "loudness_tp", buffer);
+        snprintf(buffer, sizeof(buffer), "%.1f", status->loudness_gain_db);
+        add_to_kv_list(kv_list, "loudness_gain_db", buffer);
+    }
+
+    // checksums (FINISH only)
+    for (i = 0; i < status->nb_checksums; i++) {
+        checksum = &status->checksums[i];
+        if (checksum->file_hash[0]) {
+            snprintf(key, sizeof(key), "output%d_%s", checksum->output, checksum->algo);
+            add_to_kv_list(kv_list, key, checksum->file_hash);
+        }
+        snprintf(key, sizeof(key), "output%d_video_crc32", checksum->output);
+        snprintf(buffer, sizeof(buffer), "%08" PRIx32, checksum->video_crc32);
+        add_to_kv_list(kv_list, key, buffer);
+        snprintf(key, sizeof(key), "output%d_audio_crc32", checksum->output);
+        snprintf(buffer, sizeof(buffer), "%08" PRIx32, checksum->audio_crc32);
+        add_to_kv_list(kv_list, key, buffer);
+    }
+
+    // pipeline stages (FINISH only): per-frame latency, wall and CPU time
+    for (i = 0; i < status->nb_stages; i++) {
+        const TAVStageStatus *stage = &status->stages[i];
+        snprintf(key, sizeof(key), "stage_%s_samples", stage->name);
+        snprintf(buffer, sizeof(buffer), "%" PRId64, stage->count);
+        add_to_kv_list(kv_list, key, buffer);
+        snprintf(key, sizeof(key), "stage_%s_p50_us", stage->name);
+        snprintf(buffer, sizeof(buffer), "%ld", stage->p50_us);
+        add_to_kv_list(kv_list, key, buffer);
+        snprintf(key, sizeof(key), "stage_%s_p99_us", stage->name);
+        snprintf(buffer, sizeof(buffer), "%ld", stage->p99_us);
+        add_to_kv_list(kv_list, key, buffer);
+        snprintf(key, sizeof(key), "stage_%s_max_us", stage->name);
+        snprintf(buffer, sizeof(buffer), "%ld", stage->max_us);
+        add_to_kv_list(kv_list, key, buffer);
+        snprintf(key, sizeof(key), "stage_%s_wall_ms", stage->name);
+        snprintf(buffer, sizeof(buffer), "%ld", stage->wall_ms);
+        add_to_kv_list(kv_list, key, buffer);
+        snprintf(key, sizeof(key), "stage_%s_cpu_ms", stage->name);
+        snprintf(buffer, sizeof(buffer), "%ld", stage->cpu_ms);
+        add_to_kv_list(kv_list, key, buffer);
+    }
+    if (status->nb_stages > 0) {
+        snprintf(buffer, sizeof(buffer), "%.2f", status->fps);
+        add_to_kv_list(kv_list, "fps", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->cpu_ms);
+        add_to_kv_list(kv_list, "cpu_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->threads_cpu_ms);
+        add_to_kv_list(kv_list, "threads_cpu_ms", buffer);
+    }
+
+    // resources of the job (FINISH only)
+    if (status->usage) {
+        snprintf(buffer, sizeof(buffer), "%ld", status->user_cpu_ms);
+        add_to_kv_list(kv_list, "user_cpu_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->system_cpu_ms);
+        add_to_kv_list(kv_list, "system_cpu_ms", buffer);
+        snprintf(buffer, sizeof(buffer), "%" PRId64, status->max_rss);
+        add_to_kv_list(kv_list, "max_rss", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->voluntary_ctxsw);
+        add_to_kv_list(kv_list, "voluntary_ctxsw", buffer);
+        snprintf(buffer, sizeof(buffer), "%ld", status->involuntary_ctxsw);
+        add_to_kv_list(kv_list, "involuntary_ctxsw", buffer);
+        if (status->io_read_bytes >= 0) {
+            snprintf(buffer, sizeof(buffer), "%" PRId64, status->io_read_bytes);
+            add_to_kv_list(kv_list, "io_read_bytes", buffer);
+            snprintf(buffer, sizeof(buffer), "%" PRId64, status->io_write_bytes);
+            add_to_kv_list(kv_list, "io_write_bytes", buffer);
+            snprintf(buffer, sizeof(buffer), "%" PRId64, status->disk_read_bytes);
+            add_to_kv_list(kv_list, "disk_read_bytes", buffer);
+            snprintf(buffer, sizeof(buffer), "%" PRId64, status->disk_write_bytes);
+            add_to_kv_list(kv_list, "disk_write_bytes", buffer);
+        }
+    }
+
+    // latency_ms
+    snprintf(buffer, sizeof(buffer), "%ld", status->latency_ms);
+    add_to_kv_list(kv_list, "latency_ms", buffer);
+
+    // latency_max_ms
+    snprintf(buffer, sizeof(buffer), "%ld", status->latency_max_ms);
+    add_to_kv_list(kv_list, "latency_max_ms", buffer);
 }
 
 int send_mediainfo(int socket, TAVInfo *info) {
@@ -183,7 +571,9 @@ int send_status(int socket, TAVStatus *status) {
         free_kv_list(kv);
         return -OS_ERROR;
     }
+    pthread_mutex_lock(&status_lock);
     ret = send_str(socket, str);
+    pthread_mutex_unlock(&status_lock);
     free_kv_list(kv);
     free(str);
     if (ret < 0) {
@@ -208,6 +598,7 @@ int recv_config(int socket, TAVConfigFormat *format, TAVConfigVideo *video, TAVC
         return -OS_ERROR;
     }
     
+    pktav_config_defaults(format, video, audio);
     pktav_config_kv_load(kv, format, video, audio);
 
     free_kv_list(kv);
@@ -249,6 +640,72 @@ int recv_input(int socket, char *file, size_t len) {
     return ret;
 }
 
+/**
+ * @brief Receive a control message from the client, if there is one.
+ *
+ * Control messages are kv strings like the config: "control:pause", "control:resume" or "control:cancel".
+ * A pause message can add "release:1" to free the frame memory of the job while it is paused.
+ *
+ * The socket is read without blocking and the messages are split on their NUL terminator: the messages
+ * received in the same read are returned by the next calls, and a partial message is kept until the 
+ * rest arrives.
+ *
+ * @param socket The socket of the client.
+ * @param timeout_ms Time to wait for a message, 0 to just check.
+ * @param release Set to 1 if the message asks to release the frame memory (it can be NULL).
+ *
+ * @return Returns CONTROL_NONE if there is no message (or it is unknown), CONTROL_PAUSE, CONTROL_RESUME, CONTROL_CANCEL
+ *         or -OS_ERROR if the client closed the connection or the socket failed.
+ */
+int recv_control(int socket, int timeout_ms, int *release) {
+    static TAVMsgBuffer pending = { .socket = -1 };
+    struct pollfd pfd = { .fd = socket, .events = POLLIN };
+    KeyValueList *kv = NULL;
+    char buffer[MAX_BUFFER_SIZE];
+    const char *value;
+    ssize_t len;
+    int ret;
+
+    pktav_errno = 0;
+
+    if (!msg_pending(&pending, socket)) {
+        while ((ret = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR);
+        if (ret < 0) {
+            pktav_errno = errno;
+            return -OS_ERROR;
+        }
+        if (ret == 0)
+            return CONTROL_NONE;
+    }
+
+    if ((len = recv_msg(socket, &pending, buffer, MAX_BUFFER_SIZE)) < 0) {
+        pktav_errno = errno ? errno : ECONNRESET;       // EOF: the client hung up
+        return -OS_ERROR;
+    }
+    if (len == 0)
+        return CONTROL_NONE;    /* Partial message, the rest is read later */
+    kv = kv_list_fromstring(buffer, PROTO_PAIRKV_DELIM, PROTO_KEYVAL_DELIM);
+    if (!kv) {
+        pktav_errno = errno;
+        return -OS_ERROR;
+    }
+
+    ret = CONTROL_NONE;
+    value = get_value_from_kv_list(kv, CONTROL_KEY);
+    if (value && !strcmp(value, "pause"))
+        ret = CONTROL_PAUSE;
+    else if (value && !strcmp(value, "resume"))
+        ret = CONTROL_RESUME;
+    else if (value && !strcmp(value, "cancel"))
+        ret = CONTROL_CANCEL;
+    value = get_value_from_kv_list(kv, "release");
+    if (release)
+        *release = value ? atoi(value) : 0;
+
+    free_kv_list(kv);
+    return ret;
+}
+
 int send_error(int socket, const char *error) {
     char buffer[MAX_BUFFER_SIZE];
     sprintf(buffer, "error%c%s", PROTO_KEYVAL_DELIM, error);
@@ -6,6 +6,13 @@
 
 #define MAX_BUFFER_SIZE 4096
 #define INPUT_FILE_KEY "input_file"
+#define CONTROL_KEY    "control"
+
+/* Control messages the client can send while the job runs */
+#define CONTROL_NONE   0
+#define CONTROL_PAUSE  1
+#define CONTROL_RESUME 2
+#define CONTROL_CANCEL 3
 
 #include "pktav_mediainfo.h"
 #include "pktav_types.h"
@@ -15,5 +22,6 @@ extern int send_status(int socket, TAVStatus *status);
 extern int recv_config(int socket, TAVConfigFormat *format, TAVConfigVideo *video, TAVConfigAudio *audio);
 extern int recv_input(int socket, char *file, size_t len);
 extern int send_error(int socket, const char *error);
+extern int recv_control(int socket, int timeout_ms, int *release);
 
 #endif
\ No newline at end of file
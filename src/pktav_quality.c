@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#include <libavutil/cpu.h>
+#include <libavutil/pixdesc.h>
+#include "pktav_quality.h"
+
+/* SSIM constants for the sums of 8x8 windows of 8 bit samples (like x264) */
+#define SSIM_C1 (int)(.01 * .01 * 255 * 255 * 64 + .5)
+#define SSIM_C2 (int)(.03 * .03 * 255 * 255 * 64 * 63 + .5)
+
+/*
+ * Sum of the squared differences of a plane. The rows are accumulated in 32 bits,
+ * which is enough for 8 bit samples up to 66000 pixels wide.
+ */
+static uint64_t pktav_plane_sse(const uint8_t *a, int as, const uint8_t *b, int bs, int width, int height) {
+    uint64_t sse = 0;
+    uint32_t row;
+    int x, y, d;
+
+    for (y = 0; y < height; y++, a += as, b += bs) {
+        row = 0;
+        for (x = 0; x < width; x++) {
+            d = a[x] - b[x];
+            row += d * d;
+        }
+        sse += row;
+    }
+    return sse;
+}
+
+/*
+ * Sums of every 4x4 block of a row of blocks: s1, s2, ss (a^2 + b^2) and s12.
+ */
+static void pktav_ssim_4x4_row(const uint8_t *a, int as, const uint8_t *b, int bs, int blocks, int32_t *sums) {
+    int x, y, i, va, vb;
+
+    memset(sums, 0, blocks * 4 * sizeof(int32_t));
+    for (y = 0; y < 4; y++, a += as, b += bs) {
+        for (x = 0; x < blocks; x++) {
+            for (i = 0; i < 4; i++) {
+                va = a[x * 4 + i];
+                vb = b[x * 4 + i];
+                sums[x * 4 + 0] += va;
+                sums[x * 4 + 1] += vb;
+                sums[x * 4 + 2] += va * va + vb * vb;
+                sums[x * 4 + 3] += va * vb;
+            }
+        }
+    }
+}
+
+static double pktav_ssim_end(int s1, int s2, int ss, int s12) {
+    int64_t vars = (int64_t)ss * 64 - (int64_t)s1 * s1 - (int64_t)s2 * s2;
+    int64_t covar = (int64_t)s12 * 64 - (int64_t)s1 * s2;
+
+    return (double)(2 * (int64_t)s1 * s2 + SSIM_C1) * (double)(2 * covar + SSIM_C2) /
+           ((double)((int64_t)s1 * s1 + (int64_t)s2 * s2 + SSIM_C1) * (double)(vars + SSIM_C2));
+}
+
+/*
+ * SSIM of a plane with 8x8 windows every 4 pixels. The 4x4 sums of the previous
+ * row of blocks are kept, so every pixel is read only once.
+ */
+static double pktav_plane_ssim(TAVQuality *q, const uint8_t *a, int as, const uint8_t *b, int bs, int width, int height) {
+    int blocks = width / 4, rows = height / 4;
+    int32_t *prev, *cur, *tmp;
+    double ssim = 0.0;
+    int x, y;
+
+    if (blocks < 2 || rows < 2)
+        return 1.0;
+
+    prev = q->ssim_sums;
+    cur = q->ssim_sums + blocks * 4;
+    pktav_ssim_4x4_row(a, as, b, bs, blocks, prev);
+    for (y = 1; y < rows; y++) {
+        pktav_ssim_4x4_row(a + 4 * y * as, as, b + 4 * y * bs, bs, blocks, cur);
+        for (x = 0; x < blocks - 1; x++) {
+            ssim += pktav_ssim_end(prev[x * 4 + 0] + prev[x * 4 + 4] + cur[x * 4 + 0] + cur[x * 4 + 4],
+                                   prev[x * 4 + 1] + prev[x * 4 + 5] + cur[x * 4 + 1] + cur[x * 4 + 5],
+                                   prev[x * 4 + 2] + prev[x * 4 + 6] + cur[x * 4 + 2] + cur[x * 4 + 6],
+                                   prev[x * 4 + 3] + prev[x * 4 + 7] + cur[x * 4 + 3] + cur[x * 4 + 7]);
+        }
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    return ssim / ((double)(blocks - 1) * (rows - 1));
+}
+
+static double pktav_psnr(uint64_t sse, uint64_t samples) {
+    double psnr;
+
+    if (sse == 0)
+        return QUALITY_MAX_PSNR;
+    psnr = 10.0 * log10(255.0 * 255.0 * samples / sse);
+    return psnr > QUALITY_MAX_PSNR ? QUALITY_MAX_PSNR : psnr;
+}
+
+/*
+ * Compare a source frame with its reconstruction and add the result to the aggregates.
+ */
+static int pktav_quality_measure(TAVQuality *q, const AVFrame *src, const AVFrame *rec) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->format);
+    uint64_t sse = 0, samples = 0, plane_sse;
+    double psnr_y = 0.0, psnr, ssim;
+    int p, w, h;
+
+    if (rec->format != src->format || rec->width != src->width || rec->height != src->height)
+        return AVERROR(EINVAL);
+
+    if (q->ssim_width != src->width) {
+        av_freep(&q->ssim_sums);
+        q->ssim_sums = av_malloc_array((src->width / 4) * 4 * 2, sizeof(int32_t));
+        if (!q->ssim_sums) {
+            q->ssim_width = 0;
+            return AVERROR(ENOMEM);
+        }
+        q->ssim_width = src->width;
+    }
+
+    for (p = 0; p < desc->nb_components; p++) {
+        w = p == 0 || p == 3 ? src->width : AV_CEIL_RSHIFT(src->width, desc->log2_chroma_w);
+        h = p == 0 || p == 3 ? src->height : AV_CEIL_RSHIFT(src->height, desc->log2_chroma_h);
+        plane_sse = pktav_plane_sse(src->data[p], src->linesize[p], rec->data[p], rec->linesize[p], w, h);
+        if (p == 0)
+            psnr_y = pktav_psnr(plane_sse, (uint64_t)w * h);
+        sse += plane_sse;
+        samples += (uint64_t)w * h;
+    }
+    psnr = pktav_psnr(sse, samples);
+    ssim = pktav_plane_ssim(q, src->data[0], src->linesize[0], rec->data[0], rec->linesize[0],
+                            src->width, src->height);
+
+    if (q->frames == 0 || psnr < q->psnr_min)
+        q->psnr_min = psnr;
+    if (q->frames == 0 || ssim < q->ssim_min)
+        q->ssim_min = ssim;
+    q->psnr_sum += psnr;
+    q->psnr_y_sum += psnr_y;
+    q->ssim_sum += ssim;
+    q->frames++;
+    return 0;
+}
+
+/*
+ * Look for the sampled source of a reconstructed frame. The recon frames of the
+ * encoder come in coding order, so any of the queued sources can match.
+ */
+static int pktav_quality_match(TAVQuality *q, const AVFrame *rec) {
+    int i, error;
+
+    for (i = 0; i < q->nb_refs; i++) {
+        if (q->refs[i]->pts == rec->pts) {
+            error = pktav_quality_measure(q, q->refs[i], rec);
+            av_frame_free(&q->refs[i]);
+            memmove(&q->refs[i], &q->refs[i + 1], (q->nb_refs - i - 1) * sizeof(AVFrame *));
+            q->nb_refs--;
+            return error;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Frames the encoder can hold before it returns the first reconstruction: the
+ * lookahead, the B-frames and one frame per frame thread. The lookahead can be
+ * raised later by the speed controller, so the one of the slowest presets is
+ * the minimum.
+ */
+static int pktav_quality_delay(AVCodecContext *enc) {
+    int64_t lookahead = 0;
+    int threads;
+
+    if (enc->priv_data && av_opt_get_int(enc->priv_data, "rc-lookahead", 0, &lookahead) < 0)
+        lookahead = 0;
+    threads = enc->thread_count > 0 ? enc->thread_count : av_cpu_count() * 3 / 2;
+    return FFMAX(lookahead, QUALITY_MAX_LOOKAHEAD) + FFMAX(enc->max_b_frames, 0) + threads + 1;
+}
+
+/**
+ * @brief Prepare the quality metrics of an opened video encoder.
+ *
+ * @param q Pointer to the TAVQuality structure to initialize.
+ * @param interval One frame of every `interval` frames sent to the encoder is measured.
+ * @param enc Pointer to the opened encoder.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *         - AVERROR(ENOSYS) if the pixel format of the encoder is not planar 8 bit YUV (or gray).
+ *
+ * @note The reconstructed frames are taken from the encoder when it was opened with AV_CODEC_FLAG_RECON_FRAME,
+ *       otherwise a decoder of the encoded packets is opened. All the packets must then be decoded, but
+ *       only the sampled frames are compared.
+ */
+int pktav_quality_init(TAVQuality *q, int interval, AVCodecContext *enc) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(enc->pix_fmt);
+    const AVCodec *codec;
+    AVCodecParameters *par = NULL;
+    int i, error;
+
+    memset(q, 0, sizeof(TAVQuality));
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)))
+        return AVERROR(ENOSYS);
+    for (i = 0; i < desc->nb_components; i++) {
+        /* One plane per component (no NV12), 8 bits */
+        if (desc->comp[i].plane != i || desc->comp[i].step != 1 || desc->comp[i].depth != 8)
+            return AVERROR(ENOSYS);
+    }
+
+    q->interval = interval > 0 ? interval : 1;
+    q->recon = (enc->flags & AV_CODEC_FLAG_RECON_FRAME) != 0;
+    q->max_refs = pktav_quality_delay(enc) / q->interval + 2;
+    if ((q->refs = av_calloc(q->max_refs, sizeof(AVFrame *))) == NULL)
+        return AVERROR(ENOMEM);
+    if ((q->frame = av_frame_alloc()) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if (q->recon)
+        return 0;
+
+    /* No recon frames: decode the encoded packets */
+    if ((codec = avcodec_find_decoder(enc->codec_id)) == NULL) {
+        error = AVERROR_DECODER_NOT_FOUND;
+        goto fail;
+    }
+    if ((q->dec = avcodec_alloc_context3(codec)) == NULL || (par = avcodec_parameters_alloc()) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((error = avcodec_parameters_from_context(par, enc)) < 0 ||
+        (error = avcodec_parameters_to_context(q->dec, par)) < 0)
+        goto fail;
+    q->dec->pkt_timebase = enc->time_base;
+    if ((error = avcodec_open2(q->dec, codec, NULL)) < 0)
+        goto fail;
+    avcodec_parameters_free(&par);
+    return 0;
+
+fail:
+    avcodec_parameters_free(&par);
+    pktav_quality_close(q);
+    return error;
+}
+
+/**
+ * @brief Keep a reference to a frame sent to the encoder if it is one of the sampled frames.
+ *
+ * @param q Pointer to the TAVQuality structure.
+ * @param frame Pointer to the (scaled) frame that is being sent to the encoder.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note Must be called before avcodec_send_frame(), with the final pts of the frame. The queue holds 
+ *       the sampled frames of the whole delay of the encoder, so it is only full when a reconstruction
+ *       never came: the oldest source is then dropped.
+ */
+int pktav_quality_source(TAVQuality *q, const AVFrame *frame) {
+    AVFrame *ref;
+
+    if (q->sent++ % q->interval != 0 || frame->pts == AV_NOPTS_VALUE)
+        return 0;
+
+    if (q->nb_refs == q->max_refs) {
+        av_frame_free(&q->refs[0]);
+        memmove(&q->refs[0], &q->refs[1], (q->max_refs - 1) * sizeof(AVFrame *));
+        q->nb_refs--;
+    }
+    if ((ref = av_frame_clone(frame)) == NULL)
+        return AVERROR(ENOMEM);
+    q->refs[q->nb_refs++] = ref;
+    return 0;
+}
+
+/**
+ * @brief Get the reconstruction of an encoded packet and measure it if it is a sampled frame.
+ *
+ * @param q Pointer to the TAVQuality structure.
+ * @param enc Pointer to the encoder the packet was received from.
+ * @param packet Pointer to the encoded packet, with the timestamps of the encoder (not rescaled yet).
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+int pktav_quality_packet(TAVQuality *q, AVCodecContext *enc, const AVPacket *packet) {
+    int error;
+
+    if (q->recon) {
+        error = avcodec_receive_frame(enc, q->frame);
+    } else {
+        if ((error = avcodec_send_packet(q->dec, packet)) < 0)
+            return error;
+        error = avcodec_receive_frame(q->dec, q->frame);
+    }
+
+    while (error >= 0) {
+        error = pktav_quality_match(q, q->frame);
+        av_frame_unref(q->frame);
+        if (error < 0 || q->recon)
+            return error;
+        error = avcodec_receive_frame(q->dec, q->frame);
+    }
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+/**
+ * @brief Measure the frames still buffered in the decoder at the end of the stream.
+ *
+ * @param q Pointer to the TAVQuality structure.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+int pktav_quality_flush(TAVQuality *q) {
+    int error;
+
+    if (q->recon || !q->dec)
+        return 0;
+
+    avcodec_send_packet(q->dec, NULL);
+    while ((error = avcodec_receive_frame(q->dec, q->frame)) >= 0) {
+        error = pktav_quality_match(q, q->frame);
+        av_frame_unref(q->frame);
+        if (error < 0)
+            return error;
+    }
+    return error == AVERROR_EOF ? 0 : error;
+}
+
+/**
+ * @brief Free the decoder and the frames of the quality metrics. The aggregates are kept.
+ *
+ * @param q Pointer to the TAVQuality structure. It can be called on a zeroed structure.
+ */
+void pktav_quality_close(TAVQuality *q) {
+    int i;
+
+    for (i = 0; i < q->nb_refs; i++)
+        av_frame_free(&q->refs[i]);
+    q->nb_refs = 0;
+    av_freep(&q->refs);
+    q->max_refs = 0;
+    avcodec_free_context(&q->dec);
+    av_frame_free(&q->frame);
+    av_freep(&q->ssim_sums);
+    q->ssim_width = 0;
+}
@@ -0,0 +1,41 @@
+#ifndef _PKTAV_QUALITY_H
+#define _PKTAV_QUALITY_H 1
+
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+
+#define QUALITY_MAX_LOOKAHEAD 60    // Lookahead of the slowest presets, the minimum delay assumed
+#define QUALITY_MAX_PSNR    100.0   // PSNR of identical frames
+
+/*
+ * Sampled quality metrics of the encoded video. One of every `interval` frames
+ * sent to the encoder is kept and compared (PSNR of all the planes, SSIM of the
+ * luma) with its reconstruction: the recon frames of the encoder when it can
+ * export them, or a decode of the encoded packets otherwise.
+ */
+typedef struct TAVQuality {
+    int            interval;        // One sampled frame every `interval` frames sent to the encoder
+    int            recon;           // The encoder exports its reconstructed frames
+    AVCodecContext *dec;            // Decoder of the encoded packets (no recon)
+    AVFrame        *frame;          // Reconstructed/decoded frame
+    AVFrame        **refs;          // Sampled source frames, oldest first
+    int            nb_refs;
+    int            max_refs;        // Sampled frames the encoder can hold before their reconstruction
+    int64_t        sent;            // Frames sent to the encoder
+    int32_t        *ssim_sums;      // SSIM: sums of the 4x4 blocks of two rows of blocks
+    int            ssim_width;      // SSIM: width of the frames of ssim_sums
+    int            frames;          // Frames measured
+    double         psnr_sum;        // PSNR of all the planes
+    double         psnr_y_sum;      // PSNR of the luma
+    double         ssim_sum;        // SSIM of the luma
+    double         psnr_min;
+    double         ssim_min;
+} TAVQuality;
+
+extern int  pktav_quality_init(TAVQuality *q, int interval, AVCodecContext *enc);
+extern int  pktav_quality_source(TAVQuality *q, const AVFrame *frame);
+extern int  pktav_quality_packet(TAVQuality *q, AVCodecContext *enc, const AVPacket *packet);
+extern int  pktav_quality_flush(TAVQuality *q);
+extern void pktav_quality_close(TAVQuality *q);
+
+#endif
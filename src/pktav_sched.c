@@ -0,0 +1,676 @@
+#define _GNU_SOURCE    /* CPU_SET, sched_setaffinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "pktav_sched.h"
+#include "pktav_proto.h"
+#include "pktav_error.h"
+#include "pktav_log.h"
+
+#define SCHED_ENCODE_PIXELS_PER_CORE 12e6   // Pixels/s encoded by one core at the x264 medium preset
+#define SCHED_DECODE_PIXELS_PER_CORE 150e6  // Pixels/s decoded by one core
+#define SCHED_MIN_COST               0.25
+#define SCHED_DEFAULT_FPS            25.0
+
+/* Cost of the x264/x265 presets relative to medium */
+static const struct {
+    const char *preset;
+    double     factor;
+} sched_presets[] = {
+    { "ultrafast", 0.15 }, { "superfast", 0.25 }, { "veryfast", 0.4 }, { "faster", 0.6 }, { "fast", 0.8 },
+    { "medium", 1.0 },     { "slow", 1.6 },       { "slower", 3.0 },   { "veryslow", 6.0 }, { "placebo", 20.0 },
+};
+
+/* Job of this worker process (one job per process), set by pktav_sched_submit */
+static TAVScheduler *sched_current = NULL;
+static int sched_current_slot = -1;
+/* Placement of the job of this worker (cpulist format) */
+static char sched_cpus[SCHED_MAX_CPUS * 4] = "";
+static int sched_node = -1;
+/* The memory policy is per thread: every placement is a new generation the threads apply */
+static volatile int sched_policy_gen = 0;
+static __thread int sched_thread_gen = 0;
+
+static int64_t sched_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Lock the scheduler. A worker that died holding the lock leaves the jobs
+ * consistent (every change is a single assignment), so it is just recovered.
+ */
+static void sched_lock(TAVScheduler *s) {
+    if (pthread_mutex_lock(&s->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&s->lock);
+}
+
+/*
+ * Free the cpus pinned to a job.
+ */
+static void sched_unplace(TAVScheduler *s, TAVSchedJob *job) {
+    int i, owner = (int)(job - s->jobs) + 1;
+
+    for (i = 0; i < s->nb_cpus; i++) {
+        if (s->cpu_owner[i] == owner)
+            s->cpu_owner[i] = 0;
+    }
+    job->nb_cpus = 0;
+}
+
+/*
+ * Pin an admitted job to free cpus of one NUMA node: the node it ran on before
+ * (resumed jobs) if it still has room, otherwise the node with most free cpus.
+ * A job that finds no free cpu (live jobs over the capacity) is not pinned.
+ */
+static void sched_place(TAVScheduler *s, TAVSchedJob *job) {
+    int free_cpus[SCHED_MAX_NODES] = { 0 };
+    int i, node, owner = (int)(job - s->jobs) + 1;
+
+    if (!s->placement)
+        return;
+    sched_unplace(s, job);
+    for (i = 0; i < s->nb_cpus; i++) {
+        if (s->cpu_node[i] >= 0 && s->cpu_owner[i] == 0)
+            free_cpus[s->cpu_node[i]]++;
+    }
+    node = job->node;
+    if (node < 0 || free_cpus[node] < job->threads) {
+        for (i = 1, node = 0; i < SCHED_MAX_NODES; i++) {
+            if (free_cpus[i] > free_cpus[node])
+                node = i;
+        }
+    }
+    if (free_cpus[node] == 0)
+        return;
+
+    job->node = node;
+    for (i = 0; i < s->nb_cpus && job->nb_cpus < job->threads; i++) {
+        if (s->cpu_node[i] == node && s->cpu_owner[i] == 0) {
+            s->cpu_owner[i] = owner;
+            job->nb_cpus++;
+        }
+    }
+}
+
+/*
+ * Prefer the node of the job for the new memory of the calling thread.
+ */
+static void sched_mempolicy(int node) {
+    unsigned long nodemask;
+
+    if (node >= 0) {
+        nodemask = 1UL << node;
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8);
+    } else {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    }
+}
+
+/*
+ * Apply the placement of the job of this worker to all its threads (a resumed
+ * job has decoder and muxing threads already) and prefer its node for the new
+ * memory, so the frame buffers are node-local. The affinity is set here for
+ * every thread, but set_mempolicy only changes the calling thread: the other
+ * threads apply it in pktav_sched_thread_policy(), and the threads created
+ * from now on inherit it.
+ */
+static void sched_apply(TAVScheduler *s, TAVSchedJob *job) {
+    struct dirent *entry;
+    cpu_set_t set;
+    DIR *dir;
+    int i, len = 0, owner = (int)(job - s->jobs) + 1;
+
+    CPU_ZERO(&set);
+    sched_cpus[0] = '\0';
+    for (i = 0; i < s->nb_cpus; i++) {
+        if (job->nb_cpus > 0 ? s->cpu_owner[i] != owner : s->cpu_node[i] < 0)
+            continue;
+        CPU_SET(i, &set);
+        /* cpulist: ranges of consecutive cpus */
+        if (job->nb_cpus > 0 && (i == 0 || s->cpu_owner[i - 1] != owner))
+            len += snprintf(sched_cpus + len, sizeof(sched_cpus) - len, "%s%d", len ? "," : "", i);
+        else if (job->nb_cpus > 0 && (i == s->nb_cpus - 1 || s->cpu_owner[i + 1] != owner))
+            len += snprintf(sched_cpus + len, sizeof(sched_cpus) - len, "-%d", i);
+    }
+    sched_node = job->nb_cpus > 0 ? job->node : -1;
+
+    if ((dir = opendir("/proc/self/task")) != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.')
+                sched_setaffinity(atoi(entry->d_name), sizeof(cpu_set_t), &set);
+        }
+        closedir(dir);
+    }
+    sched_mempolicy(sched_node);
+    sched_thread_gen = ++sched_policy_gen;
+    if (sched_node >= 0)
+        pktav_log(NULL, 0, "Scheduler: job pinned to node %d, cpus %s\n", sched_node, sched_cpus);
+}
+
+static void sched_release(TAVScheduler *s, TAVSchedJob *job) {
+    sched_unplace(s, job);
+    if (job->state == SCHED_RUNNING)
+        s->used -= job->cost;
+    if (s->used < 0)
+        s->used = 0;
+    job->state = SCHED_FREE;
+    job->pid = 0;
+    job->paused = 0;
+    job->preempt = 0;
+}
+
+/*
+ * Free the jobs of the workers that died without calling pktav_sched_done().
+ */
+static void sched_reap(TAVScheduler *s) {
+    int i;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++) {
+        if (s->jobs[i].state != SCHED_FREE && kill(s->jobs[i].pid, 0) < 0 && errno == ESRCH) {
+            pktav_log(NULL, 0, "Scheduler: worker %d died, job released\n", (int)s->jobs[i].pid);
+            sched_release(s, &s->jobs[i]);
+        }
+    }
+}
+
+/*
+ * Queue order: priority class, then earliest deadline (jobs without one go
+ * last), then submission order.
+ */
+static int sched_before(const TAVSchedJob *a, const TAVSchedJob *b) {
+    int64_t da = a->deadline_ms > 0 ? a->deadline_ms : INT64_MAX;
+    int64_t db = b->deadline_ms > 0 ? b->deadline_ms : INT64_MAX;
+
+    if (a->priority != b->priority)
+        return a->priority < b->priority;
+    if (da != db)
+        return da < db;
+    return a->seq < b->seq;
+}
+
+/*
+ * Slots of the queued jobs in queue order.
+ */
+static int sched_queue(TAVScheduler *s, int *order) {
+    int i, j, n = 0;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++) {
+        if (s->jobs[i].state != SCHED_QUEUED)
+            continue;
+        for (j = n; j > 0 && sched_before(&s->jobs[i], &s->jobs[order[j - 1]]); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+        n++;
+    }
+    return n;
+}
+
+static int sched_running(TAVScheduler *s) {
+    int i, n = 0;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++)
+        n += s->jobs[i].state == SCHED_RUNNING;
+    return n;
+}
+
+/*
+ * Ask running bulk jobs to pause until `need` cores are free, the most recently
+ * started first. The cores of the jobs already asked count as freed.
+ */
+static void sched_preempt(TAVScheduler *s, double need) {
+    TAVSchedJob *job, *last;
+    int i;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++) {
+        if (s->jobs[i].state == SCHED_RUNNING && s->jobs[i].preempt)
+            need -= s->jobs[i].cost;
+    }
+    while (need > 0) {
+        for (i = 0, last = NULL; i < SCHED_MAX_JOBS; i++) {
+            job = &s->jobs[i];
+            if (job->state == SCHED_RUNNING && job->priority == SCHED_CLASS_BULK && !job->preempt &&
+                (!last || job->start_ms > last->start_ms))
+                last = job;
+        }
+        if (!last)
+            break;
+        last->preempt = 1;
+        need -= last->cost;
+        pktav_log(NULL, 0, "Scheduler: preempting bulk job of worker %d\n", (int)last->pid);
+    }
+}
+
+/*
+ * Admit the queued jobs that fit in the free cores, in queue order. Smaller jobs
+ * can backfill behind a standard/bulk job that does not fit, but nothing is
+ * admitted behind a paid job that is waiting, so it is not delayed by backfill.
+ * Live and paid jobs that do not fit preempt the running bulk jobs.
+ */
+static void sched_admit(TAVScheduler *s) {
+    int order[SCHED_MAX_JOBS];
+    TAVSchedJob *job;
+    int i, n, admitted = 0;
+
+    n = sched_queue(s, order);
+    for (i = 0; i < n; i++) {
+        job = &s->jobs[order[i]];
+        if (job->priority == SCHED_CLASS_LIVE || s->used + job->cost <= s->capacity || sched_running(s) == 0) {
+            job->state = SCHED_RUNNING;
+            job->start_ms = sched_now_ms();
+            s->used += job->cost;
+            sched_place(s, job);
+            admitted++;
+        } else if (job->priority <= SCHED_CLASS_PAID) {
+            sched_preempt(s, s->used + job->cost - s->capacity);
+            break;
+        }
+    }
+    if (s->used > s->capacity)
+        sched_preempt(s, s->used - s->capacity);
+    if (admitted)
+        pthread_cond_broadcast(&s->cond);
+}
+
+/*
+ * Position of a queued job and when it is expected to start: the running jobs
+ * end at their estimated time and the queued jobs ahead start as soon as
+ * enough cores are free.
+ */
+static void sched_expected(TAVScheduler *s, int slot, int *position, int64_t *start_ms) {
+    int order[SCHED_MAX_JOBS];
+    int64_t end_ms[SCHED_MAX_JOBS * 2];
+    double cost[SCHED_MAX_JOBS * 2];
+    int64_t now = sched_now_ms(), t = now;
+    double avail = s->capacity - s->used;
+    int i, j, k, n, nb_events = 0;
+
+    for (i = 0; i < SCHED_MAX_JOBS; i++) {
+        if (s->jobs[i].state == SCHED_RUNNING) {
+            end_ms[nb_events] = FFMAX(s->jobs[i].start_ms + s->jobs[i].duration_ms, now);
+            cost[nb_events++] = s->jobs[i].cost;
+        }
+    }
+
+    n = sched_queue(s, order);
+    for (i = 0; i < n; i++) {
+        while (avail < s->jobs[order[i]].cost && nb_events > 0) {
+            for (j = 1, k = 0; j < nb_events; j++) {
+                if (end_ms[j] < end_ms[k])
+                    k = j;
+            }
+            t = FFMAX(t, end_ms[k]);
+            avail += cost[k];
+            end_ms[k] = end_ms[--nb_events];
+            cost[k] = cost[nb_events];
+        }
+        if (order[i] == slot) {
+            *position = i + 1;
+            *start_ms = t - now;
+            return;
+        }
+        end_ms[nb_events] = t + s->jobs[order[i]].duration_ms;
+        cost[nb_events++] = s->jobs[order[i]].cost;
+        avail -= s->jobs[order[i]].cost;
+    }
+    *position = 0;
+    *start_ms = 0;
+}
+
+/**
+ * @brief Create the scheduler in an anonymous shared mapping, before the workers are forked.
+ *
+ * @param capacity Cores available for the jobs.
+ *
+ * @return Returns the scheduler, or NULL on failure (pktav_errno is set).
+ */
+TAVScheduler *pktav_sched_create(double capacity) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    TAVScheduler *s;
+
+    s = mmap(NULL, sizeof(TAVScheduler), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED) {
+        pktav_errno = errno;
+        return NULL;
+    }
+    memset(s, 0, sizeof(TAVScheduler));
+    s->capacity = capacity > 0 ? capacity : 1;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&s->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    pktav_errno = 0;
+    return s;
+}
+
+/**
+ * @brief Enable the placement of the jobs: every job is pinned to cpus of one NUMA node.
+ *
+ * The topology is read from /sys/devices/system/node, without it all the online cpus are one node.
+ *
+ * @param s Pointer to the TAVScheduler.
+ *
+ * @return Returns the number of NUMA nodes found.
+ *
+ * @note Must be called in the daemon before forking the workers.
+ */
+int pktav_sched_placement(TAVScheduler *s) {
+    char path[64];
+    int node, first, last, nodes = 0;
+    FILE *fp;
+
+    for (first = 0; first < SCHED_MAX_CPUS; first++)
+        s->cpu_node[first] = -1;
+    s->nb_cpus = 0;
+
+    for (node = 0; node < SCHED_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        /* cpulist: 0-7,16-23 */
+        while (fscanf(fp, "%d", &first) == 1) {
+            if (fscanf(fp, "-%d", &last) != 1)
+                last = first;
+            for (; first <= last && first < SCHED_MAX_CPUS; first++)
+                s->cpu_node[first] = node;
+            s->nb_cpus = FFMAX(s->nb_cpus, FFMIN(last + 1, SCHED_MAX_CPUS));
+            if (fgetc(fp) != ',')
+                break;
+        }
+        fclose(fp);
+        nodes++;
+    }
+    if (nodes == 0) {
+        s->nb_cpus = FFMIN((int)sysconf(_SC_NPROCESSORS_ONLN), SCHED_MAX_CPUS);
+        for (first = 0; first < s->nb_cpus; first++)
+            s->cpu_node[first] = 0;
+        nodes = 1;
+    }
+    s->placement = s->nb_cpus > 0;
+    return nodes;
+}
+
+/**
+ * @brief Get the priority class of a job.
+ *
+ * @param priority Priority requested by the client: "paid", "standard" or "bulk" (NULL = standard).
+ * @param live The job is a live transcode, it always gets the live class.
+ *
+ * @return Returns the SCHED_CLASS_* of the job.
+ */
+int pktav_sched_class(const char *priority, int live) {
+    if (live)
+        return SCHED_CLASS_LIVE;
+    if (priority && strcasecmp(priority, "paid") == 0)
+        return SCHED_CLASS_PAID;
+    if (priority && strcasecmp(priority, "bulk") == 0)
+        return SCHED_CLASS_BULK;
+    return SCHED_CLASS_STANDARD;
+}
+
+/**
+ * @brief Estimate the cores a job needs to run at realtime speed.
+ *
+ * @param mi Pointer to the TAVInfo of the input (decode cost).
+ * @param video Pointer to the TAVConfigVideo of the job (encode cost: resolution, frame rate and preset).
+ *
+ * @return Returns the estimated cores.
+ */
+double pktav_sched_cost(TAVInfo *mi, TAVConfigVideo *video) {
+    double in_fps = mi->fps > 0 ? mi->fps : SCHED_DEFAULT_FPS;
+    double out_fps = video->output_framerate.num > 0 ? av_q2d(video->output_framerate) : in_fps;
+    double out_pixels = (double)(video->width > 0 ? video->width : mi->width) *
+                        (video->height > 0 ? video->height : mi->height);
+    double factor = 1.0, cost;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(sched_presets) / sizeof(sched_presets[0])); i++) {
+        if (video->preset && strcmp(video->preset, sched_presets[i].preset) == 0)
+            factor = sched_presets[i].factor;
+    }
+
+    cost = out_pixels * out_fps * factor / SCHED_ENCODE_PIXELS_PER_CORE +
+           (double)mi->width * mi->height * in_fps / SCHED_DECODE_PIXELS_PER_CORE;
+    return cost > SCHED_MIN_COST ? cost : SCHED_MIN_COST;
+}
+
+/**
+ * @brief Add a job to the queue of the scheduler.
+ *
+ * @param s Pointer to the TAVScheduler.
+ * @param priority Priority class of the job (SCHED_CLASS_*).
+ * @param deadline_ms Deadline of the job in ms from now (0 = none).
+ * @param cost Estimated cores of the job (pktav_sched_cost).
+ * @param threads Thread budget of the job, the cores pinned to it with placement (0 = its estimated cores).
+ * @param duration_ms Estimated run time of the job.
+ *
+ * @return Returns the slot of the job, or -PK_ERROR if the queue is full (pktav_errno is set).
+ */
+int pktav_sched_submit(TAVScheduler *s, int priority, int deadline_ms, double cost, int threads, int64_t duration_ms) {
+    TAVSchedJob *job;
+    int i;
+
+    sched_lock(s);
+    sched_reap(s);
+    for (i = 0; i < SCHED_MAX_JOBS && s->jobs[i].state != SCHED_FREE; i++);
+    if (i == SCHED_MAX_JOBS) {
+        pthread_mutex_unlock(&s->lock);
+        pktav_errno = PK_ERROR_QUEUEFULL;
+        return -PK_ERROR;
+    }
+
+    job = &s->jobs[i];
+    job->pid = getpid();
+    job->priority = priority;
+    job->deadline_ms = deadline_ms > 0 ? sched_now_ms() + deadline_ms : 0;
+    job->seq = ++s->seq;
+    job->cost = cost;
+    job->duration_ms = duration_ms;
+    job->threads = threads > 0 ? threads : FFMAX(1, (int)ceil(cost));
+    job->node = -1;
+    job->nb_cpus = 0;
+    job->start_ms = 0;
+    job->paused = 0;
+    job->preempt = 0;
+    job->state = SCHED_QUEUED;
+    pthread_mutex_unlock(&s->lock);
+
+    sched_current = s;
+    sched_current_slot = i;
+    pktav_errno = 0;
+    return i;
+}
+
+/*
+ * Wait until a job is admitted, sending its queue position and expected start to the client.
+ * The job keeps its slot on error, the caller releases it.
+ */
+static int sched_wait(TAVScheduler *s, int slot, int socket) {
+    TAVSchedJob *job = &s->jobs[slot];
+    TAVStatus status;
+    struct timespec ts;
+    int64_t queued_ms = sched_now_ms(), start_ms;
+    int position, error;
+
+    sched_lock(s);
+    while (job->state == SCHED_QUEUED) {
+        sched_reap(s);
+        sched_admit(s);
+        if (job->state != SCHED_QUEUED)
+            break;
+        sched_expected(s, slot, &position, &start_ms);
+        pthread_mutex_unlock(&s->lock);
+
+        memset(&status, 0, sizeof(TAVStatus));
+        status.status = job->paused ? 3 : 6;
+        status.status_desc = job->paused ? "PAUSED" : "QUEUED";
+        status.err_msg = "";
+        status.proc_time_ms = sched_now_ms() - queued_ms;
+        status.queue_position = position;
+        status.expected_start_ms = start_ms;
+        if ((error = send_status(socket, &status)) < 0)
+            return error;
+        if ((error = recv_control(socket, 0, NULL)) < 0 || error == CONTROL_CANCEL) {
+            pktav_errno = PK_ERROR_CANCELLED;
+            return -PK_ERROR;
+        }
+
+        sched_lock(s);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += SCHED_WAIT_MS / 1000;
+        ts.tv_nsec += (SCHED_WAIT_MS % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&s->cond, &s->lock, &ts) == EOWNERDEAD)
+            pthread_mutex_consistent(&s->lock);
+    }
+    job->paused = 0;
+    if (s->placement)
+        sched_apply(s, job);
+    pthread_mutex_unlock(&s->lock);
+
+    pktav_log(NULL, 0, "Scheduler: job admitted after %ld ms (%.2f cores, %.2f/%.2f in use)\n",
+                       (long)(sched_now_ms() - queued_ms), job->cost, s->used, s->capacity);
+    return 0;
+}
+
+/**
+ * @brief Wait until a job is admitted, sending its queue position and expected start to the client.
+ *
+ * @param s Pointer to the TAVScheduler.
+ * @param slot Slot of the job (pktav_sched_submit).
+ * @param socket The socket of the client, a QUEUED status is sent every SCHED_WAIT_MS.
+ *
+ * @return Returns 0 when the job can run, -PK_ERROR (PK_ERROR_CANCELLED) if the client cancelled the job 
+ *         or hung up, or the error of send_status. The job is then removed from the queue.
+ *
+ * @note Other control messages (pause/resume) are ignored while the job is queued.
+ */
+int pktav_sched_wait(TAVScheduler *s, int slot, int socket) {
+    int error;
+
+    if ((error = sched_wait(s, slot, socket)) < 0)
+        pktav_sched_done(s, slot);
+    return error;
+}
+
+/**
+ * @brief Remove a job from the scheduler and admit the queued jobs that fit in the freed cores.
+ *
+ * @param s Pointer to the TAVScheduler.
+ * @param slot Slot of the job (pktav_sched_submit).
+ *
+ * @note Only the worker of the job releases it: a slot already released (and maybe taken by another 
+ *       job) is left alone.
+ */
+void pktav_sched_done(TAVScheduler *s, int slot) {
+    sched_lock(s);
+    if (s->jobs[slot].state != SCHED_FREE && s->jobs[slot].pid == getpid())
+        sched_release(s, &s->jobs[slot]);
+    sched_admit(s);
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * @brief Check if the scheduler asked the job of this worker to pause (preemption).
+ *
+ * @return Returns 1 if the job must pause at its next GOP boundary, 0 otherwise.
+ */
+int pktav_sched_preempted(void) {
+    return sched_current && sched_current->jobs[sched_current_slot].preempt;
+}
+
+/**
+ * @brief Pause the job of this worker: its cores are released and it leaves the queue until it is resumed.
+ */
+void pktav_sched_pause(void) {
+    TAVScheduler *s = sched_current;
+    TAVSchedJob *job;
+
+    if (!s)
+        return;
+    sched_lock(s);
+    job = &s->jobs[sched_current_slot];
+    if (job->state == SCHED_RUNNING)
+        s->used -= job->cost;
+    sched_unplace(s, job);
+    job->state = SCHED_PAUSED;
+    job->preempt = 0;
+    sched_admit(s);
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * @brief Queue the paused job of this worker again and wait until it is admitted.
+ *
+ * The job keeps its submission order, so it runs before the jobs of its class submitted after it.
+ *
+ * @param socket The socket of the client, a PAUSED status is sent while the job waits.
+ *
+ * @return Returns 0 when the job can run, or an error if the client is gone or cancelled the job
+ *         (see pktav_sched_wait). The job keeps its slot, pktav_sched_done releases it.
+ */
+int pktav_sched_resume(int socket) {
+    TAVScheduler *s = sched_current;
+
+    if (!s)
+        return 0;
+    sched_lock(s);
+    s->jobs[sched_current_slot].state = SCHED_QUEUED;
+    s->jobs[sched_current_slot].paused = 1;
+    pthread_mutex_unlock(&s->lock);
+    return sched_wait(s, sched_current_slot, socket);
+}
+
+/**
+ * @brief Apply the memory policy of the job placement to the calling thread, if it changed.
+ *
+ * @note Called by the threads that already existed when the job was placed (muxing threads and the
+ *       decoder threads through the frame pool), it is only a comparison when nothing changed.
+ */
+void pktav_sched_thread_policy(void) {
+    int gen = sched_policy_gen;
+
+    if (sched_thread_gen == gen)
+        return;
+    sched_thread_gen = gen;
+    sched_mempolicy(sched_node);
+}
+
+/**
+ * @brief Report the placement of the job of this worker.
+ *
+ * @param status Pointer to the TAVStatus where the NUMA node and the cpus are set (only if the job is pinned).
+ */
+void pktav_sched_status(TAVStatus *status) {
+    if (!sched_cpus[0])
+        return;
+    status->numa_node = sched_node;
+    status->cpus = sched_cpus;
+}
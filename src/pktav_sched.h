@@ -0,0 +1,73 @@
+#ifndef _PKTAV_SCHED_H
+#define _PKTAV_SCHED_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "pktav_mediainfo.h"
+#include "pktav_types.h"
+
+#define SCHED_MAX_JOBS      64
+#define SCHED_WAIT_MS       1000    // Queued jobs check the queue (and send their status) every second
+#define SCHED_MAX_CPUS      256
+#define SCHED_MAX_NODES     64
+
+/* Priority classes, the lower the sooner */
+#define SCHED_CLASS_LIVE      0     // Never queued, admitted even over the capacity
+#define SCHED_CLASS_PAID      1
+#define SCHED_CLASS_STANDARD  2
+#define SCHED_CLASS_BULK      3     // Backfill
+
+#define SCHED_FREE     0
+#define SCHED_QUEUED   1
+#define SCHED_RUNNING  2
+#define SCHED_PAUSED   3      // Paused (client or preemption), out of the queue and without cores
+
+typedef struct {
+    int      state;             // SCHED_FREE, SCHED_QUEUED, SCHED_RUNNING or SCHED_PAUSED
+    int      paused;            // Queued again after a pause (resume), reported as PAUSED
+    int      preempt;           // The scheduler asks the job to pause at its next GOP boundary
+    pid_t    pid;               // Worker process of the job
+    int      priority;          // SCHED_CLASS_*
+    int64_t  deadline_ms;       // Absolute deadline (CLOCK_MONOTONIC ms), 0 if none
+    uint64_t seq;               // Submission order
+    int64_t  start_ms;          // When the job started running (CLOCK_MONOTONIC ms)
+    int64_t  duration_ms;       // Estimated run time
+    double   cost;              // Estimated cores
+    int      threads;           // Thread budget: cores pinned to the job
+    int      node;              // NUMA node of the job, -1 if not placed
+    int      nb_cpus;           // Cpus pinned to the job (0 = not pinned)
+} TAVSchedJob;
+
+/*
+ * Job scheduler shared by all the worker processes. It lives in an anonymous
+ * shared mapping created by the daemon before forking, so the mutex and the
+ * condition variable are process-shared.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    double          capacity;   // Cores available for the jobs
+    double          used;       // Cores of the running jobs
+    uint64_t        seq;
+    TAVSchedJob     jobs[SCHED_MAX_JOBS];
+    int             placement;                  // Pin the jobs to cpus of one NUMA node
+    int             nb_cpus;
+    int16_t         cpu_node[SCHED_MAX_CPUS];   // NUMA node of every cpu, -1 if offline
+    int16_t         cpu_owner[SCHED_MAX_CPUS];  // Slot + 1 of the job pinned to the cpu, 0 if free
+} TAVScheduler;
+
+extern TAVScheduler *pktav_sched_create(double capacity);
+extern int    pktav_sched_placement(TAVScheduler *s);
+extern int    pktav_sched_class(const char *priority, int live);
+extern double pktav_sched_cost(TAVInfo *mi, TAVConfigVideo *video);
+extern int    pktav_sched_submit(TAVScheduler *s, int priority, int deadline_ms, double cost, int threads, int64_t duration_ms);
+extern int    pktav_sched_wait(TAVScheduler *s, int slot, int socket);
+extern void   pktav_sched_done(TAVScheduler *s, int slot);
+extern int    pktav_sched_preempted(void);
+extern void   pktav_sched_pause(void);
+extern int    pktav_sched_resume(int socket);
+extern void   pktav_sched_thread_policy(void);
+extern void   pktav_sched_status(TAVStatus *status);
+
+#endif
@@ -5,6 +5,8 @@
 #include <sys/wait.h>
 #include "pktav_log.h"
 #include "pktav_error.h"
+#include "pktav_cgroup.h"
+#include "pktav_metrics.h"
 
 void sigchld_handler(int signo) {
     int status;
@@ -15,7 +17,9 @@ void sigchld_handler(int signo) {
             pktav_log(NULL, 0, "End process (Pid:%d) with status: %d\n", pid, WEXITSTATUS(status));
         } else if (WIFSIGNALED(status)) {
             pktav_log(NULL, 0, "End process (Pid:%d) by a signal: %d\n", pid, WTERMSIG(status));
+            pktav_metrics_result(METRICS_CRASHED);
         }
+        pktav_cgroup_reaped(pid);
     }
 }
 
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <libavutil/time.h>
+#include "pktav_stages.h"
+#include "pktav_log.h"
+
+static const char *stage_names[MAX_STAGES] = { "demux", "decode", "scale", "encode", "mux", "audio" };
+
+static int hist_index(int64_t us) {
+    int e;
+
+    if (us < 0)
+        us = 0;
+    if (us > UINT32_MAX)
+        us = UINT32_MAX;
+    if (us < (1 << HIST_SUB_BITS))
+        return (int)us;
+    /* Exponent: the value shifted by e has HIST_SUB_BITS bits */
+    e = 63 - __builtin_clzll((uint64_t)us) - HIST_SUB_BITS + 1;
+    return (e << (HIST_SUB_BITS - 1)) + (int)(us >> e);
+}
+
+/* Highest value of a bucket */
+static int64_t hist_value(int index) {
+    int half = 1 << (HIST_SUB_BITS - 1);
+    int e;
+
+    if (index < (1 << HIST_SUB_BITS))
+        return index;
+    e = index / half - 1;
+    return (((int64_t)(index % half + half) + 1) << e) - 1;
+}
+
+void pktav_hist_add(TAVHistogram *h, int64_t us) {
+    h->counts[hist_index(us)]++;
+    h->count++;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+void pktav_hist_merge(TAVHistogram *dst, const TAVHistogram *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->count += src->count;
+    if (src->max_us > dst->max_us)
+        dst->max_us = src->max_us;
+}
+
+/**
+ * @brief Value at a percentile of a histogram.
+ *
+ * @param h Pointer to the TAVHistogram.
+ * @param pct Percentile (0-100).
+ *
+ * @return Returns the highest value of the bucket of the percentile (never over the maximum), 0 if empty.
+ */
+int64_t pktav_hist_percentile(const TAVHistogram *h, double pct) {
+    int64_t rank, seen = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    rank = (int64_t)(h->count * pct / 100.0 + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max_us ? hist_value(i) : h->max_us;
+    }
+    return h->max_us;
+}
+
+int64_t pktav_thread_cpu_us(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+        return 0;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t process_cpu_us(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) < 0)
+        return 0;
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void pktav_stages_init(TAVStages *s) {
+    memset(s, 0, sizeof(TAVStages));
+    s->cpu_start_us = process_cpu_us();
+}
+
+/**
+ * @brief Start a timed call.
+ *
+ * @param s Pointer to the TAVStages, NULL if the stages are not measured (only the wall clock is read, 
+ *          it is also the start of the trace span).
+ * @param clock Pointer to the TAVStageClock of the call.
+ */
+void pktav_stage_begin(TAVStages *s, TAVStageClock *clock) {
+    clock->wall_us = av_gettime_relative();
+    clock->cpu_us = s ? pktav_thread_cpu_us() : 0;
+}
+
+/**
+ * @brief End a timed call.
+ *
+ * @param s Pointer to the TAVStages (NULL = not measured).
+ * @param stage STAGE_*.
+ * @param clock Pointer to the TAVStageClock started by pktav_stage_begin().
+ * @param sample The call produced a frame or packet: the time since the last sample is added to the histogram.
+ */
+void pktav_stage_end(TAVStages *s, int stage, TAVStageClock *clock, int sample) {
+    int64_t wall_us;
+
+    if (!s)
+        return;
+    wall_us = av_gettime_relative() - clock->wall_us;
+    s->wall_us[stage] += wall_us;
+    s->cpu_us[stage] += pktav_thread_cpu_us() - clock->cpu_us;
+    s->pending_us[stage] += wall_us;
+    if (sample) {
+        pktav_hist_add(&s->hist[stage], s->pending_us[stage]);
+        s->pending_us[stage] = 0;
+    }
+}
+
+/**
+ * @brief Report the stages: p50/p99/max per sample and wall/CPU time of every stage, and the CPU of the job.
+ *
+ * @param s Pointer to the TAVStages. The muxing stage must be already merged (pktav_output_stages).
+ * @param status Pointer to the TAVStatus (FINISH).
+ *
+ * @note The summary is also written to the log of the job.
+ */
+void pktav_stages_status(TAVStages *s, TAVStatus *status) {
+    TAVStageStatus *st;
+    int64_t stages_cpu_us = 0;
+    int i;
+
+    status->nb_stages = 0;
+    for (i = 0; i < MAX_STAGES; i++) {
+        stages_cpu_us += s->cpu_us[i];
+        if (s->hist[i].count == 0)
+            continue;
+        st = &status->stages[status->nb_stages++];
+        st->name = stage_names[i];
+        st->count = s->hist[i].count;
+        st->p50_us = pktav_hist_percentile(&s->hist[i], 50);
+        st->p99_us = pktav_hist_percentile(&s->hist[i], 99);
+        st->max_us = s->hist[i].max_us;
+        st->wall_ms = s->wall_us[i] / 1000;
+        st->cpu_ms = s->cpu_us[i] / 1000;
+        pktav_log(NULL, 0, "Stage %-6s: %" PRId64 " samples, p50 %.2f ms, p99 %.2f ms, max %.2f ms, wall %ld ms, cpu %ld ms\n",
+                           st->name, st->count, st->p50_us / 1000.0, st->p99_us / 1000.0, st->max_us / 1000.0,
+                           st->wall_ms, st->cpu_ms);
+    }
+    status->cpu_ms = (process_cpu_us() - s->cpu_start_us) / 1000;
+    status->threads_cpu_ms = status->cpu_ms > stages_cpu_us / 1000 ? status->cpu_ms - stages_cpu_us / 1000 : 0;
+    pktav_log(NULL, 0, "Job cpu %ld ms (codec threads %ld ms), %.2f fps\n", status->cpu_ms, status->threads_cpu_ms,
+                       status->fps);
+}
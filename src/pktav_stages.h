@@ -0,0 +1,57 @@
+#ifndef _PKTAV_STAGES_H
+#define _PKTAV_STAGES_H 1
+
+#include <stdint.h>
+#include "pktav_types.h"
+
+/* Stages of the pipeline (MAX_STAGES in pktav_types.h) */
+#define STAGE_DEMUX   0     // av_read_frame, per packet
+#define STAGE_DECODE  1     // Video decoder, per decoded frame (send_packet + receive_frame)
+#define STAGE_SCALE   2     // sws_scale, per frame
+#define STAGE_ENCODE  3     // Video encoder, per frame sent (send_frame + receive_packet)
+#define STAGE_MUX     4     // av_interleaved_write_frame in the muxing threads, per packet
+#define STAGE_AUDIO   5     // Audio decoder and encoder, per frame
+
+/*
+ * HDR-style histogram of durations in us: linear up to 2^HIST_SUB_BITS, then 
+ * 2^(HIST_SUB_BITS-1) buckets per power of two (~3% of error) up to 2^32 us.
+ */
+#define HIST_SUB_BITS   6
+#define HIST_BUCKETS    ((32 - HIST_SUB_BITS + 2) << (HIST_SUB_BITS - 1))
+
+typedef struct {
+    uint32_t counts[HIST_BUCKETS];
+    int64_t  count;
+    int64_t  max_us;
+} TAVHistogram;
+
+/* Start of a timed call (wall clock and CPU of the calling thread) */
+typedef struct {
+    int64_t wall_us;
+    int64_t cpu_us;
+} TAVStageClock;
+
+/*
+ * Stages of the pipeline thread of a worker. The time of the calls that do 
+ * not produce a frame (EAGAIN, the encoder output) is carried to the next 
+ * sample, so the samples add up to the time of the stage.
+ */
+typedef struct TAVStages {
+    TAVHistogram hist[MAX_STAGES];
+    int64_t wall_us[MAX_STAGES];
+    int64_t cpu_us[MAX_STAGES];
+    int64_t pending_us[MAX_STAGES];     // Time not yet counted in a sample
+    int64_t cpu_start_us;               // CPU of the process when the job started
+} TAVStages;
+
+extern void    pktav_hist_add(TAVHistogram *h, int64_t us);
+extern void    pktav_hist_merge(TAVHistogram *dst, const TAVHistogram *src);
+extern int64_t pktav_hist_percentile(const TAVHistogram *h, double pct);
+
+extern int64_t pktav_thread_cpu_us(void);
+extern void    pktav_stages_init(TAVStages *s);
+extern void    pktav_stage_begin(TAVStages *s, TAVStageClock *clock);
+extern void    pktav_stage_end(TAVStages *s, int stage, TAVStageClock *clock, int sample);
+extern void    pktav_stages_status(TAVStages *s, TAVStatus *status);
+
+#endif
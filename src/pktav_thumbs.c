@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+#include "pktav_thumbs.h"
+#include "pktav_video.h"
+#include "pktav_proto.h"
+#include "pktav_error.h"
+#include "pktav_log.h"
+
+#define THUMBS_DEFAULT_WIDTH 160
+#define THUMBS_MJPEG_QSCALE  4
+#define THUMBS_MAX_KEY_GAP_MS 60000  /* Seek job: a keyframe repeated farther than this is the end of the input */
+
+/**
+ * @brief Open the thumbnail generator: sprite sheet encoder, sheet frame and WebVTT index.
+ *
+ * @param th Pointer to the TAVThumbs structure to be initialized.
+ * @param config Pointer to the TAVConfigThumbs with the thumbnail settings.
+ * @param src_width Width of the decoded frames.
+ * @param src_height Height of the decoded frames.
+ * @param sar Sample aspect ratio of the decoded frames (0/1 if unknown).
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure (the resources are freed).
+ *
+ * @note If the thumbnail height is not set, it keeps the display aspect ratio of the input.
+ * @note `config->dst` must contain a %d that is replaced by the number of the sheet.
+ */
+int pktav_thumbs_open(TAVThumbs *th, TAVConfigThumbs *config, int src_width, int src_height, AVRational sar) {
+    const AVCodec *codec;
+    char name[sizeof(th->sheet_name)];
+    int error;
+
+    memset(th, 0, sizeof(TAVThumbs));
+    th->config = config;
+
+    if (!config->dst || av_get_frame_filename(name, sizeof(name), config->dst, 0) < 0)
+        return AVERROR(EINVAL);     /* The sheets would overwrite each other */
+
+    th->width  = config->width > 0 ? config->width : THUMBS_DEFAULT_WIDTH;
+    th->height = config->height;
+    if (th->height <= 0) {
+        if (sar.num <= 0 || sar.den <= 0)
+            sar = (AVRational){1, 1};
+        th->height = (int)av_rescale(th->width, (int64_t)src_height * sar.den, (int64_t)src_width * sar.num);
+    }
+    /* Even sizes, the tiles must start on a chroma sample */
+    th->width  = FFMAX(2, th->width & ~1);
+    th->height = FFMAX(2, th->height & ~1);
+
+    codec = avcodec_find_encoder_by_name(config->codec ? config->codec : "mjpeg");
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+
+    if ((th->enc = avcodec_alloc_context3(codec)) == NULL)
+        return AVERROR(ENOMEM);
+    th->enc->width     = th->width * FFMAX(1, config->cols);
+    th->enc->height    = th->height * FFMAX(1, config->rows);
+    th->enc->time_base = (AVRational){1, 1};
+    th->enc->pix_fmt   = codec->pix_fmts ? codec->pix_fmts[0] : AV_PIX_FMT_YUVJ420P;
+    if (codec->id == AV_CODEC_ID_MJPEG) {
+        th->enc->flags |= AV_CODEC_FLAG_QSCALE;
+        th->enc->global_quality = FF_QP2LAMBDA * THUMBS_MJPEG_QSCALE;
+    }
+
+    if (!(av_pix_fmt_desc_get(th->enc->pix_fmt)->flags & AV_PIX_FMT_FLAG_PLANAR)) {
+        error = AVERROR(ENOSYS);
+        goto fail;
+    }
+    if ((error = avcodec_open2(th->enc, codec, NULL)) < 0)
+        goto fail;
+
+    th->sheet  = av_frame_alloc();
+    th->packet = av_packet_alloc();
+    if (!th->sheet || !th->packet) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    th->sheet->format = th->enc->pix_fmt;
+    th->sheet->width  = th->enc->width;
+    th->sheet->height = th->enc->height;
+    if ((error = av_frame_get_buffer(th->sheet, 0)) < 0)
+        goto fail;
+
+    if (config->vtt) {
+        if ((error = avio_open(&th->vtt, config->vtt, AVIO_FLAG_WRITE)) < 0)
+            goto fail;
+        avio_printf(th->vtt, "WEBVTT\n\n");
+    }
+    return 0;
+
+fail:
+    pktav_thumbs_close(th);
+    return error;
+}
+
+/**
+ * @brief Check if a thumbnail must be captured.
+ *
+ * @param th Pointer to the TAVThumbs structure.
+ * @param time_ms Time of the frame from the beginning of the output.
+ *
+ * @return Returns 1 if the next thumbnail is due at `time_ms`, 0 otherwise.
+ */
+int pktav_thumbs_due(TAVThumbs *th, int64_t time_ms) {
+    return th->enc && time_ms >= th->next_ms;
+}
+
+/**
+ * @brief Fill a sprite sheet with black.
+ */
+static void pktav_thumbs_clear(AVFrame *sheet) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(sheet->format);
+    int p, h;
+
+    for (p = 0; p < 4 && sheet->data[p]; p++) {
+        h = p == 1 || p == 2 ? AV_CEIL_RSHIFT(sheet->height, desc->log2_chroma_h) : sheet->height;
+        if (p == 0)
+            memset(sheet->data[p], strncmp(desc->name, "yuvj", 4) == 0 ? 0 : 16, (size_t)sheet->linesize[p] * h);
+        else if (p < 3)
+            memset(sheet->data[p], 128, (size_t)sheet->linesize[p] * h);
+        else
+            memset(sheet->data[p], 255, (size_t)sheet->linesize[p] * h);
+    }
+}
+
+/**
+ * @brief Encode the current sprite sheet and write it to its file.
+ *
+ * @param th Pointer to the TAVThumbs structure.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+static int pktav_thumbs_write_sheet(TAVThumbs *th) {
+    AVIOContext *pb = NULL;
+    int error;
+
+    th->sheet->pts = th->sheet_index;
+    if ((error = avcodec_send_frame(th->enc, th->sheet)) < 0)
+        return error;
+
+    while ((error = avcodec_receive_packet(th->enc, th->packet)) == 0) {
+        if ((error = avio_open(&pb, th->sheet_name, AVIO_FLAG_WRITE)) < 0) {
+            av_packet_unref(th->packet);
+            return error;
+        }
+        avio_write(pb, th->packet->data, th->packet->size);
+        av_packet_unref(th->packet);
+        if ((error = avio_closep(&pb)) < 0)
+            return error;
+    }
+
+    th->tile = 0;
+    th->sheet_index++;
+    return error == AVERROR(EAGAIN) ? 0 : error;
+}
+
+/**
+ * @brief Write a WebVTT timestamp (hh:mm:ss.mmm).
+ */
+static void pktav_thumbs_vtt_time(char *buffer, size_t size, int64_t ms) {
+    snprintf(buffer, size, "%02d:%02d:%02d.%03d", (int)(ms / 3600000), (int)(ms / 60000 % 60),
+                                                  (int)(ms / 1000 % 60), (int)(ms % 1000));
+}
+
+/**
+ * @brief Add a thumbnail to the sprite sheet.
+ *
+ * The frame is scaled into the next tile of the sheet and the tile gets a cue in the WebVTT index
+ * that lasts until the next thumbnail. The sheet is written when it is full.
+ *
+ * @param th Pointer to the TAVThumbs structure.
+ * @param frame Pointer to the decoded AVFrame (any size and format supported by swscale).
+ * @param time_ms Time of the frame from the beginning of the output.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+int pktav_thumbs_add(TAVThumbs *th, AVFrame *frame, int64_t time_ms) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(th->sheet->format);
+    uint8_t *dst[4] = { NULL };
+    int cols = FFMAX(1, th->config->cols);
+    int rows = FFMAX(1, th->config->rows);
+    int interval = FFMAX(1, th->config->interval_ms);
+    int64_t start_ms = th->next_ms;
+    char start[16], end[16];
+    int x, y, p, error;
+
+    if (th->tile == 0) {
+        if ((error = av_frame_make_writable(th->sheet)) < 0)
+            return error;
+        pktav_thumbs_clear(th->sheet);
+        av_get_frame_filename(th->sheet_name, sizeof(th->sheet_name), th->config->dst, th->sheet_index);
+    }
+
+    th->sws = sws_getCachedContext(th->sws, frame->width, frame->height, frame->format,
+                                   th->width, th->height, th->sheet->format,
+                                   SWS_BILINEAR, NULL, NULL, NULL);
+    if (!th->sws)
+        return AVERROR(EINVAL);
+
+    x = (th->tile % cols) * th->width;
+    y = (th->tile / cols) * th->height;
+    for (p = 0; p < 4 && th->sheet->data[p]; p++) {
+        if (p == 1 || p == 2)
+            dst[p] = th->sheet->data[p] + (y >> desc->log2_chroma_h) * th->sheet->linesize[p] + (x >> desc->log2_chroma_w);
+        else
+            dst[p] = th->sheet->data[p] + y * th->sheet->linesize[p] + x;
+    }
+    sws_scale(th->sws, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+              dst, th->sheet->linesize);
+
+    /* The next thumbnail is due at the next interval after this frame */
+    while (th->next_ms <= time_ms)
+        th->next_ms += interval;
+
+    if (th->vtt) {
+        pktav_thumbs_vtt_time(start, sizeof(start), start_ms);
+        pktav_thumbs_vtt_time(end, sizeof(end), th->next_ms);
+        avio_printf(th->vtt, "%s --> %s\n%s#xywh=%d,%d,%d,%d\n\n", start, end,
+                    av_basename(th->sheet_name), x, y, th->width, th->height);
+    }
+
+    th->count++;
+    if (++th->tile == cols * rows)
+        return pktav_thumbs_write_sheet(th);
+    return 0;
+}
+
+/**
+ * @brief Write the last (partially filled) sprite sheet and the WebVTT index.
+ *
+ * @param th Pointer to the TAVThumbs structure.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+int pktav_thumbs_finish(TAVThumbs *th) {
+    int error = 0;
+
+    if (th->tile > 0 && (error = pktav_thumbs_write_sheet(th)) < 0)
+        return error;
+    if (th->vtt)
+        error = avio_closep(&th->vtt);
+    return error;
+}
+
+/**
+ * @brief Free all the resources of the thumbnail generator.
+ *
+ * @param th Pointer to the TAVThumbs structure.
+ */
+void pktav_thumbs_close(TAVThumbs *th) {
+    if (th->enc) avcodec_free_context(&th->enc);
+    if (th->sheet) av_frame_free(&th->sheet);
+    if (th->packet) av_packet_free(&th->packet);
+    if (th->sws) sws_freeContext(th->sws);
+    if (th->vtt) avio_closep(&th->vtt);
+    th->sws = NULL;
+}
+
+/**
+ * @brief Read and decode the next keyframe of a stream.
+ *
+ * @param ifc Pointer to the input AVFormatContext.
+ * @param dec Pointer to the decoder (skip_frame = AVDISCARD_NONKEY).
+ * @param stream Pointer to the video stream.
+ * @param packet Pointer to an allocated AVPacket.
+ * @param frame Pointer to the AVFrame with the last decoded keyframe, the new one is stored here.
+ * @param min_ts Keyframes with a pts lower than this are skipped (AV_NOPTS_VALUE to take the first one).
+ * @param key_pts Pts of the keyframe in `frame`, updated with the new one.
+ *
+ * @return Returns 0 on success, AVERROR_EOF at the end of the input or a negative AVERROR code on failure.
+ *
+ * @note Only the keyframes are sent to the decoder. If the keyframe is the one already in `frame`
+ *       (the interval is shorter than the GOP), it is not decoded again.
+ */
+static int pktav_thumbs_read_keyframe(AVFormatContext *ifc, AVCodecContext *dec, AVStream *stream, AVPacket *packet,
+                                      AVFrame *frame, int64_t min_ts, int64_t *key_pts) {
+    int error;
+
+    while ((error = av_read_frame(ifc, packet)) == 0) {
+        if (packet->stream_index != stream->index || !(packet->flags & AV_PKT_FLAG_KEY) ||
+            (min_ts != AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE && packet->pts < min_ts)) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        if (packet->pts != AV_NOPTS_VALUE && packet->pts == *key_pts && frame->buf[0]) {
+            av_packet_unref(packet);
+            return 0;
+        }
+        *key_pts = packet->pts;
+
+        error = avcodec_send_packet(dec, packet);
+        av_packet_unref(packet);
+        if (error < 0)
+            return error;
+
+        av_frame_unref(frame);
+        error = avcodec_receive_frame(dec, frame);
+        if (error == AVERROR(EAGAIN)) {
+            /* Decoder delay: drain it to get the frame of this keyframe */
+            avcodec_send_packet(dec, NULL);
+            error = avcodec_receive_frame(dec, frame);
+        }
+        avcodec_flush_buffers(dec);
+
+        if (error == 0 || (error != AVERROR(EAGAIN) && error != AVERROR_EOF))
+            return error;
+        /* No picture for this keyframe (like a recovery point), try the next one */
+    }
+    return error;
+}
+
+/**
+ * @brief Send the status of the thumbnail job.
+ */
+static int pktav_thumbs_status(int socket, TAVThumbs *th, int64_t start_us, int pct, int finished) {
+    TAVStatus status;
+
+    memset(&status, 0, sizeof(TAVStatus));
+    status.proc_time_ms = (av_gettime_relative() - start_us) / 1000;
+    status.progress_pct = pct;
+    status.time_left_ms = pct > 0 ? (status.proc_time_ms * (100 - pct)) / pct : 0;
+    status.err_msg = "";
+    status.status = finished;
+    status.status_desc = finished ? "FINISH" : "TRANSCODING";
+    status.thumbnails = th->count;
+    return send_status(socket, &status);
+}
+
+/**
+ * @brief Thumbnail job: capture the thumbnails seeking from keyframe to keyframe.
+ *
+ * For every interval the input is seeked to the keyframe before the thumbnail time and only that
+ * keyframe is decoded, so the cost depends on the number of thumbnails and not on the length of
+ * the input. Inputs that cannot be seeked are read forward, decoding only the keyframes.
+ *
+ * @param socket The socket of the client, used to send the status.
+ * @param input Path or URL of the input.
+ * @param config Pointer to the TAVConfigVideo with the track selection and the thumbnail settings.
+ *
+ * @return Returns the result of the last send_status on success, or -AV_ERROR/-PK_ERROR on failure
+ *         (pktav_errno is set).
+ */
+int pktav_thumbs_worker(int socket, const char *input, TAVConfigVideo *config) {
+    AVFormatContext *ifc = NULL;
+    AVStream *stream = NULL;
+    AVCodecContext *dec = NULL;
+    const AVCodec *codec;
+    AVPacket *packet = NULL;
+    AVFrame *frame = NULL;
+    TAVThumbs th;
+    int64_t start_us = av_gettime_relative();
+    int64_t duration_ms, offset, ts, prev_key_pts, key_pts = AV_NOPTS_VALUE;
+    int error, seeked, i, pct, counter = 0;
+
+    memset(&th, 0, sizeof(TAVThumbs));
+
+    error = pktav_open_input_context(input, &ifc, NULL);
+    if (error < 0) {
+        pktav_errno = error;
+        return -AV_ERROR;
+    }
+
+    if (pktva_get_video_stream(ifc, config->track, &stream) == -1) {
+        pktav_errno = PK_ERROR_VNOTFOUND;
+        error = -PK_ERROR;
+        goto cleanup;
+    }
+    for (i = 0; i < ifc->nb_streams; i++) {
+        if (ifc->streams[i] != stream)
+            ifc->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    /* Keyframes only: the decoder skips everything else */
+    if ((codec = avcodec_find_decoder(stream->codecpar->codec_id)) == NULL) {
+        error = AVERROR_DECODER_NOT_FOUND;
+        goto fail;
+    }
+    if ((dec = avcodec_alloc_context3(codec)) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if ((error = avcodec_parameters_to_context(dec, stream->codecpar)) < 0)
+        goto fail;
+    dec->skip_frame = AVDISCARD_NONKEY;
+    dec->thread_type = FF_THREAD_SLICE;
+    if ((error = avcodec_open2(dec, codec, NULL)) < 0)
+        goto fail;
+
+    packet = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!packet || !frame) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    if ((error = pktav_thumbs_open(&th, &config->thumbs, dec->width, dec->height, dec->sample_aspect_ratio)) < 0)
+        goto fail;
+
+    offset = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    duration_ms = ifc->duration != AV_NOPTS_VALUE ? ifc->duration / 1000 : INT64_MAX;
+
+    while (th.next_ms < duration_ms) {
+        ts = offset + av_rescale_q(th.next_ms, (AVRational){1, 1000}, stream->time_base);
+        seeked = avformat_seek_file(ifc, stream->index, INT64_MIN, ts, ts, 0) >= 0;
+
+        prev_key_pts = key_pts;
+        error = pktav_thumbs_read_keyframe(ifc, dec, stream, packet, frame, seeked ? AV_NOPTS_VALUE : ts, &key_pts);
+        if (error == AVERROR_EOF)
+            break;
+        if (error < 0)
+            goto fail;
+
+        /*
+         * The seek lands on the last keyframe once the thumbnail time is past the end (the duration 
+         * can be unknown or wrong): the same keyframe far behind the thumbnail time is the end.
+         */
+        if (key_pts != AV_NOPTS_VALUE && key_pts == prev_key_pts && 
+            av_rescale_q(ts - key_pts, stream->time_base, (AVRational){1, 1000}) > THUMBS_MAX_KEY_GAP_MS)
+            break;
+
+        if ((error = pktav_thumbs_add(&th, frame, th.next_ms)) < 0)
+            goto fail;
+
+        pct = duration_ms != INT64_MAX ? (int)FFMIN(99, th.next_ms * 100 / FFMAX(1, duration_ms)) : 0;
+        if (pct > counter) {
+            counter = pct;
+            if ((error = pktav_thumbs_status(socket, &th, start_us, pct, 0)) < 0)
+                goto cleanup;
+        }
+    }
+
+    if ((error = pktav_thumbs_finish(&th)) < 0)
+        goto fail;
+    pktav_log(NULL, 0, "Thumbnails: %d in %d sheets\n", th.count, th.sheet_index);
+    error = pktav_thumbs_status(socket, &th, start_us, 100, 1);
+    goto cleanup;
+
+fail:
+    pktav_errno = error;
+    error = -AV_ERROR;
+cleanup:
+    pktav_thumbs_close(&th);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&dec);
+    avformat_close_input(&ifc);
+    return error;
+}
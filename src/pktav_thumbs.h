@@ -0,0 +1,34 @@
+#ifndef _PKTAV_THUMBS_H
+#define _PKTAV_THUMBS_H 1
+
+#include "pktav_types.h"
+
+/*
+ * Thumbnail/sprite sheet generator. The thumbnails are scaled into the tiles
+ * of a sprite sheet (cols x rows) that is encoded as an image when it is full.
+ * Every tile has a cue in the WebVTT index.
+ */
+typedef struct TAVThumbs {
+    TAVConfigThumbs   *config;
+    AVCodecContext    *enc;          // Sprite sheet encoder (mjpeg, libwebp)
+    AVFrame           *sheet;        // Sprite sheet being filled
+    AVPacket          *packet;
+    struct SwsContext *sws;          // Reused while the size and format of the frames do not change
+    AVIOContext       *vtt;          // WebVTT index (NULL if not requested)
+    int               width;         // Tile size
+    int               height;
+    int               tile;          // Next tile of the sheet
+    int               sheet_index;   // Number of the sheet being filled
+    int64_t           next_ms;       // Time of the next thumbnail
+    int               count;         // Thumbnails captured
+    char              sheet_name[1024];
+} TAVThumbs;
+
+extern int  pktav_thumbs_open(TAVThumbs *th, TAVConfigThumbs *config, int src_width, int src_height, AVRational sar);
+extern int  pktav_thumbs_due(TAVThumbs *th, int64_t time_ms);
+extern int  pktav_thumbs_add(TAVThumbs *th, AVFrame *frame, int64_t time_ms);
+extern int  pktav_thumbs_finish(TAVThumbs *th);
+extern void pktav_thumbs_close(TAVThumbs *th);
+extern int  pktav_thumbs_worker(int socket, const char *input, TAVConfigVideo *config);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <libavutil/avutil.h>
+#include "pktav_trace.h"
+#include "pktav_error.h"
+#include "pktav_log.h"
+
+/*
+ * Pipeline tracing: every thread records its spans in its own preallocated
+ * buffer (no locks, no I/O), and the buffers are written as Chrome/Perfetto
+ * trace-event JSON when the job ends.
+ */
+typedef struct {
+    int64_t ts_us;
+    int32_t dur_us;
+    int16_t span;
+    int16_t stream;
+    int64_t pts;
+} TAVTraceEvent;
+
+typedef struct TAVTraceBuffer {
+    int           tid;
+    char          name[32];
+    int           count;
+    int           dropped;      // Full buffer
+    struct TAVTraceBuffer *next;
+    TAVTraceEvent events[];
+} TAVTraceBuffer;
+
+static const char *trace_spans[] = { "demux", "decode", "scale", "encode", "mux" };
+
+int pktav_trace_on = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TAVTraceBuffer *trace_buffers = NULL;
+static int trace_generation = 0;
+static int64_t trace_start_us;
+static char *trace_file = NULL;
+static __thread TAVTraceBuffer *trace_buffer = NULL;
+static __thread int trace_buffer_generation = 0;
+
+/*
+ * Buffer of the calling thread, allocated on its first event. The pages are
+ * only committed as the events are written.
+ */
+static TAVTraceBuffer *trace_get_buffer(void) {
+    TAVTraceBuffer *b;
+
+    if (trace_buffer && trace_buffer_generation == trace_generation)
+        return trace_buffer;
+    trace_buffer = NULL;
+    if ((b = malloc(sizeof(TAVTraceBuffer) + TRACE_MAX_EVENTS * sizeof(TAVTraceEvent))) == NULL)
+        return NULL;
+    b->tid = (int)syscall(SYS_gettid);
+    snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+    b->count = 0;
+    b->dropped = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!pktav_trace_on) {
+        pthread_mutex_unlock(&trace_lock);
+        free(b);
+        return NULL;
+    }
+    b->next = trace_buffers;
+    trace_buffers = b;
+    trace_buffer_generation = trace_generation;
+    pthread_mutex_unlock(&trace_lock);
+    trace_buffer = b;
+    return b;
+}
+
+/**
+ * @brief Start tracing the pipeline of the job.
+ *
+ * @param file Path of the trace-event JSON written by pktav_trace_close().
+ *
+ * @return Returns 0 on success, or -OS_ERROR if the file cannot be created (pktav_errno is set).
+ */
+int pktav_trace_open(const char *file) {
+    FILE *fp;
+
+    pktav_errno = 0;
+    /* Fail now rather than after the job */
+    if ((fp = fopen(file, "w")) == NULL) {
+        pktav_errno = errno;
+        return -OS_ERROR;
+    }
+    fclose(fp);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_file = strdup(file);
+    trace_start_us = av_gettime_relative();
+    trace_generation++;
+    pktav_trace_on = 1;
+    pthread_mutex_unlock(&trace_lock);
+    pktav_trace_thread_name("worker");
+    return 0;
+}
+
+/**
+ * @brief Record a span of the calling thread (use PKTAV_TRACE_END).
+ *
+ * @param span TRACE_DEMUX, TRACE_DECODE, TRACE_SCALE, TRACE_ENCODE or TRACE_MUX.
+ * @param start_us Start of the span (av_gettime_relative), it ends now.
+ * @param stream Stream of the packet or frame.
+ * @param pts Timestamp of the packet or frame (AV_NOPTS_VALUE if none).
+ */
+void pktav_trace_event(int span, int64_t start_us, int stream, int64_t pts) {
+    TAVTraceBuffer *b = trace_get_buffer();
+    TAVTraceEvent *e;
+
+    if (!b)
+        return;
+    if (b->count == TRACE_MAX_EVENTS) {
+        b->dropped++;
+        return;
+    }
+    e = &b->events[b->count++];
+    e->ts_us = start_us;
+    e->dur_us = (int32_t)(av_gettime_relative() - start_us);
+    e->span = span;
+    e->stream = stream;
+    e->pts = pts;
+}
+
+/**
+ * @brief Name the calling thread in the trace (like "mux 0").
+ *
+ * @param name Name of the thread.
+ */
+void pktav_trace_thread_name(const char *name) {
+    TAVTraceBuffer *b;
+
+    if (pktav_trace_on && (b = trace_get_buffer()) != NULL)
+        snprintf(b->name, sizeof(b->name), "%s", name);
+}
+
+/**
+ * @brief Stop tracing and write the trace-event JSON (Chrome about:tracing, Perfetto UI).
+ *
+ * @note Must be called when the threads that record spans (muxing threads) have finished. A trace that
+ *       cannot be written is only logged, it does not change the result of the job (nor pktav_errno).
+ */
+void pktav_trace_close(void) {
+    TAVTraceBuffer *b, *next;
+    TAVTraceEvent *e;
+    int64_t events = 0, dropped = 0;
+    int i;
+    pid_t pid = getpid();
+    FILE *fp;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!pktav_trace_on) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    pktav_trace_on = 0;
+    b = trace_buffers;
+    trace_buffers = NULL;
+    trace_generation++;
+    pthread_mutex_unlock(&trace_lock);
+
+    if ((fp = fopen(trace_file, "w")) == NULL) {
+        pktav_log(NULL, 0, "Trace not written, %s: %s\n", trace_file, strerror(errno));
+    } else {
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"pktav worker\"}}", (int)pid);
+        for (; b; b = next) {
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", 
+                    (int)pid, b->tid, b->name);
+            for (i = 0; i < b->count; i++) {
+                e = &b->events[i];
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%d,"
+                            "\"args\":{\"stream\":%d", trace_spans[e->span], (int)pid, b->tid, 
+                            e->ts_us - trace_start_us, e->dur_us, e->stream);
+                if (e->pts != AV_NOPTS_VALUE)
+                    fprintf(fp, ",\"pts\":%" PRId64, e->pts);
+                fprintf(fp, "}}");
+            }
+            events += b->count;
+            dropped += b->dropped;
+            next = b->next;
+            free(b);
+        }
+        fprintf(fp, "\n],\"otherData\":{\"events\":%" PRId64 ",\"dropped\":%" PRId64 "}}\n", events, dropped);
+        if (fclose(fp) != 0)
+            pktav_log(NULL, 0, "Trace not written, %s: %s\n", trace_file, strerror(errno));
+        else
+            pktav_log(NULL, 0, "Trace: %" PRId64 " events (%" PRId64 " dropped) written to %s\n", events, dropped, trace_file);
+    }
+
+    for (; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    trace_buffer = NULL;
+    free(trace_file);
+    trace_file = NULL;
+}
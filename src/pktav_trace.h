@@ -0,0 +1,30 @@
+#ifndef _PKTAV_TRACE_H
+#define _PKTAV_TRACE_H 1
+
+#include <stdint.h>
+#include <libavutil/time.h>
+
+#define TRACE_MAX_EVENTS     (1 << 20)  // Events per thread (24 MB reserved, committed as it is used)
+
+/* Spans of the pipeline */
+#define TRACE_DEMUX   0
+#define TRACE_DECODE  1
+#define TRACE_SCALE   2
+#define TRACE_ENCODE  3
+#define TRACE_MUX     4
+
+extern int pktav_trace_on;
+
+/* 
+ * Near zero cost when tracing is disabled: one test of a global. The start of 
+ * the span is the clock of the stage (pktav_stage_begin), always read.
+ */
+#define PKTAV_TRACE_END(span, start_us, stream, pts) \
+    do { if (pktav_trace_on) pktav_trace_event(span, start_us, stream, pts); } while (0)
+
+extern int  pktav_trace_open(const char *file);
+extern void pktav_trace_event(int span, int64_t start_us, int stream, int64_t pts);
+extern void pktav_trace_thread_name(const char *name);
+extern void pktav_trace_close(void);
+
+#endif
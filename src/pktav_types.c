@@ -5,27 +5,71 @@
 void dump_TAVConfigVideo(TAVConfigVideo *videoConfig) {
     pktav_log(NULL, 0, "Video Config:\n");
     pktav_log(NULL, 0, "Codec: %s\n", videoConfig->codec);
+    pktav_log(NULL, 0, "Track: %s\n", videoConfig->track);
     pktav_log(NULL, 0, "Framerate: %d/%d\n", videoConfig->framerate.num, videoConfig->framerate.den);
+    pktav_log(NULL, 0, "Output Framerate: %d/%d\n", videoConfig->output_framerate.num, videoConfig->output_framerate.den);
     pktav_log(NULL, 0, "Resolution: %dx%d\n", videoConfig->width, videoConfig->height);
     pktav_log(NULL, 0, "GOP Size: %d\n", videoConfig->gop_size);
     pktav_log(NULL, 0, "Pixel Format: %d\n", videoConfig->pix_fmt);
     pktav_log(NULL, 0, "Profile: %s\n", videoConfig->profile);
     pktav_log(NULL, 0, "Preset: %s\n", videoConfig->preset);
+    pktav_log(NULL, 0, "Tune: %s\n", videoConfig->tune);
+    pktav_log(NULL, 0, "Lookahead: %d\n", videoConfig->lookahead);
+    pktav_log(NULL, 0, "Threads: %d\n", videoConfig->threads);
+    pktav_log(NULL, 0, "Huge Pages: %d\n", videoConfig->hugepages);
+    pktav_log(NULL, 0, "Duplicate Threshold: %d\n", videoConfig->dup_threshold);
+    pktav_log(NULL, 0, "Duplicate Max Skip: %d\n", videoConfig->dup_max_skip);
+    pktav_log(NULL, 0, "Quality Interval: %d\n", videoConfig->quality_interval);
+    if (videoConfig->probe.windows > 0) {
+        pktav_log(NULL, 0, "Probe: %d windows of %d ms, width %d, crf %d\n", videoConfig->probe.windows,
+                           videoConfig->probe.window_ms, videoConfig->probe.width, videoConfig->probe.crf);
+        pktav_log(NULL, 0, "Probe Bounds: crf %d-%d, bitrate %d-%d bps\n", videoConfig->probe.crf_min, 
+                           videoConfig->probe.crf_max, videoConfig->probe.bitrate_min_bps, videoConfig->probe.bitrate_max_bps);
+    }
+    if (videoConfig->thumbs.interval_ms > 0) {
+        pktav_log(NULL, 0, "Thumbnails: every %d ms, %dx%d, %dx%d sheets (%s)%s\n", videoConfig->thumbs.interval_ms,
+                           videoConfig->thumbs.width, videoConfig->thumbs.height, videoConfig->thumbs.cols, 
+                           videoConfig->thumbs.rows, videoConfig->thumbs.codec, videoConfig->thumbs.only ? ", only" : "");
+        pktav_log(NULL, 0, "Thumbnails Destination: %s\n", videoConfig->thumbs.dst);
+        pktav_log(NULL, 0, "Thumbnails WebVTT: %s\n", videoConfig->thumbs.vtt);
+    }
     pktav_log(NULL, 0, "CRF: %d\n", videoConfig->crf);
     pktav_log(NULL, 0, "Bitrate (bps): %d\n", videoConfig->bitrate_bps);
+    pktav_log(NULL, 0, "Speed Target: %.2f\n", videoConfig->speed_target);
+    pktav_log(NULL, 0, "Deadline (ms): %d\n", videoConfig->deadline_ms);
 }
 
 void dump_TAVConfigAudio(TAVConfigAudio *audioConfig) {
     pktav_log(NULL, 0, "Audio Config:\n");
     pktav_log(NULL, 0, "Codec: %s\n", audioConfig->codec);
+    pktav_log(NULL, 0, "Track: %s\n", audioConfig->track);
     pktav_log(NULL, 0, "Bitrate (bps): %d\n", audioConfig->bitrate_bps);
     pktav_log(NULL, 0, "Channels: %d\n", audioConfig->channels);
     pktav_log(NULL, 0, "Sample Rate: %d\n", audioConfig->sample_rate);
+    pktav_log(NULL, 0, "Loudness: %d (target %.1f LUFS)\n", audioConfig->loudness, audioConfig->loudness_target);
+    pktav_log(NULL, 0, "Gain (dB): %.2f\n", audioConfig->gain_db);
 }
 
 void dump_TAVConfigFormat(TAVConfigFormat *formatConfig) {
-    pktav_log(NULL, 0, "Format Config:\n");
-    pktav_log(NULL, 0, "Destination: %s\n", formatConfig->dst);
-    pktav_log(NULL, 0, "Destination Type: %s\n", formatConfig->dst_type);
-    pktav_log(NULL, 0, "Key-Value Options: %s\n", formatConfig->kv_opts);
+    int i;
+    for (i = 0; formatConfig; formatConfig = formatConfig->next, i++) {
+        pktav_log(NULL, 0, "Format Config (output %d):\n", i);
+        pktav_log(NULL, 0, "Destination: %s\n", formatConfig->dst);
+        pktav_log(NULL, 0, "Destination Type: %s\n", formatConfig->dst_type);
+        pktav_log(NULL, 0, "Key-Value Options: %s\n", formatConfig->kv_opts);
+        pktav_log(NULL, 0, "Fragment Duration (ms): %d\n", formatConfig->frag_duration_ms);
+        pktav_log(NULL, 0, "Segment Duration (ms): %d\n", formatConfig->segment_duration_ms);
+        pktav_log(NULL, 0, "Segment Type: %s\n", formatConfig->segment_type);
+        pktav_log(NULL, 0, "Checksum: %s\n", formatConfig->checksum);
+        if (i == 0) {
+            pktav_log(NULL, 0, "Live: %d\n", formatConfig->live);
+            pktav_log(NULL, 0, "Live Max Latency (ms): %d\n", formatConfig->live_max_latency_ms);
+            pktav_log(NULL, 0, "Start (ms): %d\n", formatConfig->start_ms);
+            pktav_log(NULL, 0, "End (ms): %d\n", formatConfig->end_ms);
+            pktav_log(NULL, 0, "Smart Cut: %d\n", formatConfig->smart_cut);
+            pktav_log(NULL, 0, "Priority: %s\n", formatConfig->priority);
+            pktav_log(NULL, 0, "Job Id: %s\n", formatConfig->job_id);
+            pktav_log(NULL, 0, "Trace File: %s\n", formatConfig->trace_file);
+        }
+    }
 }
@@ -6,6 +6,11 @@
 #include <libavutil/audio_fifo.h>
 #include <libswscale/swscale.h>
 #include <libswresample/swresample.h>
+#include <libavutil/pixelutils.h>
+
+/* Streams of the outputs */
+#define VIDEO_INDEX 0
+#define AUDIO_INDEX 1
 
 typedef struct {
     int codec_type;
@@ -20,39 +25,168 @@ typedef struct {
     AVAudioFifo     *fifo;               /* Para hacer Resample de Audio */
     SwrContext      *resample_ctx;       /* Para hacer Resample de Audio */
     struct SwsContext *sws_ctx;
+    int             low_delay;           /* Live: no frame threading nor reordering delay in the decoder */
+    int64_t         live_origin_us;      /* Live: wall clock (us) of the input pts 0, 0 if not live */
+    int64_t         max_latency_us;      /* Live: decoded frames later than this are dropped */
+    int             frames_dropped;      /* Live: frames dropped for being late */
+    int64_t         trim_start;          /* Trim: first pts to encode (input time base), AV_NOPTS_VALUE if not set */
+    int64_t         trim_end;            /* Trim: pts where the clip ends (input time base), AV_NOPTS_VALUE if not set */
+    int64_t         last_dts;            /* Last dts sent to the outputs (output time base) */
+    AVRational      frame_rate;          /* Frame rate conversion: output frame rate, 0/0 to keep the input timing */
+    int64_t         next_out_pts;        /* Frame rate conversion: next output frame (encoder time base) */
+    av_pixelutils_sad_fn dup_sad;        /* Duplicate skipping: 8x8 SAD function, NULL if disabled */
+    int             dup_threshold;       /* Duplicate skipping: max SAD of an 8x8 luma block */
+    int             dup_max_skip;        /* Duplicate skipping: max consecutive skipped frames, 0 = no limit */
+    int             dup_count;           /* Duplicate skipping: consecutive skipped frames */
+    int             frames_skipped;      /* Duplicate skipping: frames not encoded */
+    AVFrame         *prev_frame;         /* Duplicate skipping: last encoded frame (decoded) */
+    AVFrame         *dup_last;           /* Duplicate skipping: last skipped frame, encoded at the end */
+    struct TAVThumbs *thumbs;            /* Thumbnails captured from the decoded frames, NULL if none */
+    struct TAVLoudness *loudness;        /* Loudness meter of the decoded audio, NULL if none */
+    double          gain_db;             /* Gain applied to the decoded audio */
+    int64_t         frames_sent;         /* Frames sent to the encoder */
+    int64_t         gop_origin;          /* frames_sent when the encoder was opened (first keyframe) */
+    struct TAVQuality *quality;          /* Sampled PSNR/SSIM of the encoded video, NULL if disabled */
+    struct TAVFramePool *scale_pool;     /* Huge page buffers of the scaled frames, NULL if disabled */
+    struct TAVStages *stages;            /* Per-stage latency histograms and times, NULL if not measured */
 } TAVContext;
 
+/*
+ * Thumbnails and sprite sheets. They are captured from the decoded frames of a
+ * transcode, or by a thumbnail job (only) that seeks from keyframe to keyframe.
+ */
+typedef struct {
+    int     interval_ms;        // One thumbnail every interval_ms (0 = disabled).
+    int     width;              // Thumbnail width (default 160).
+    int     height;             // Thumbnail height (0 = keep the aspect ratio).
+    int     cols;               // Sprite sheet columns.
+    int     rows;               // Sprite sheet rows.
+    char    *codec;             // Sprite sheet encoder: "mjpeg" (default) or "libwebp".
+    char    *dst;               // Sprite sheet path, with a %d for the number of the sheet.
+    char    *vtt;               // WebVTT index path (NULL = no index).
+    int     only;               // Thumbnail job: no transcode, only the keyframes are decoded.
+} TAVConfigThumbs;
+
+/*
+ * Complexity probe: a few short windows of the input are encoded at a fast
+ * preset and low resolution before the transcode, and the crf/bitrate of the
+ * title is chosen from the bits they needed.
+ */
+typedef struct {
+    int     windows;            // Sampled windows (0 = no probe).
+    int     window_ms;          // Duration of every window (default 2000).
+    int     width;              // Width of the probe encode (default 480).
+    int     crf;                // Bitrate mode: quality target used to predict the bitrate (default 23).
+    int     crf_min;            // Bounds of the chosen crf (0 = none).
+    int     crf_max;
+    int     bitrate_min_bps;    // Bounds of the chosen bitrate (0 = none, the max defaults to bitrate_bps).
+    int     bitrate_max_bps;
+} TAVConfigProbe;
+
 typedef struct {
     char    *codec;
+    char    *track;             // Input video track: stream index or language (NULL = first video stream).
     AVRational   framerate;
+    AVRational   output_framerate;   // Requested output frame rate, 0/0 = same as the input.
+    int     dup_threshold;      // Skip near-duplicate frames: max mean luma difference per pixel (0 = disabled).
+    int     dup_max_skip;       // Max consecutive skipped frames (0 = no limit).
+    TAVConfigThumbs thumbs;     // Thumbnails/sprite sheets.
+    int     quality_interval;   // Measure the PSNR/SSIM of one of every N encoded frames (0 = disabled).
+    TAVConfigProbe probe;       // Content-adaptive crf/bitrate.
     int     width;
     int     height;
-    int     gop_size;
+    int     gop_size;           // Frames per GOP (0 = encoder default, or the fragment/segment duration).
+    int     fixed_gop;          // Keyframes only every gop_size frames, no scene cuts (fragmented/segmented output).
     int     pix_fmt;
     char    *profile;
     char    *preset;
+    char    *tune;
+    int     lookahead;          // Rate control lookahead in frames (-1 = preset default).
+    int     threads;            // Encoder threads, also the cores pinned to the job (0 = auto).
+    int     hugepages;          // Decoded and scaled frames in 2 MB huge page buffers.
     int     crf;
     int     bitrate_bps;
+    double  speed_target;       // Speed controller: target encode speed, x realtime (0 = none).
+    int     deadline_ms;        // Speed controller: the job must finish in deadline_ms (0 = none).
 } TAVConfigVideo;
 
 typedef struct {
     char    *codec;
+    char    *track;             // Input audio track: stream index or language (NULL = first audio stream).
     int     bitrate_bps;
     int     channels;
     int     sample_rate;
+    int     loudness;           // Measure the EBU R128 loudness of the audio.
+    double  loudness_target;    // Target integrated loudness in LUFS, to report the gain needed (0 = none).
+    double  gain_db;            // Gain applied to the audio before encoding.
 } TAVConfigAudio;
 
+#define MAX_OUTPUTS 4
+#define MAX_STAGES  6       // Pipeline stages timed per frame (pktav_stages.h)
+
 /* 
  * Struct representing the configuration of the output. This includes
  * information about the destination, type of destination, key-value options, 
  * and a flag indicating whether to ignore failures or not.
+ * A job can have up to MAX_OUTPUTS outputs chained with `next`, all of them 
+ * muxing the same encoded packets.
  */
-typedef struct {
+typedef struct TAVConfigFormat {
     char *dst;                // A string indicating the destination of the data.
     char *dst_type;           // Type of the output (for instance, format or protocol type).
     char *kv_opts;            // Key-Value options to apply on output.
+    int  frag_duration_ms;    // Fragmented MP4/CMAF fragment duration in ms (0 = regular moov at the end).
+    int  segment_duration_ms; // HLS/DASH target segment duration in ms (0 = muxer default).
+    char *segment_type;       // HLS segment container: "fmp4" or "mpegts" (DASH always uses fmp4).
+    char *checksum;           // Hash of the output file and CRC32 of its streams, like "MD5" (NULL = disabled).
+    struct TAVConfigFormat *next; // Next output receiving the same encoded packets (NULL if none).
+    /* Job-wide settings, only read from the first output */
+    int  live;                // Low-latency live mode.
+    int  live_max_latency_ms; // Live: maximum latency before late frames are dropped.
+    int  start_ms;            // Clip start in ms from the beginning of the input (0 = beginning).
+    int  end_ms;              // Clip end in ms from the beginning of the input (0 = end of the input).
+    int  smart_cut;           // Re-encode only the partial GOPs at the clip boundaries, copy the rest.
+    char *priority;           // Scheduler priority class: "paid", "standard" (default) or "bulk".
+    char *job_id;             // Id of the job in the logs (NULL = none).
+    char *trace_file;         // Chrome/Perfetto trace-event JSON of the pipeline (NULL = disabled).
 } TAVConfigFormat;
 
+/*
+ * Checksums of an output, computed while the packets are muxed.
+ */
+typedef struct {
+    int      output;                 // Position of the output in the configuration (0 = format, 1 = format1...)
+    char     *algo;                  // Hash algorithm of the file
+    char     file_hash[129];         // Hash of the file, empty if it was not written sequentially
+    uint32_t video_crc32;            // CRC32 of the video packets
+    uint32_t audio_crc32;            // CRC32 of the audio packets
+} TAVChecksum;
+
+/*
+ * Latency of a pipeline stage (pktav_stages.c), per frame or packet, and the 
+ * time spent in it.
+ */
+typedef struct {
+    const char *name;                // demux, decode, scale, encode, mux or audio
+    int64_t count;                   // Samples: packets (demux, mux), video frames or audio frames
+    long p50_us;
+    long p99_us;
+    long max_us;
+    long wall_ms;                    // Time in the stage (mux: sum of the muxing threads)
+    long cpu_ms;                     // CPU of the threads running the stage
+} TAVStageStatus;
+
+/*
+ * Status messages sent to the client (status / status_desc):
+ *   -1 FAILED        The job failed (err_msg)
+ *    0 TRANSCODING   Progress
+ *    1 FINISH        The job is done
+ *    2 SEGMENT       A media segment of an hls/dash output is complete (segment)
+ *    3 PAUSED        The job is paused (client or preemption)
+ *    4 CANCELLED     The job was cancelled
+ *    5 INIT_SEGMENT  The initialization segment of an fMP4 hls/dash output is complete (segment)
+ *    6 QUEUED        The job waits for the scheduler (queue_position, expected_start_ms)
+ */
 typedef struct {
     int  status;                     // Numeric status value
     char *status_desc;               // Status description
@@ -62,6 +196,65 @@ typedef struct {
     int  audio_pkts_read;            // Audio packets read
     int  video_pkts_read;            // Video packets read
     char *err_msg;                   // Error message (if any)
+    char *segment;                   // Completed segment (SEGMENT events only)
+    int  queue_position;             // Scheduler: position in the queue (QUEUED only)
+    long expected_start_ms;          // Scheduler: expected time until the job starts (QUEUED only)
+    int  outputs_failed;             // Outputs disabled after an error
+    int  frames_dropped;             // Live: late video frames dropped
+    int  frames_skipped;             // Near-duplicate video frames not encoded
+    int  thumbnails;                 // Thumbnails captured
+    int  quality_frames;             // Encoded frames measured (sampled)
+    double psnr;                     // Average PSNR of all the planes (dB)
+    double psnr_y;                   // Average PSNR of the luma (dB)
+    double psnr_min;                 // Worst PSNR of all the planes (dB)
+    double ssim;                     // Average SSIM of the luma
+    double ssim_min;                 // Worst SSIM of the luma
+    int  probe;                      // The probe fields are set
+    double probe_bpp;                // Probe: bits per pixel of the probe encode
+    long probe_time_ms;              // Probe: time spent in the probe
+    int  video_crf;                  // Probe: chosen crf (-1 in bitrate mode)
+    int  video_bitrate_bps;          // Probe: chosen bitrate (0 in crf mode)
+    double speed;                    // Speed controller: encode speed (x realtime), 0 if disabled
+    const char *preset;              // Speed controller: current preset
+    int  lookahead;                  // Speed controller: current lookahead (-1 = preset default)
+    int  preset_changes;             // Speed controller: encoder reconfigurations
+    int  pauses;                     // Times the job was paused (client or preemption)
+    long paused_ms;                  // Time spent paused
+    int  cgroup;                     // The cgroup fields are set (FINISH only)
+    long cgroup_cpu_ms;              // Cgroup: CPU time of the job
+    long cgroup_user_ms;             // Cgroup: user CPU time
+    long cgroup_system_ms;           // Cgroup: system CPU time
+    long cgroup_throttled_ms;        // Cgroup: time throttled by cpu.max
+    int64_t cgroup_memory_peak;      // Cgroup: peak memory (bytes)
+    int64_t frame_buffers;           // Huge page pools: buffers mapped (0 if disabled)
+    int64_t frame_buffers_hugetlb;   // Huge page pools: buffers backed by MAP_HUGETLB
+    int64_t frame_buffers_thp;       // Huge page pools: buffers advised as transparent huge pages
+    int  numa_node;                  // Placement: NUMA node of the job (-1 = not pinned)
+    const char *cpus;                // Placement: cpus pinned to the job (cpulist format)
+    int  loudness;                   // The loudness fields are set (FINISH only)
+    double loudness_i;               // Integrated loudness (LUFS)
+    double loudness_lra;             // Loudness range (LU)
+    double loudness_tp;              // True peak (dBTP)
+    double loudness_gain_db;         // Gain to reach the target loudness, 0 if not needed
+    int  nb_checksums;               // Outputs with checksums (FINISH only)
+    TAVChecksum checksums[MAX_OUTPUTS];
+    int  nb_stages;                  // Pipeline stages with samples (FINISH only)
+    TAVStageStatus stages[MAX_STAGES];
+    double fps;                      // Video frames encoded per second of processing (without the pauses)
+    long cpu_ms;                     // CPU of the worker process during the job
+    long threads_cpu_ms;             // CPU outside the timed stages: codec threads (frame/slice threads, lookahead)
+    int  usage;                      // The resource fields are set (FINISH only)
+    long user_cpu_ms;                // getrusage: user CPU of the job
+    long system_cpu_ms;              // getrusage: system CPU of the job
+    int64_t max_rss;                 // getrusage: peak resident memory of the worker (bytes)
+    long voluntary_ctxsw;            // getrusage: context switches waiting for I/O or locks
+    long involuntary_ctxsw;          // getrusage: context switches by preemption (CPU contention)
+    int64_t io_read_bytes;           // /proc/self/io rchar: bytes read (files, sockets, pipes), -1 if unknown
+    int64_t io_write_bytes;          // /proc/self/io wchar: bytes written, -1 if unknown
+    int64_t disk_read_bytes;         // /proc/self/io read_bytes: bytes read from storage, -1 if unknown
+    int64_t disk_write_bytes;        // /proc/self/io write_bytes: bytes written to storage, -1 if unknown
+    long latency_ms;                 // Live: average latency from input pts to mux time
+    long latency_max_ms;             // Live: maximum latency from input pts to mux time
 } TAVStatus;
 
 extern void dump_TAVConfigVideo(TAVConfigVideo *videoConfig);
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "pktav_usage.h"
+
+/*
+ * I/O counters of the process. Returns -1 if /proc/self/io cannot be read 
+ * (kernel without task I/O accounting).
+ */
+static int usage_read_io(TAVUsage *usage) {
+    char name[32];
+    int64_t value;
+    int found = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/io", "r")) == NULL)
+        return -1;
+    while (fscanf(fp, "%31[^:]: %" SCNd64 " ", name, &value) == 2) {
+        if (strcmp(name, "rchar") == 0)
+            usage->rchar = value;
+        else if (strcmp(name, "wchar") == 0)
+            usage->wchar = value;
+        else if (strcmp(name, "read_bytes") == 0)
+            usage->read_bytes = value;
+        else if (strcmp(name, "write_bytes") == 0)
+            usage->write_bytes = value;
+        else
+            continue;
+        found++;
+    }
+    fclose(fp);
+    return found == 4 ? 0 : -1;
+}
+
+static long usage_ms(const struct timeval *end, const struct timeval *start) {
+    return (end->tv_sec - start->tv_sec) * 1000L + (end->tv_usec - start->tv_usec) / 1000;
+}
+
+/**
+ * @brief Take the resources of the worker when the job starts.
+ *
+ * @param usage Pointer to the TAVUsage.
+ */
+void pktav_usage_start(TAVUsage *usage) {
+    memset(usage, 0, sizeof(TAVUsage));
+    getrusage(RUSAGE_SELF, &usage->ru);
+    usage->io = usage_read_io(usage) == 0;
+}
+
+/**
+ * @brief Report the resources used by the job: CPU, peak RSS, I/O bytes and context switches.
+ *
+ * @param usage Pointer to the TAVUsage taken by pktav_usage_start().
+ * @param status Pointer to the TAVStatus (FINISH).
+ *
+ * @note The peak RSS is the peak of the worker process, the rest are differences with the start of the job. 
+ *       The I/O bytes include the input and the outputs (files and sockets) and the status messages.
+ */
+void pktav_usage_status(TAVUsage *usage, TAVStatus *status) {
+    struct rusage ru;
+    TAVUsage end;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return;
+    status->usage = 1;
+    status->user_cpu_ms = usage_ms(&ru.ru_utime, &usage->ru.ru_utime);
+    status->system_cpu_ms = usage_ms(&ru.ru_stime, &usage->ru.ru_stime);
+    status->max_rss = (int64_t)ru.ru_maxrss * 1024;     /* Kilobytes on Linux */
+    status->voluntary_ctxsw = ru.ru_nvcsw - usage->ru.ru_nvcsw;
+    status->involuntary_ctxsw = ru.ru_nivcsw - usage->ru.ru_nivcsw;
+
+    status->io_read_bytes = status->io_write_bytes = -1;
+    status->disk_read_bytes = status->disk_write_bytes = -1;
+    memset(&end, 0, sizeof(TAVUsage));
+    if (usage->io && usage_read_io(&end) == 0) {
+        status->io_read_bytes = end.rchar - usage->rchar;
+        status->io_write_bytes = end.wchar - usage->wchar;
+        status->disk_read_bytes = end.read_bytes - usage->read_bytes;
+        status->disk_write_bytes = end.write_bytes - usage->write_bytes;
+    }
+}
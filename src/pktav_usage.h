@@ -0,0 +1,24 @@
+#ifndef _PKTAV_USAGE_H
+#define _PKTAV_USAGE_H 1
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include "pktav_types.h"
+
+/*
+ * Resources of the worker process when the job started: getrusage() and 
+ * /proc/self/io (all the threads, also the finished ones).
+ */
+typedef struct {
+    struct rusage ru;
+    int64_t rchar;              // Bytes read by read(2) and friends (files, sockets, pipes)
+    int64_t wchar;              // Bytes written
+    int64_t read_bytes;         // Bytes fetched from the storage layer
+    int64_t write_bytes;        // Bytes sent to the storage layer
+    int     io;                 // /proc/self/io was read
+} TAVUsage;
+
+extern void pktav_usage_start(TAVUsage *usage);
+extern void pktav_usage_status(TAVUsage *usage, TAVStatus *status);
+
+#endif
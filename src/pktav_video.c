@@ -4,26 +4,132 @@
 #include <string.h>
 #include <time.h>
 #include <inttypes.h>
+#include <math.h>
+#include <malloc.h>
 #include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
 #include <libavformat/avformat.h>
 #include <libavutil/timestamp.h>
 #include <libswresample/swresample.h>
 #include <libavutil/audio_fifo.h>
 #include <libavutil/opt.h>
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
 #include "pktav_mediainfo.h"
 #include "pktav_keyvalue.h"
 #include "pktav_error.h"
 #include "pktav_types.h"
 #include "pktav_proto.h"
+#include "pktav_mux.h"
+#include "pktav_thumbs.h"
+#include "pktav_checksum.h"
+#include "pktav_loudness.h"
+#include "pktav_quality.h"
+#include "pktav_probe.h"
+#include "pktav_sched.h"
+#include "pktav_cgroup.h"
+#include "pktav_framepool.h"
+#include "pktav_trace.h"
+#include "pktav_metrics.h"
+#include "pktav_stages.h"
+#include "pktav_usage.h"
+#include "pktav_video.h"
+#include "pktav_log.h"
 
 #define PKST_PAIR_DELIM '&'
 #define PKST_KV_DELIM   '='
 
 #define HANDLER_NAME "Media file produced by Peekast Media LLC (2024)."
-#define VIDEO_INDEX 0
-#define AUDIO_INDEX 1
 #define DEFAULT_PIX_FMT AV_PIX_FMT_YUV420P
+#define FRAG_MOVFLAGS   "+frag_keyframe+empty_moov+default_base_moof+cmaf"
+#define MAX_OPEN_IO     16
+#define LOUDNESS_TOLERANCE_LU 0.5   /* EBU R128: target +-0.5 LU */
+#define LOUDNESS_MAX_TP        -1.0  /* EBU R128: max true peak (dBTP) */
+#define LIVE_MAX_LATENCY_MS 1000
+#define SPEED_STEP_DOWN    0.95     /* Speed controller: faster preset below 95% of the target */
+#define SPEED_STEP_UP      1.25     /* Speed controller: slower preset above 125% of the target */
+#define SPEED_DEADLINE_MARGIN 1.10  /* Speed controller: 10% of the deadline is kept as margin */
+#define SPEED_GOP_MS       2000     /* Speed controller: GOP of the jobs without a GOP size */
+#define CONTROL_POLL_MS    20       /* Control messages are checked every 20 ms */
+#define CONTROL_WAIT_MS    1000     /* Paused: wait for the resume, sending the status every second */
+
+/*
+ * State used to notify the client every time a segmented muxer (hls, dash)
+ * closes a media segment. The muxer opens and closes every file through the
+ * io_open/io_close2 callbacks of the AVFormatContext, so we wrap them. Local
+ * segments of dash (and hls with hls_flags=temp_file) are written as
+ * <name>.tmp and renamed after the close, so they are reported on the next
+ * callback, when the final name exists.
+ */
+typedef struct {
+    int  socket;
+    long start_time;
+    int  segments;
+    struct {
+        AVIOContext *pb;
+        char        *url;
+    } open_io[MAX_OPEN_IO];
+    char *pending;              /* Segment written as <name>.tmp, reported once it is renamed */
+    int  (*io_open)(struct AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options);
+    int  (*io_close2)(struct AVFormatContext *s, AVIOContext *pb);
+} TAVSegmentNotify;
+
+/*
+ * Smart-cut state: the input video packets of the current GOP are buffered
+ * until the next keyframe, then the GOP is copied or re-encoded.
+ */
+typedef struct {
+    int          active;
+    int          encoding;          /* The encoder has frames of the current re-encoded GOPs */
+    int          drained;           /* The encoder was drained and must be reopened to encode again */
+    AVPacket     **gop;             /* Packets of the current GOP */
+    int          gop_count;
+    int          gop_size;
+    AVPacket     *tmp;
+    AVBSFContext *bsf;              /* mp4toannexb for the copied packets */
+    int          copied_gops;
+    int          encoded_gops;
+} TAVSmartCut;
+
+/*
+ * Speed controller: the encode speed (x realtime) is measured every GOP and
+ * the preset/lookahead of the encoder is stepped up or down at the GOP
+ * boundaries to keep the job on its target speed or deadline.
+ */
+typedef struct {
+    int          active;
+    int          level;             /* Current entry of speed_levels */
+    int          next_level;        /* Entry of speed_levels applied at the next keyframe */
+    double       target;            /* Target speed (x realtime), 0 if only a deadline */
+    int64_t      deadline_us;       /* av_gettime_relative() the job must finish by, 0 if none */
+    int64_t      duration_ms;       /* Media duration of the job, 0 if unknown */
+    double       fps;               /* Frame rate of the encoder */
+    int64_t      gop_frames;        /* Frames sent to the encoder when the GOP started */
+    int64_t      gop_start_us;      /* Wall clock when the GOP started */
+    double       speed;             /* Smoothed speed (x realtime) */
+    int          changes;           /* Encoder reconfigurations */
+    int          lookahead;         /* The lookahead is changed too (not in live mode) */
+} TAVSpeedControl;
+
+/*
+ * Pause/resume: the client (control messages) or the scheduler (preemption)
+ * pauses the job at a GOP boundary. The encoder is drained and freed, so its
+ * threads are released, and opened again on resume. A cancel message or a
+ * client hang-up aborts the job between packets.
+ */
+typedef struct {
+    int          socket;
+    int          enabled;           /* Live and smart-cut jobs cannot be paused */
+    int          pause;             /* The client asked to pause */
+    int          release;           /* Free the frame memory too while paused */
+    int          cancel;            /* Cancelled by the client or the client hung up */
+    int          ignored;           /* A preemption of a job that cannot be paused was logged */
+    int64_t      gop_frames;        /* Frames sent to the encoder when the GOP started */
+    int64_t      poll_us;           /* Last check of the control messages */
+    int          pauses;
+    int64_t      paused_us;
+} TAVControl;
 
 
 /**
@@ -51,6 +157,30 @@ void init_TAVContext(TAVContext *ctx) {
     ctx->fifo = NULL;
     ctx->resample_ctx = NULL;
     ctx->sws_ctx = NULL;
+    ctx->low_delay = 0;
+    ctx->live_origin_us = 0;
+    ctx->max_latency_us = 0;
+    ctx->frames_dropped = 0;
+    ctx->trim_start = AV_NOPTS_VALUE;
+    ctx->trim_end = AV_NOPTS_VALUE;
+    ctx->last_dts = AV_NOPTS_VALUE;
+    ctx->frame_rate = (AVRational){0, 0};
+    ctx->next_out_pts = AV_NOPTS_VALUE;
+    ctx->dup_sad = NULL;
+    ctx->dup_threshold = 0;
+    ctx->dup_max_skip = 0;
+    ctx->dup_count = 0;
+    ctx->frames_skipped = 0;
+    ctx->prev_frame = NULL;
+    ctx->dup_last = NULL;
+    ctx->thumbs = NULL;
+    ctx->loudness = NULL;
+    ctx->gain_db = 0.0;
+    ctx->quality = NULL;
+    ctx->frames_sent = 0;
+    ctx->gop_origin = 0;
+    ctx->scale_pool = NULL;
+    ctx->stages = NULL;
 }
 
 /**
@@ -81,6 +211,12 @@ void pktav_close_transcoder(TAVContext *tavc) {
     // Free the scale frame
     if (tavc->scale_frame) av_frame_free(&(tavc->scale_frame));
 
+    // Free the last encoded frame
+    if (tavc->prev_frame) av_frame_free(&(tavc->prev_frame));
+
+    // Free the last skipped frame
+    if (tavc->dup_last) av_frame_free(&(tavc->dup_last));
+
     // Free the audio FIFO buffer
     if (tavc->fifo) av_audio_fifo_free(tavc->fifo);
 
@@ -141,6 +277,12 @@ int pktav_open_default_transcoder(AVStream *stream, TAVConfigAudio *config, TAVC
         goto cleanup_decode_error;
     }
 
+    /* Live: frame threading adds one frame of delay per thread */
+    if (tavc->low_delay) {
+        tavc->decode_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        tavc->decode_ctx->thread_type = FF_THREAD_SLICE;
+    }
+
     /* Abre el decodificador para usarlo más tarde. */
     error = avcodec_open2(tavc->decode_ctx, tavc->decode_codec, NULL);
     if (error < 0) {
@@ -215,6 +357,8 @@ static int pktav_config_audio_encoder(TAVConfigAudio *config, TAVContext *tavc)
  */
 
 static int pktav_config_video_encoder(TAVConfigVideo *config, TAVContext *tavc) {
+    int repeat_headers;
+
     tavc->encode_ctx->width = config->width;
     tavc->encode_ctx->height = config->height;
     tavc->encode_ctx->gop_size = config->gop_size;
@@ -238,6 +382,38 @@ static int pktav_config_video_encoder(TAVConfigVideo *config, TAVContext *tavc)
     if (av_opt_set(tavc->encode_ctx->priv_data, "profile", config->profile, 0) < 0) {
         return AVERROR(EINVAL);
     }
+    if (config->tune && av_opt_set(tavc->encode_ctx->priv_data, "tune", config->tune, 0) < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    /* Reopened encoder: the global header was already muxed, the new parameter sets go in-band */
+    repeat_headers = (tavc->encode_ctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER) != 0;
+    if (repeat_headers)
+        av_opt_set(tavc->encode_ctx->priv_data, "x264-params", "repeat-headers=1", 0);
+
+    /* Fragmented/segmented output: a keyframe every gop_size frames and only there */
+    if (config->fixed_gop && config->gop_size > 0) {
+        char x265_params[64];
+        tavc->encode_ctx->keyint_min = config->gop_size;
+        av_opt_set_int(tavc->encode_ctx->priv_data, "sc_threshold", 0, 0);
+        snprintf(x265_params, sizeof(x265_params), "scenecut=0:min-keyint=%d%s", config->gop_size, 
+                 repeat_headers ? ":repeat-headers=1" : "");
+        av_opt_set(tavc->encode_ctx->priv_data, "x265-params", x265_params, 0);
+    } else if (repeat_headers) {
+        av_opt_set(tavc->encode_ctx->priv_data, "x265-params", "repeat-headers=1", 0);
+    }
+
+    /* Thread budget of the job (the cores pinned to it), otherwise one per core of the affinity mask */
+    if (config->threads > 0)
+        tavc->encode_ctx->thread_count = config->threads;
+
+    /* Speed controller: the preset default unless it was set */
+    if (config->lookahead >= 0)
+        av_opt_set_int(tavc->encode_ctx->priv_data, "rc-lookahead", config->lookahead, 0);
+
+    /* Quality metrics: the reconstructed frames are cheaper than decoding the packets */
+    if (config->quality_interval > 0 && (tavc->encode_codec->capabilities & AV_CODEC_CAP_ENCODER_RECON_FRAME))
+        tavc->encode_ctx->flags |= AV_CODEC_FLAG_RECON_FRAME;
 
     if (tavc->decode_ctx->width > tavc->encode_ctx->width && 
         tavc->decode_ctx->height > tavc->encode_ctx->height) {
@@ -292,6 +468,302 @@ int pktav_open_transcoder(AVStream *stream, void *config, TAVContext *tavc) {
     return error;
 }
 
+/**
+ * @brief Close and open again the video encoder with the given configuration.
+ * 
+ * The new encoder starts with a keyframe, so this must only be called at a GOP boundary after the 
+ * previous encoder was drained.
+ *
+ * @param config Pointer to the TAVConfigVideo structure with the (possibly updated) encoder configuration.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param flags Codec flags of the previous encoder (it may be freed already).
+ * 
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note The codec flags of the previous encoder (like AV_CODEC_FLAG_GLOBAL_HEADER) are kept. With a global
+ *       header x264/x265 repeat the parameter sets on every keyframe, since they can change with the preset
+ *       (see pktav_config_video_encoder).
+ * @note The keyframes of a fixed GOP count from here (`gop_origin`).
+ */
+static int pktav_reopen_video_encoder(TAVConfigVideo *config, TAVContext *tavc, int flags) {
+    avcodec_free_context(&tavc->encode_ctx);
+    if (tavc->sws_ctx) {
+        sws_freeContext(tavc->sws_ctx);
+        tavc->sws_ctx = NULL;
+    }
+    if (tavc->scale_frame)
+        av_frame_free(&tavc->scale_frame);
+
+    tavc->encode_ctx = avcodec_alloc_context3(tavc->encode_codec);
+    if (!tavc->encode_ctx)
+        return AVERROR(ENOMEM);
+    tavc->encode_ctx->flags = flags;
+    tavc->gop_origin = tavc->frames_sent;
+
+    return pktav_config_video_encoder(config, tavc);
+}
+
+/**
+ * @brief Apply the trimming window to a decoded frame.
+ *
+ * @param tavc Pointer to the TAVContext structure with the trimming window.
+ * @param frame Pointer to the decoded AVFrame, with timestamps in the input stream time base.
+ *
+ * @return Returns 1 if the frame is outside the window and must be dropped, 0 otherwise.
+ *
+ * @note The frames inside the window are shifted so the clip starts at timestamp 0.
+ */
+static int pktav_trim_frame(TAVContext *tavc, AVFrame *frame) {
+    if (frame->pts == AV_NOPTS_VALUE)
+        return 0;
+    if (tavc->trim_end != AV_NOPTS_VALUE && frame->pts >= tavc->trim_end)
+        return 1;
+    if (tavc->trim_start != AV_NOPTS_VALUE) {
+        if (frame->pts < tavc->trim_start)
+            return 1;
+        frame->pts -= tavc->trim_start;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check if a decoded frame is too late to be encoded (live mode only).
+ *
+ * @param tavc Pointer to the TAVContext structure with the live clock.
+ * @param frame Pointer to the decoded AVFrame, with timestamps in the input stream time base.
+ *
+ * @return Returns 1 if the frame should have been presented more than `max_latency_us` ago, 0 otherwise.
+ */
+static int pktav_frame_is_late(TAVContext *tavc, AVFrame *frame) {
+    int64_t due_us;
+
+    if (tavc->live_origin_us == 0 || tavc->max_latency_us <= 0 || frame->pts == AV_NOPTS_VALUE)
+        return 0;
+
+    due_us = tavc->live_origin_us + av_rescale_q(frame->pts, tavc->input_stream->time_base, AV_TIME_BASE_Q);
+    return av_gettime_relative() - due_us > tavc->max_latency_us;
+}
+
+/**
+ * @brief Capture a thumbnail from a decoded frame if one is due.
+ *
+ * @param tavc Pointer to the TAVContext structure with the thumbnail generator.
+ * @param frame Pointer to the decoded AVFrame (after trimming), with timestamps in the input stream time base.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+static int pktav_capture_thumbnail(TAVContext *tavc, AVFrame *frame) {
+    int64_t pts = frame->pts;
+    int64_t time_ms;
+
+    if (!tavc->thumbs || pts == AV_NOPTS_VALUE)
+        return 0;
+
+    /* Time from the beginning of the output (trimmed frames already start at 0) */
+    if (tavc->trim_start == AV_NOPTS_VALUE && tavc->input_stream->start_time != AV_NOPTS_VALUE)
+        pts -= tavc->input_stream->start_time;
+    time_ms = av_rescale_q(pts, tavc->input_stream->time_base, (AVRational){1, 1000});
+
+    if (!pktav_thumbs_due(tavc->thumbs, time_ms))
+        return 0;
+    return pktav_thumbs_add(tavc->thumbs, frame, time_ms);
+}
+
+/**
+ * @brief Frame rate conversion: get how many times a decoded frame must be encoded.
+ *
+ * The frame covers the interval [pts, pts + duration) of the input. It is encoded once for every 
+ * output frame slot that starts inside that interval, so frames are dropped when the output frame 
+ * rate is lower than the input one and repeated when it is higher.
+ *
+ * @param tavc Pointer to the TAVContext structure with the output frame rate.
+ * @param frame Pointer to the decoded AVFrame, with timestamps in the input stream time base.
+ *
+ * @return Returns the number of output frames for this frame (0 if it must be dropped). The first 
+ *         one has the pts `next_out_pts - n` in the encoder time base. Without conversion it is always 1.
+ */
+static int pktav_frame_rate_convert(TAVContext *tavc, AVFrame *frame) {
+    AVRational tb = tavc->input_stream->time_base;
+    AVRational rate = tavc->input_stream->avg_frame_rate;
+    int64_t duration, end;
+
+    if (tavc->frame_rate.num <= 0 || frame->pts == AV_NOPTS_VALUE)
+        return 1;
+
+    duration = frame->duration;
+    if (duration <= 0 && rate.num > 0 && rate.den > 0)
+        duration = av_rescale_q(1, av_inv_q(rate), tb);
+
+    if (tavc->next_out_pts == AV_NOPTS_VALUE)
+        tavc->next_out_pts = av_rescale_q_rnd(frame->pts, tb, tavc->encode_ctx->time_base, AV_ROUND_NEAR_INF);
+
+    end = av_rescale_q_rnd(frame->pts + duration, tb, tavc->encode_ctx->time_base, AV_ROUND_NEAR_INF);
+    if (duration <= 0 && end <= tavc->next_out_pts)
+        end = tavc->next_out_pts + 1;   /* Unknown duration: one output frame */
+    if (end <= tavc->next_out_pts)
+        return 0;
+
+    duration = end - tavc->next_out_pts;
+    tavc->next_out_pts = end;
+    return (int)duration;
+}
+
+/**
+ * @brief Enable the near-duplicate frame skipping of a video transcoder.
+ *
+ * @param tavc Pointer to the TAVContext structure of the video transcoder (decoder already open).
+ * @param threshold Max mean absolute luma difference per pixel of every 8x8 block.
+ * @param max_skip Max consecutive frames skipped, 0 for no limit.
+ *
+ * @return Returns 0 on success (or if the decoded format is not supported, the skipping is 
+ *         then disabled), or AVERROR(ENOMEM).
+ *
+ * @note Only 8-bit planar YUV/gray formats are compared (luma plane only).
+ */
+static int pktav_dup_init(TAVContext *tavc, int threshold, int max_skip) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(tavc->decode_ctx->pix_fmt);
+
+    if (!desc || desc->comp[0].depth != 8 || desc->comp[0].step != 1 || 
+        (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) ||
+        tavc->decode_ctx->width < 8 || tavc->decode_ctx->height < 8) {
+        pktav_log(NULL, 0, "Duplicate frame skipping disabled: unsupported input format\n");
+        return 0;
+    }
+
+    /* Block SAD of libavutil (SIMD when available) */
+    if ((tavc->dup_sad = av_pixelutils_get_sad_fn(3, 3, 0, NULL)) == NULL)
+        return 0;
+    if ((tavc->prev_frame = av_frame_alloc()) == NULL || (tavc->dup_last = av_frame_alloc()) == NULL) {
+        tavc->dup_sad = NULL;
+        return AVERROR(ENOMEM);
+    }
+    tavc->dup_threshold = threshold * 64;
+    tavc->dup_max_skip = max_skip;
+    return 0;
+}
+
+/**
+ * @brief Check if a decoded frame is a near-duplicate of the last encoded one.
+ *
+ * The luma planes are compared by 8x8 blocks, a frame is a duplicate only if no block changed 
+ * more than the threshold, so small changes (like a mouse pointer) are not lost.
+ *
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param frame Pointer to the decoded AVFrame.
+ *
+ * @return Returns 1 if the frame can be skipped, 0 if it must be encoded (the frame becomes the reference).
+ *
+ * @note The last skipped frame is kept in `dup_last`, it is encoded at the end of the stream so a 
+ *       static tail keeps its duration (see pktav_dup_flush).
+ */
+static int pktav_frame_is_dup(TAVContext *tavc, AVFrame *frame) {
+    AVFrame *prev = tavc->prev_frame;
+    int x, y, bx, by;
+
+    if (!tavc->dup_sad)
+        return 0;
+
+    if (prev->buf[0] && prev->width == frame->width && prev->height == frame->height &&
+        (tavc->dup_max_skip <= 0 || tavc->dup_count < tavc->dup_max_skip)) {
+        for (y = 0; y < frame->height; y += 8) {
+            /* The last row/column of blocks is aligned to the border */
+            by = FFMIN(y, frame->height - 8);
+            for (x = 0; x < frame->width; x += 8) {
+                bx = FFMIN(x, frame->width - 8);
+                if (tavc->dup_sad(frame->data[0] + by * frame->linesize[0] + bx, frame->linesize[0],
+                                  prev->data[0] + by * prev->linesize[0] + bx, prev->linesize[0]) > tavc->dup_threshold)
+                    goto changed;
+            }
+        }
+        tavc->dup_count++;
+        tavc->frames_skipped++;
+        av_frame_unref(tavc->dup_last);
+        if (av_frame_ref(tavc->dup_last, frame) < 0)
+            av_frame_unref(tavc->dup_last);
+        return 1;
+    }
+
+changed:
+    tavc->dup_count = 0;
+    av_frame_unref(tavc->dup_last);
+    av_frame_unref(prev);
+    if (av_frame_ref(prev, frame) < 0)
+        av_frame_unref(prev);   /* No reference: the next frame is encoded */
+    return 0;
+}
+
+/**
+ * @brief Scale a decoded video frame (if needed) and send it to the encoder.
+ *
+ * @param tavc Pointer to the TAVContext structure with the scaler and the encoder.
+ * @param frame Pointer to the decoded AVFrame. The frame is unreferenced.
+ * @param nb_frames Number of times the frame is sent to the encoder (frame rate conversion).
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note A repeated frame is scaled only once. With frame rate conversion the frames are sent with 
+ *       consecutive pts in the encoder time base.
+ */
+static int pktav_encode_video_frame(TAVContext *tavc, AVFrame *frame, int nb_frames) {
+    AVFrame *out = frame;
+    int i, error = 0;
+    TAVStageClock clock;
+
+    if (tavc->sws_ctx) {
+        pktav_stage_begin(tavc->stages, &clock);
+        tavc->scale_frame->format = tavc->encode_ctx->pix_fmt;
+        tavc->scale_frame->width  = tavc->encode_ctx->width;
+        tavc->scale_frame->height = tavc->encode_ctx->height;
+        if (!tavc->scale_pool || pktav_framepool_get(tavc->scale_pool, tavc->scale_frame, 
+                                                     tavc->scale_frame->width, tavc->scale_frame->height) < 0)
+            av_frame_get_buffer(tavc->scale_frame, 32); 
+
+        sws_scale(tavc->sws_ctx, (const uint8_t * const *)frame->data,
+                  frame->linesize, 0, tavc->decode_ctx->height,
+                  tavc->scale_frame->data, tavc->scale_frame->linesize);
+        pktav_stage_end(tavc->stages, STAGE_SCALE, &clock, 1);
+        PKTAV_TRACE_END(TRACE_SCALE, clock.wall_us, VIDEO_INDEX, frame->pts);
+        tavc->scale_frame->pts = frame->pts;
+        av_frame_unref(frame);
+        out = tavc->scale_frame;
+    }
+
+    for (i = 0; i < nb_frames && error >= 0; i++) {
+        if (tavc->frame_rate.num > 0 && out->pts != AV_NOPTS_VALUE) {
+            out->pts = tavc->next_out_pts - nb_frames + i;
+            out->duration = 1;
+        }
+        if (tavc->quality && (error = pktav_quality_source(tavc->quality, out)) < 0)
+            break;
+        pktav_stage_begin(tavc->stages, &clock);
+        if ((error = avcodec_send_frame(tavc->encode_ctx, out)) >= 0)
+            tavc->frames_sent++;
+        pktav_stage_end(tavc->stages, STAGE_ENCODE, &clock, 1);
+        PKTAV_TRACE_END(TRACE_ENCODE, clock.wall_us, VIDEO_INDEX, out->pts);
+    }
+    av_frame_unref(out);
+    return error;
+}
+
+/**
+ * @brief Encode the last skipped duplicate at the end of the stream.
+ *
+ * Without it a static tail would be cut off: the output would end at the last encoded 
+ * frame instead of the last decoded one.
+ *
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ *
+ * @return Returns 0 on success (or if there is no skipped frame), or a negative AVERROR code on failure.
+ */
+static int pktav_dup_flush(TAVContext *tavc) {
+    if (!tavc->dup_last || !tavc->dup_last->buf[0])
+        return 0;
+
+    tavc->dup_count = 0;
+    tavc->frames_skipped--;
+    return pktav_encode_video_frame(tavc, tavc->dup_last, 1);
+}
+
 /**
  * @brief Send a video packet to the decoder and process the resulting frames for encoding.
  * 
@@ -311,46 +783,75 @@ int pktav_open_transcoder(AVStream *stream, void *config, TAVContext *tavc) {
  *       before sending it to the encoder. If no scaling is required, the decoded frame is sent directly.
  * @note This function handles both the decoding and encoding steps and ensures that frames are unreferenced 
  *       after being processed to free their resources.
+ * @note In live mode the decoded frames that are already later than `max_latency_us` are dropped instead 
+ *       of being queued in the encoder.
+ * @note The frames outside the trimming window are dropped, the others are shifted to start at 0.
+ * @note Thumbnails are captured from the decoded frames, before the frame rate conversion.
+ * @note With an output frame rate, the frames are dropped or repeated before scaling.
+ * @note With duplicate skipping, the frames almost equal to the last encoded one are not encoded.
+ * @note A NULL packet drains the decoder (end of the stream), the last skipped duplicate is then encoded.
  */
 int pktav_send_video_packet(TAVContext *tavc, AVPacket *packet) {
     int error = 0;
+    int nb_frames;
+    TAVStageClock clock;
 
+    pktav_stage_begin(tavc->stages, &clock);
     error = avcodec_send_packet(tavc->decode_ctx, packet);
+    pktav_stage_end(tavc->stages, STAGE_DECODE, &clock, 0);
+    PKTAV_TRACE_END(TRACE_DECODE, clock.wall_us, VIDEO_INDEX, packet ? packet->pts : AV_NOPTS_VALUE);
     if (error < 0) {
         return error;
     }
 
     while (error >= 0) {
+        pktav_stage_begin(tavc->stages, &clock);
         error = avcodec_receive_frame(tavc->decode_ctx, tavc->input_frame);
+        pktav_stage_end(tavc->stages, STAGE_DECODE, &clock, error >= 0);
         if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
             break; // No más cuadros disponibles o fin del flujo
         } else if (error < 0) {
             return error;
         }
+        PKTAV_TRACE_END(TRACE_DECODE, clock.wall_us, VIDEO_INDEX, tavc->input_frame->pts);
 
-        if (tavc->sws_ctx) {
-            tavc->scale_frame->format = tavc->encode_ctx->pix_fmt;
-            tavc->scale_frame->width  = tavc->encode_ctx->width;
-            tavc->scale_frame->height = tavc->encode_ctx->height;
-            av_frame_get_buffer(tavc->scale_frame, 32); 
+        if (pktav_frame_is_late(tavc, tavc->input_frame)) {
+            /* Live: encoding a late frame would only add more latency */
+            tavc->frames_dropped++;
+            av_frame_unref(tavc->input_frame);
+            continue;
+        }
 
-            sws_scale(tavc->sws_ctx, (const uint8_t * const *)tavc->input_frame->data,
-                      tavc->input_frame->linesize, 0, tavc->decode_ctx->height,
-                      tavc->scale_frame->data, tavc->scale_frame->linesize);
-            tavc->scale_frame->pts = tavc->input_frame->pts;
+        if (pktav_trim_frame(tavc, tavc->input_frame)) {
+            av_frame_unref(tavc->input_frame);
+            continue;
+        }
 
-            error = avcodec_send_frame(tavc->encode_ctx, tavc->scale_frame);
-            av_frame_unref(tavc->scale_frame);
-        } else {
-            error = avcodec_send_frame(tavc->encode_ctx, tavc->input_frame);
+        if ((error = pktav_capture_thumbnail(tavc, tavc->input_frame)) < 0)
+            return error;
+
+        /* Frame rate conversion: the dropped frames are never scaled */
+        if ((nb_frames = pktav_frame_rate_convert(tavc, tavc->input_frame)) == 0) {
+            av_frame_unref(tavc->input_frame);
+            continue;
+        }
+
+        /* Static content: the near-duplicate frames are not encoded (variable frame rate output) */
+        if (pktav_frame_is_dup(tavc, tavc->input_frame)) {
             av_frame_unref(tavc->input_frame);
+            continue;
         }
 
+        error = pktav_encode_video_frame(tavc, tavc->input_frame, nb_frames);
         if (error < 0) {
             return error;
         }
     }
 
+    /* End of the stream: a static tail is not cut off */
+    if (!packet && error == AVERROR_EOF)
+        return pktav_dup_flush(tavc);
+
     return error == AVERROR_EOF || error == AVERROR(EAGAIN) ? 0 : error;
 }
 
@@ -371,28 +872,59 @@ int pktav_send_video_packet(TAVContext *tavc, AVPacket *packet) {
  * 
  * @note The function currently sends decoded audio frames directly to the encoder. It includes 
  *       a placeholder for resampling logic, which can be implemented if needed for format or rate conversions.
+ * @note The gain and the loudness meter of the transcoder are applied to the decoded frames, the 
+ *       loudness is measured after the gain (what is encoded). If the meter fails it is disabled 
+ *       and the final status has no loudness fields.
  * @note After sending frames to the encoder, the function unreferences the input frame to free 
  *       its resources and prepare it for the next packet.
  */
 int pktav_send_audio_packet(TAVContext *tavc, AVPacket *packet) {
     int error = 0;
+    TAVStageClock clock;
 
+    pktav_stage_begin(tavc->stages, &clock);
     error = avcodec_send_packet(tavc->decode_ctx, packet);
+    pktav_stage_end(tavc->stages, STAGE_AUDIO, &clock, 0);
+    PKTAV_TRACE_END(TRACE_DECODE, clock.wall_us, AUDIO_INDEX, packet ? packet->pts : AV_NOPTS_VALUE);
     if (error < 0) {
         return error;
     }
 
     while (error >= 0) {
+        pktav_stage_begin(tavc->stages, &clock);
         error = avcodec_receive_frame(tavc->decode_ctx, tavc->input_frame);
+        pktav_stage_end(tavc->stages, STAGE_AUDIO, &clock, 0);
         if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
             break; // No más cuadros disponibles o fin del flujo
         } else if (error < 0) {
             return error;
         }
+        PKTAV_TRACE_END(TRACE_DECODE, clock.wall_us, AUDIO_INDEX, tavc->input_frame->pts);
+
+        if (pktav_trim_frame(tavc, tavc->input_frame)) {
+            av_frame_unref(tavc->input_frame);
+            continue;
+        }
+
+        /* Gain (a second encode after measuring the loudness) */
+        if (tavc->gain_db != 0.0 && (error = pktav_audio_apply_gain(tavc->input_frame, tavc->gain_db)) < 0) {
+            av_frame_unref(tavc->input_frame);
+            return error;
+        }
+
+        /* The measurement is optional: a meter that fails is disabled, not the transcode */
+        if (tavc->loudness && (error = pktav_loudness_add(tavc->loudness, tavc->input_frame)) < 0) {
+            pktav_log(NULL, 0, "Loudness measurement disabled: %s\n", av_err2str(error));
+            tavc->loudness = NULL;
+        }
+
         if (0) {
             /* RESAMPLER */
         } else {
+            pktav_stage_begin(tavc->stages, &clock);
             error = avcodec_send_frame(tavc->encode_ctx, tavc->input_frame);
+            pktav_stage_end(tavc->stages, STAGE_AUDIO, &clock, 1);
+            PKTAV_TRACE_END(TRACE_ENCODE, clock.wall_us, AUDIO_INDEX, tavc->input_frame->pts);
             av_frame_unref(tavc->input_frame);
         }
 
@@ -460,15 +992,33 @@ static void pktav_rescale_audio_packet(AVStream *input, AVStream *output, AVPack
  * 
  * @note The function checks that the TAVContext is handling a video stream before attempting to receive a packet.
  * @note On success, the packet's timestamps are rescaled using `pktav_rescale_video_packet` to match the output stream's time base.
+ *       With frame rate conversion they are rescaled from the encoder time base instead.
  */
 int pktav_recv_video_packet(TAVContext *tavc, AVPacket *packet) {
     int error;
+    TAVStageClock clock;
     if (tavc->codec_type != AVMEDIA_TYPE_VIDEO) 
         return AVERROR_INVALIDDATA;
     
+    pktav_stage_begin(tavc->stages, &clock);
     error = avcodec_receive_packet(tavc->encode_ctx, packet);
-    if (error == 0) 
+    pktav_stage_end(tavc->stages, STAGE_ENCODE, &clock, 0);
+    if (error == 0)
+        PKTAV_TRACE_END(TRACE_ENCODE, clock.wall_us, VIDEO_INDEX, packet->pts);
+    if (error == 0 && tavc->quality && pktav_quality_packet(tavc->quality, tavc->encode_ctx, packet) < 0) {
+        /* The metrics are not worth failing the job */
+        pktav_log(NULL, 0, "Quality metrics disabled\n");
+        pktav_quality_close(tavc->quality);
+        tavc->quality = NULL;
+    }
+    if (error == 0 && tavc->frame_rate.num > 0) {
+        /* Frame rate conversion: the timestamps are in the encoder time base (one tick per frame) */
+        packet->stream_index = VIDEO_INDEX;
+        packet->duration = 1;
+        av_packet_rescale_ts(packet, tavc->encode_ctx->time_base, tavc->output_stream->time_base);
+    } else if (error == 0) {
         pktav_rescale_video_packet(tavc->input_stream, tavc->output_stream, packet);
+    }
 
     return error;
 }
@@ -492,25 +1042,132 @@ int pktav_recv_video_packet(TAVContext *tavc, AVPacket *packet) {
  */
 int pktav_recv_audio_packet(TAVContext *tavc, AVPacket *packet) {
     int error;
+    TAVStageClock clock;
     if (tavc->codec_type != AVMEDIA_TYPE_AUDIO) 
         return AVERROR_INVALIDDATA;
     
+    pktav_stage_begin(tavc->stages, &clock);
     error = avcodec_receive_packet(tavc->encode_ctx, packet);
+    pktav_stage_end(tavc->stages, STAGE_AUDIO, &clock, 0);
+    if (error == 0)
+        PKTAV_TRACE_END(TRACE_ENCODE, clock.wall_us, AUDIO_INDEX, packet->pts);
     if (error == 0) 
         pktav_rescale_audio_packet(tavc->input_stream, tavc->output_stream, packet);
 
     return error;
 }
 
+/**
+ * @brief Send a packet ready to be muxed to all the outputs.
+ *
+ * @param tavc Pointer to the TAVContext structure the packet belongs to.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to the AVPacket, with timestamps in the time base of the output stream.
+ *
+ * @return Returns the number of outputs still working, or a negative AVERROR code when all the outputs failed.
+ *
+ * @note The dts is kept strictly increasing, like the ffmpeg cli does, because encoded and copied packets 
+ *       can be mixed in the same stream (smart-cut) or the encoder can be reopened.
+ */
+static int pktav_send_to_outputs(TAVContext *tavc, TAVOutput *outs, int nb_outputs, AVPacket *packet) {
+    if (packet->dts != AV_NOPTS_VALUE) {
+        if (tavc->last_dts != AV_NOPTS_VALUE && packet->dts <= tavc->last_dts) {
+            packet->dts = tavc->last_dts + 1;
+            if (packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts)
+                packet->pts = packet->dts;
+        }
+        tavc->last_dts = packet->dts;
+    }
+    return pktav_output_send(outs, nb_outputs, packet, tavc->output_stream->time_base);
+}
+
+/*
+ * Media time of an encoded video packet (in the output time base), one frame 
+ * if the encoder did not set the duration. 0 for audio.
+ */
+static int64_t pktav_packet_us(TAVContext *tavc, AVPacket *packet) {
+    if (tavc->codec_type != AVMEDIA_TYPE_VIDEO)
+        return 0;
+    if (packet->duration > 0)
+        return av_rescale_q(packet->duration, tavc->output_stream->time_base, AV_TIME_BASE_Q);
+    if (tavc->encode_ctx->framerate.num > 0)
+        return av_rescale_q(1, av_inv_q(tavc->encode_ctx->framerate), AV_TIME_BASE_Q);
+    return 0;
+}
+
+/**
+ * @brief Receive all the packets available in the encoder and send them to the outputs.
+ *
+ * @param tavc Pointer to the TAVContext structure (audio or video).
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to an AVPacket used to receive the encoded data.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+static int pktav_write_packets(TAVContext *tavc, TAVOutput *outs, int nb_outputs, AVPacket *packet) {
+    int error;
+
+    for (;;) {
+        if (tavc->codec_type == AVMEDIA_TYPE_VIDEO)
+            error = pktav_recv_video_packet(tavc, packet);
+        else
+            error = pktav_recv_audio_packet(tavc, packet);
+        if (error < 0)
+            break;
+
+        pktav_metrics_encoded(tavc->codec_type == AVMEDIA_TYPE_VIDEO, packet->size, pktav_packet_us(tavc, packet));
+        error = pktav_send_to_outputs(tavc, outs, nb_outputs, packet);
+        av_packet_unref(packet);
+        if (error < 0)
+            return error;
+    }
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+/**
+ * @brief Drain a transcoder: flush the frames left in the decoder and the packets left in the encoder.
+ *
+ * @param tavc Pointer to the TAVContext structure (audio or video).
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to an AVPacket used to receive the encoded data.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note After this call the encoder cannot accept more frames (see pktav_reopen_video_encoder) and the 
+ *       decoder needs avcodec_flush_buffers() before accepting new packets.
+ */
+static int pktav_flush_transcoder(TAVContext *tavc, TAVOutput *outs, int nb_outputs, AVPacket *packet) {
+    int error;
+
+    if (tavc->codec_type == AVMEDIA_TYPE_VIDEO)
+        error = pktav_send_video_packet(tavc, NULL);
+    else
+        error = pktav_send_audio_packet(tavc, NULL);
+    if (error < 0 && error != AVERROR_EOF)
+        return error;
+
+    error = avcodec_send_frame(tavc->encode_ctx, NULL);
+    if (error < 0 && error != AVERROR_EOF)
+        return error;
+
+    return pktav_write_packets(tavc, outs, nb_outputs, packet);
+}
+
 
 int pktav_open_input_context(const char *input_media, AVFormatContext **avfc, AVDictionary *options) {
     int ret;
     *avfc = avformat_alloc_context();
     if (!*avfc) {
+        av_dict_free(&options);
         return AVERROR(ENOMEM);
     }
 
+    /* avformat_open_input replaces the dictionary with the options not found, free it here */
     ret = avformat_open_input(avfc, input_media, NULL, options ? &options : NULL);
+    av_dict_free(&options);
     if (ret < 0) {
         avformat_free_context(*avfc);
         return ret;
@@ -524,10 +1181,48 @@ int pktav_open_input_context(const char *input_media, AVFormatContext **avfc, AV
     return 0;
 }
 
-int pktva_get_video_stream(AVFormatContext *avfc, AVStream **stream) {
+/**
+ * @brief Check if a stream matches a track selection.
+ *
+ * @param stream Pointer to the AVStream.
+ * @param track Track selection: a stream index ("2") or a language ("spa"). NULL or empty matches any stream.
+ *
+ * @return Returns 1 if the stream matches, 0 otherwise.
+ */
+static int pktav_stream_match(AVStream *stream, const char *track) {
+    AVDictionaryEntry *lang;
+    char *end;
+    long index;
+
+    if (!track || !*track)
+        return 1;
+
+    index = strtol(track, &end, 10);
+    if (*end == '\0')
+        return index == stream->index;
+
+    lang = av_dict_get(stream->metadata, "language", NULL, 0);
+    return lang && av_strcasecmp(lang->value, track) == 0;
+}
+
+/**
+ * @brief Find the input stream of a type that matches a track selection.
+ *
+ * @param avfc Pointer to the input AVFormatContext.
+ * @param type Media type of the stream.
+ * @param track Track selection (see pktav_stream_match), NULL for the first stream of the type.
+ * @param stream Where the selected stream is stored.
+ *
+ * @return Returns the index of the stream, or -1 if there is no matching stream.
+ *
+ * @note Cover art (attached pictures) is never selected as the video stream.
+ */
+static int pktav_get_stream(AVFormatContext *avfc, enum AVMediaType type, const char *track, AVStream **stream) {
     int i;
     for (i = 0; i < avfc->nb_streams; i++) {
-        if (avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        if (avfc->streams[i]->codecpar->codec_type == type &&
+            !(avfc->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC) &&
+            pktav_stream_match(avfc->streams[i], track)) {
             *stream = avfc->streams[i];
             return i;
         }
@@ -535,56 +1230,279 @@ int pktva_get_video_stream(AVFormatContext *avfc, AVStream **stream) {
     return -1;
 }
 
-int pktva_get_audio_stream(AVFormatContext *avfc, AVStream **stream) {
+int pktva_get_video_stream(AVFormatContext *avfc, const char *track, AVStream **stream) {
+    return pktav_get_stream(avfc, AVMEDIA_TYPE_VIDEO, track, stream);
+}
+
+int pktva_get_audio_stream(AVFormatContext *avfc, const char *track, AVStream **stream) {
+    return pktav_get_stream(avfc, AVMEDIA_TYPE_AUDIO, track, stream);
+}
+
+/**
+ * @brief Discard all the input streams except the selected ones.
+ *
+ * The demuxer does not return packets of the discarded streams, so the unused tracks 
+ * (other languages, subtitles, data, attachments) are neither parsed nor copied.
+ *
+ * @param avfc Pointer to the input AVFormatContext.
+ * @param video Pointer to the selected video stream.
+ * @param audio Pointer to the selected audio stream.
+ */
+static void pktav_discard_streams(AVFormatContext *avfc, AVStream *video, AVStream *audio) {
     int i;
     for (i = 0; i < avfc->nb_streams; i++) {
-        if (avfc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
-            *stream = avfc->streams[i];
-            return i;
-        }
+        if (avfc->streams[i] != video && avfc->streams[i] != audio)
+            avfc->streams[i]->discard = AVDISCARD_ALL;
     }
-    return -1;
+}
+
+static long current_time_ms() {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec * 1000 + spec.tv_nsec / 1e6;
 }
 
 /**
- * @brief Initialize an output context for remuxing or encoding AV streams.
- * 
- * This function creates an AVFormatContext for output, based on the provided configuration 
- * and input AV streams. It handles both remuxing and encoding of video and audio streams.
+ * @brief Check if the output format is a segmented packager (HLS or DASH).
  *
- * @param config Pointer to a PKSTOutputConfig structure containing the configuration for the output context.
- * @note At each index, either the remux or enc pointer should be non-null, but not both. If both are non-null, 
- *       the function returns NULL.
- * @note If the function fails at any point, it will free all resources it has allocated up to that point and return NULL.
- * @note If the function is successful, it returns a pointer to the created AVFormatContext. The caller is 
- *       responsible for freeing this with avformat_free_context().
+ * @param ofmt Pointer to the AVOutputFormat selected for the output context.
  *
- * @return On success, a pointer to the created AVFormatContext. On failure, returns NULL.
+ * @return Returns 1 for the hls and dash muxers, 0 otherwise.
  */
+static int pktav_is_segmented_format(const AVOutputFormat *ofmt) {
+    return strcmp(ofmt->name, "hls") == 0 || strcmp(ofmt->name, "dash") == 0;
+}
 
-int pktva_open_output_context(TAVConfigFormat *config, AVFormatContext **ctx, TAVContext *video_enc, TAVContext *audio_enc) {
-    int error, i;
-    const AVOutputFormat *ofmt;
-    AVDictionary *opts = NULL;
-    KeyValueList *kv_opts;
-    
-    if (video_enc == NULL || audio_enc == NULL)
-        return AVERROR_ENCODER_NOT_FOUND;
+/**
+ * @brief Check if a file written by a segmented muxer is an fMP4 initialization segment.
+ *
+ * @param url The url of the file opened by the muxer.
+ *
+ * @return Returns 1 for the init segments (hls `init.mp4`, dash `init-stream*.m4s`), 0 otherwise.
+ */
+static int pktav_is_init_segment(const char *url) {
+    const char *name = strrchr(url, '/');
+    return strncmp(name ? name + 1 : url, "init", 4) == 0;
+}
+
+/**
+ * @brief Check if a file written by a segmented muxer is a playlist/manifest rather than a media segment.
+ *
+ * @param url The url of the file opened by the muxer.
+ *
+ * @return Returns 1 for playlists and manifests (also their temporary files), 0 for media segments.
+ */
+static int pktav_is_manifest(const char *url) {
+    size_t len = strlen(url);
 
+    if (len > 4 && strcmp(url + len - 4, ".tmp") == 0)
+        len -= 4;
+    return (len > 5 && strncmp(url + len - 5, ".m3u8", 5) == 0) || (len > 4 && strncmp(url + len - 4, ".mpd", 4) == 0);
+}
 
-    error = avformat_alloc_output_context2(ctx, NULL, config->dst_type, config->dst);
-    if (error <0) {
-        return error;
-    }
-    ofmt = (*ctx)->oformat;
+/*
+ * Tell the client that a segment is complete on disk.
+ */
+static void pktav_segment_send(TAVSegmentNotify *notify, const char *url) {
+    TAVStatus status;
 
-    if ((video_enc->output_stream = avformat_new_stream(*ctx, NULL)) == NULL) {
-        error = AVERROR(ENOMEM);
-        goto cleanup;
+    memset(&status, 0, sizeof(TAVStatus));
+    if (pktav_is_init_segment(url)) {
+        status.status = 5;
+        status.status_desc = "INIT_SEGMENT";
+    } else {
+        notify->segments++;
+        status.status = 2;
+        status.status_desc = "SEGMENT";
     }
+    status.proc_time_ms = current_time_ms() - notify->start_time;
+    status.err_msg = "";
+    status.segment = (char *)url;
+    send_status(notify->socket, &status);
+}
 
-    error = avcodec_parameters_from_context(video_enc->output_stream->codecpar, video_enc->encode_ctx);
-    if (error < 0) goto cleanup;
+/**
+ * @brief Report the temporary segment closed last, the muxer renamed it already.
+ *
+ * @param notify Pointer to the TAVSegmentNotify state.
+ *
+ * @note Called from the muxer callbacks and by the worker after the trailer, before the FINISH status.
+ */
+static void pktav_segment_notify_flush(TAVSegmentNotify *notify) {
+    if (!notify->pending)
+        return;
+    pktav_segment_send(notify, notify->pending);
+    av_freep(&notify->pending);
+}
+
+static int pktav_segment_io_open(struct AVFormatContext *s, AVIOContext **pb, const char *url, int flags, AVDictionary **options) {
+    TAVSegmentNotify *notify = s->opaque;
+    int error, i;
+
+    pktav_segment_notify_flush(notify);
+    error = notify->io_open(s, pb, url, flags, options);
+    if (error < 0 || !(flags & AVIO_FLAG_WRITE) || pktav_is_manifest(url))
+        return error;
+
+    for (i = 0; i < MAX_OPEN_IO; i++) {
+        if (notify->open_io[i].pb == NULL) {
+            notify->open_io[i].pb  = *pb;
+            notify->open_io[i].url = av_strdup(url);
+            break;
+        }
+    }
+    if (i == MAX_OPEN_IO)
+        pktav_log(NULL, 0, "Segment %s will not be notified: more than %d files open\n", url, MAX_OPEN_IO);
+    return error;
+}
+
+static int pktav_segment_io_close2(struct AVFormatContext *s, AVIOContext *pb) {
+    TAVSegmentNotify *notify = s->opaque;
+    char *url = NULL;
+    size_t len;
+    int error, i;
+
+    pktav_segment_notify_flush(notify);
+    for (i = 0; i < MAX_OPEN_IO; i++) {
+        if (pb && notify->open_io[i].pb == pb) {
+            url = notify->open_io[i].url;
+            notify->open_io[i].pb  = NULL;
+            notify->open_io[i].url = NULL;
+            break;
+        }
+    }
+
+    error = notify->io_close2(s, pb);
+    if (url && error >= 0) {
+        len = strlen(url);
+        if (len > 4 && strcmp(url + len - 4, ".tmp") == 0) {
+            /* Renamed by the muxer after this call */
+            url[len - 4] = '\0';
+            notify->pending = url;
+            return error;
+        }
+        /* The segment is complete on disk: tell the client */
+        pktav_segment_send(notify, url);
+    }
+    av_free(url);
+    return error;
+}
+
+/**
+ * @brief Hook the segment-complete notifications into a segmented output context.
+ *
+ * @param ctx Pointer to the output AVFormatContext (hls or dash muxer).
+ * @param notify Pointer to the TAVSegmentNotify state. It must outlive the output context.
+ */
+static void pktav_segment_notify_attach(AVFormatContext *ctx, TAVSegmentNotify *notify) {
+    notify->io_open   = ctx->io_open;
+    notify->io_close2 = ctx->io_close2;
+    ctx->opaque    = notify;
+    ctx->io_open   = pktav_segment_io_open;
+    ctx->io_close2 = pktav_segment_io_close2;
+}
+
+/**
+ * @brief Add the HLS/DASH packaging options for a segmented output.
+ *
+ * @param ofmt Pointer to the AVOutputFormat (hls or dash).
+ * @param config Pointer to the TAVConfigFormat with the segment duration and type.
+ * @param opts Dictionary where the muxer options are added.
+ *
+ * @note Segments are always cut on keyframes by the muxers, the worker aligns the GOP to the segment
+ *       duration so all the segments have the same length. The playlist/manifest is rewritten after every
+ *       segment, so a player can start before the job ends.
+ * @note Added after the muxer options of the client, which are kept. The `hls_flags` of the client are
+ *       merged with independent_segments.
+ */
+static void pktav_segment_options(const AVOutputFormat *ofmt, TAVConfigFormat *config, AVDictionary **opts) {
+    char buffer[32];
+
+    if (config->segment_duration_ms > 0)
+        snprintf(buffer, sizeof(buffer), "%.3f", config->segment_duration_ms / 1000.0);
+
+    if (strcmp(ofmt->name, "hls") == 0) {
+        if (config->segment_duration_ms > 0)
+            av_dict_set(opts, "hls_time", buffer, AV_DICT_DONT_OVERWRITE);
+        if (config->segment_type)
+            av_dict_set(opts, "hls_segment_type", config->segment_type, AV_DICT_DONT_OVERWRITE);
+        av_dict_set(opts, "hls_playlist_type", "event", AV_DICT_DONT_OVERWRITE);
+        if (av_dict_get(*opts, "hls_flags", NULL, 0))
+            av_dict_set(opts, "hls_flags", "+independent_segments", AV_DICT_APPEND);
+        else
+            av_dict_set(opts, "hls_flags", "independent_segments", 0);
+    } else {
+        if (config->segment_duration_ms > 0)
+            av_dict_set(opts, "seg_duration", buffer, AV_DICT_DONT_OVERWRITE);
+        av_dict_set(opts, "use_template", "1", AV_DICT_DONT_OVERWRITE);
+        av_dict_set(opts, "use_timeline", "1", AV_DICT_DONT_OVERWRITE);
+    }
+}
+
+/**
+ * @brief Check if the output format belongs to the ISO BMFF (mov/mp4) muxer family.
+ *
+ * @param ofmt Pointer to the AVOutputFormat selected for the output context.
+ *
+ * @return Returns 1 if the format accepts the mov muxer `movflags` option, 0 otherwise.
+ */
+static int pktav_is_mov_format(const AVOutputFormat *ofmt) {
+    const char *names[] = { "mp4", "mov", "ismv", "ipod", "3gp", "3g2", "psp", "f4v", NULL };
+    int i;
+
+    for (i = 0; names[i]; i++) {
+        if (strcmp(ofmt->name, names[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Initialize an output context for remuxing or encoding AV streams.
+ * 
+ * This function creates an AVFormatContext for output, based on the provided configuration 
+ * and input AV streams. It handles both remuxing and encoding of video and audio streams.
+ *
+ * @param config Pointer to a PKSTOutputConfig structure containing the configuration for the output context.
+ * @param notify Pointer to a TAVSegmentNotify used to report completed segments of hls/dash outputs (can be NULL).
+ * @note At each index, either the remux or enc pointer should be non-null, but not both. If both are non-null, 
+ *       the function returns NULL.
+ * @note If the function fails at any point, it will free all resources it has allocated up to that point and return NULL.
+ * @note If the function is successful, it returns a pointer to the created AVFormatContext. The caller is 
+ *       responsible for freeing this with avformat_free_context().
+ * @note When `config->frag_duration_ms` is set and the output is mov/mp4, the muxer is configured for
+ *       fragmented MP4/CMAF: an empty moov is written up front and a fragment is flushed on every keyframe
+ *       (the encoder has a fixed GOP, see `fixed_gop`) or after `frag_duration_ms`. Options in `kv_opts` still 
+ *       override these defaults.
+ * @note For hls/dash outputs the packaging options are added and, if `notify` is given, a SEGMENT status
+ *       is sent to the client every time a media segment is closed (INIT_SEGMENT for the fMP4 init segment).
+ *
+ * @return On success, a pointer to the created AVFormatContext. On failure, returns NULL.
+ */
+
+int pktva_open_output_context(TAVConfigFormat *config, AVFormatContext **ctx, TAVContext *video_enc, TAVContext *audio_enc, TAVSegmentNotify *notify) {
+    int error, i;
+    const AVOutputFormat *ofmt;
+    AVDictionary *opts = NULL;
+    KeyValueList *kv_opts;
+    
+    if (video_enc == NULL || audio_enc == NULL)
+        return AVERROR_ENCODER_NOT_FOUND;
+
+
+    error = avformat_alloc_output_context2(ctx, NULL, config->dst_type, config->dst);
+    if (error <0) {
+        return error;
+    }
+    ofmt = (*ctx)->oformat;
+
+    if ((video_enc->output_stream = avformat_new_stream(*ctx, NULL)) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    error = avcodec_parameters_from_context(video_enc->output_stream->codecpar, video_enc->encode_ctx);
+    if (error < 0) goto cleanup;
 
     if (ofmt->flags & AVFMT_GLOBALHEADER)
         video_enc->encode_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
@@ -600,10 +1518,19 @@ int pktva_open_output_context(TAVConfigFormat *config, AVFormatContext **ctx, TA
     if (error < 0) goto cleanup;
 
     if (!(ofmt->flags & AVFMT_NOFILE)) {
-        error = avio_open(&((*ctx)->pb), config->dst, AVIO_FLAG_WRITE);
+        /* Checksum: the file is hashed while it is written */
+        if (config->checksum)
+            error = pktav_hashio_open(&((*ctx)->pb), config->dst, config->checksum);
+        else
+            error = avio_open(&((*ctx)->pb), config->dst, AVIO_FLAG_WRITE);
         if (error < 0)
             goto cleanup;
     }
+    if (config->frag_duration_ms > 0 && pktav_is_mov_format(ofmt)) {
+        av_dict_set(&opts, "movflags", FRAG_MOVFLAGS, 0);
+        av_dict_set_int(&opts, "frag_duration", (int64_t)config->frag_duration_ms * 1000, 0);
+    }
+
     if (config->kv_opts) {
         kv_opts = kv_list_fromstring(config->kv_opts, PKST_PAIR_DELIM, PKST_KV_DELIM);
         if (kv_opts) {
@@ -614,6 +1541,12 @@ int pktva_open_output_context(TAVConfigFormat *config, AVFormatContext **ctx, TA
         }
     }
 
+    if (pktav_is_segmented_format(ofmt)) {
+        pktav_segment_options(ofmt, config, &opts);
+        if (notify)
+            pktav_segment_notify_attach(*ctx, notify);
+    }
+
     if (opts) {
         error = avformat_write_header(*ctx, &opts);
         av_dict_free(&opts);
@@ -626,7 +1559,9 @@ int pktva_open_output_context(TAVConfigFormat *config, AVFormatContext **ctx, TA
     return 0;
 
 close:
-    if (*ctx && !(ofmt->flags & AVFMT_NOFILE))
+    if (*ctx && !(ofmt->flags & AVFMT_NOFILE) && config->checksum)
+        pktav_hashio_close(&((*ctx)->pb));
+    else if (*ctx && !(ofmt->flags & AVFMT_NOFILE))
         avio_closep(&((*ctx)->pb));
 cleanup:
     if (*ctx)
@@ -635,10 +1570,747 @@ cleanup:
     return error;
 } 
 
-static long current_time_ms() {
-    struct timespec spec;
-    clock_gettime(CLOCK_MONOTONIC, &spec);
-    return spec.tv_sec * 1000 + spec.tv_nsec / 1e6;
+/**
+ * @brief Initialize the smart-cut state for the video transcoder.
+ *
+ * Smart-cut re-encodes only the GOPs that cross the clip boundaries and copies the compressed packets of 
+ * the GOPs that are entirely inside the clip. It is only possible when the encoded stream can be mixed with 
+ * the input stream: same codec, same resolution and pixel format.
+ *
+ * @param sc Pointer to the TAVSmartCut structure to be initialized.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder (encoder already open).
+ *
+ * @return Returns 1 if smart-cut is active, 0 if the whole clip has to be re-encoded, or a negative 
+ *         AVERROR code on failure.
+ *
+ * @note The copied H.264/HEVC packets are converted to Annex B with the parameter sets in-band, so a 
+ *       decoder switches between the parameter sets of the encoder and the ones of the input. The input 
+ *       must use closed GOPs.
+ */
+static int pktav_smartcut_init(TAVSmartCut *sc, TAVContext *tavc) {
+    AVCodecParameters *par = tavc->input_stream->codecpar;
+    const AVBitStreamFilter *filter = NULL;
+    int error;
+
+    memset(sc, 0, sizeof(TAVSmartCut));
+
+    if (par->codec_id != tavc->encode_ctx->codec_id || tavc->sws_ctx || tavc->frame_rate.num > 0 ||
+        par->width != tavc->encode_ctx->width || par->height != tavc->encode_ctx->height ||
+        par->format != tavc->encode_ctx->pix_fmt) {
+        pktav_log(NULL, 0, "Smart-cut disabled: the output video does not match the input, re-encoding the clip\n");
+        return 0;
+    }
+
+    /* avcC/hvcC extradata: the packets are length prefixed, convert them to Annex B */
+    if (par->extradata_size > 0 && par->extradata[0] == 1) {
+        if (par->codec_id == AV_CODEC_ID_H264)
+            filter = av_bsf_get_by_name("h264_mp4toannexb");
+        else if (par->codec_id == AV_CODEC_ID_HEVC)
+            filter = av_bsf_get_by_name("hevc_mp4toannexb");
+    }
+    if (filter) {
+        if ((error = av_bsf_alloc(filter, &sc->bsf)) < 0)
+            return error;
+        if ((error = avcodec_parameters_copy(sc->bsf->par_in, par)) < 0)
+            goto fail;
+        sc->bsf->time_base_in = tavc->input_stream->time_base;
+        if ((error = av_bsf_init(sc->bsf)) < 0)
+            goto fail;
+    }
+
+    if ((sc->tmp = av_packet_alloc()) == NULL) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    sc->active = 1;
+    return 1;
+
+fail:
+    av_bsf_free(&sc->bsf);
+    return error;
+}
+
+/**
+ * @brief Free all the resources of the smart-cut state.
+ *
+ * @param sc Pointer to the TAVSmartCut structure.
+ */
+static void pktav_smartcut_close(TAVSmartCut *sc) {
+    int i;
+    for (i = 0; i < sc->gop_count; i++)
+        av_packet_free(&sc->gop[i]);
+    av_freep(&sc->gop);
+    av_packet_free(&sc->tmp);
+    av_bsf_free(&sc->bsf);
+    sc->gop_count = sc->gop_size = 0;
+    sc->active = 0;
+}
+
+/**
+ * @brief Copy a compressed input packet to the outputs (stream copy).
+ *
+ * @param sc Pointer to the TAVSmartCut structure.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to the input AVPacket, it is unreferenced.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+static int pktav_smartcut_copy(TAVSmartCut *sc, TAVContext *tavc, TAVOutput *outs, int nb_outputs, AVPacket *packet) {
+    int error;
+
+    if (sc->bsf) {
+        if ((error = av_bsf_send_packet(sc->bsf, packet)) < 0)
+            return error;
+    } else {
+        av_packet_move_ref(sc->tmp, packet);
+    }
+
+    while (!sc->bsf || (error = av_bsf_receive_packet(sc->bsf, sc->tmp)) == 0) {
+        if (tavc->trim_start != AV_NOPTS_VALUE) {
+            if (sc->tmp->pts != AV_NOPTS_VALUE) sc->tmp->pts -= tavc->trim_start;
+            if (sc->tmp->dts != AV_NOPTS_VALUE) sc->tmp->dts -= tavc->trim_start;
+        }
+        pktav_rescale_video_packet(tavc->input_stream, tavc->output_stream, sc->tmp);
+        error = pktav_send_to_outputs(tavc, outs, nb_outputs, sc->tmp);
+        av_packet_unref(sc->tmp);
+        if (error < 0 || !sc->bsf)
+            return error < 0 ? error : 0;
+    }
+    return error == AVERROR(EAGAIN) ? 0 : error;
+}
+
+/**
+ * @brief Process the buffered GOP: copy it if it is entirely inside the clip, re-encode it otherwise.
+ *
+ * @param sc Pointer to the TAVSmartCut structure.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param config Pointer to the TAVConfigVideo used to reopen the encoder.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to an AVPacket used to receive the encoded data.
+ * @param next_key_pts The pts of the keyframe that starts the next GOP, AV_NOPTS_VALUE if unknown.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+static int pktav_smartcut_flush_gop(TAVSmartCut *sc, TAVContext *tavc, TAVConfigVideo *config, 
+                                    TAVOutput *outs, int nb_outputs, AVPacket *packet, int64_t next_key_pts) {
+    int64_t first_pts;
+    int i, copy, error = 0;
+
+    if (sc->gop_count == 0)
+        return 0;
+
+    first_pts = sc->gop[0]->pts;
+    copy = first_pts != AV_NOPTS_VALUE && next_key_pts != AV_NOPTS_VALUE &&
+           (tavc->trim_start == AV_NOPTS_VALUE || first_pts >= tavc->trim_start) &&
+           (tavc->trim_end == AV_NOPTS_VALUE || next_key_pts <= tavc->trim_end);
+
+    if (copy) {
+        if (sc->encoding) {
+            /* The encoded frames must reach the outputs before the copied ones */
+            if ((error = pktav_flush_transcoder(tavc, outs, nb_outputs, packet)) < 0)
+                goto done;
+            avcodec_flush_buffers(tavc->decode_ctx);
+            if (tavc->prev_frame)
+                av_frame_unref(tavc->prev_frame);
+            sc->encoding = 0;
+            sc->drained = 1;
+        }
+        for (i = 0; i < sc->gop_count && error >= 0; i++)
+            error = pktav_smartcut_copy(sc, tavc, outs, nb_outputs, sc->gop[i]);
+        sc->copied_gops++;
+    } else {
+        if (sc->drained) {
+            if ((error = pktav_reopen_video_encoder(config, tavc, tavc->encode_ctx->flags)) < 0)
+                goto done;
+            sc->drained = 0;
+        }
+        sc->encoding = 1;
+        for (i = 0; i < sc->gop_count && error >= 0; i++) {
+            if ((error = pktav_send_video_packet(tavc, sc->gop[i])) >= 0)
+                error = pktav_write_packets(tavc, outs, nb_outputs, packet);
+        }
+        sc->encoded_gops++;
+    }
+
+done:
+    for (i = 0; i < sc->gop_count; i++)
+        av_packet_free(&sc->gop[i]);
+    sc->gop_count = 0;
+    return error;
+}
+
+/**
+ * @brief Buffer an input video packet in smart-cut mode, processing the previous GOP when a keyframe arrives.
+ *
+ * @param sc Pointer to the TAVSmartCut structure.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param config Pointer to the TAVConfigVideo used to reopen the encoder.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to the input AVPacket, the caller keeps the ownership.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ */
+static int pktav_smartcut_packet(TAVSmartCut *sc, TAVContext *tavc, TAVConfigVideo *config, 
+                                 TAVOutput *outs, int nb_outputs, AVPacket *packet) {
+    AVPacket **gop;
+    int error;
+
+    if ((packet->flags & AV_PKT_FLAG_KEY) && sc->gop_count > 0) {
+        if ((error = pktav_smartcut_flush_gop(sc, tavc, config, outs, nb_outputs, sc->tmp, packet->pts)) < 0)
+            return error;
+    }
+
+    if (sc->gop_count == sc->gop_size) {
+        gop = av_realloc_array(sc->gop, sc->gop_size * 2 + 64, sizeof(AVPacket *));
+        if (!gop)
+            return AVERROR(ENOMEM);
+        sc->gop = gop;
+        sc->gop_size = sc->gop_size * 2 + 64;
+    }
+    if ((sc->gop[sc->gop_count] = av_packet_clone(packet)) == NULL)
+        return AVERROR(ENOMEM);
+    sc->gop_count++;
+    return 0;
+}
+
+/**
+ * @brief Process the last buffered GOP at the end of the clip.
+ *
+ * @param sc Pointer to the TAVSmartCut structure.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param config Pointer to the TAVConfigVideo used to reopen the encoder.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note Without an end point the last GOP ends with the input and can be copied, otherwise it crosses 
+ *       the end point and it is re-encoded.
+ */
+static int pktav_smartcut_finish(TAVSmartCut *sc, TAVContext *tavc, TAVConfigVideo *config, TAVOutput *outs, int nb_outputs) {
+    int64_t next_key_pts = tavc->trim_end == AV_NOPTS_VALUE ? INT64_MAX : AV_NOPTS_VALUE;
+    int error;
+
+    error = pktav_smartcut_flush_gop(sc, tavc, config, outs, nb_outputs, sc->tmp, next_key_pts);
+    pktav_log(NULL, 0, "Smart-cut: %d GOPs copied, %d GOPs re-encoded\n", sc->copied_gops, sc->encoded_gops);
+    return error;
+}
+
+/*
+ * Preset/lookahead steps of the speed controller, from the fastest to the most
+ * efficient one. Between two presets the lookahead is reduced first.
+ */
+static const struct {
+    const char *preset;
+    int        lookahead;
+} speed_levels[] = {
+    { "ultrafast", 0 },  { "superfast", 0 },  { "veryfast", 10 }, { "faster", 10 },
+    { "faster", 20 },    { "fast", 15 },      { "fast", 30 },      { "medium", 20 },
+    { "medium", 40 },    { "slow", 25 },      { "slow", 50 },      { "slower", 30 },
+    { "slower", 60 },    { "veryslow", 30 },  { "veryslow", 60 },
+};
+
+#define SPEED_LEVELS ((int)(sizeof(speed_levels) / sizeof(speed_levels[0])))
+
+/**
+ * @brief Initialize the speed controller of the video transcoder.
+ *
+ * @param sc Pointer to the TAVSpeedControl structure to be initialized.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder (encoder already open).
+ * @param config Pointer to the TAVConfigVideo with the target speed, the deadline and the initial preset.
+ * @param duration_ms Media duration of the job in ms (0 if unknown, a deadline is then ignored).
+ * @param start_us av_gettime_relative() when the job started, the deadline counts from there.
+ *
+ * @return Returns 1 if the controller is active, 0 otherwise.
+ *
+ * @note The initial level is the configured preset with its default lookahead. Presets that are not 
+ *       x264/x265 ones disable the controller, and so do the encoders that cannot repeat their parameter
+ *       sets in-band (the reopened encoder could not change them).
+ * @note The GOP must be fixed (`fixed_gop`), the encoder is only reopened where it puts a keyframe. The
+ *       worker sets a GOP of SPEED_GOP_MS when the client did not set a GOP size.
+ */
+static int pktav_speed_init(TAVSpeedControl *sc, TAVContext *tavc, TAVConfigVideo *config, int64_t duration_ms, int64_t start_us) {
+    int i;
+
+    memset(sc, 0, sizeof(TAVSpeedControl));
+    if (config->speed_target <= 0 && config->deadline_ms > 0 && duration_ms <= 0)
+        pktav_log(NULL, 0, "Speed controller disabled: deadline without a known duration\n");
+    if (config->speed_target <= 0 && (config->deadline_ms <= 0 || duration_ms <= 0))
+        return 0;
+
+    sc->level = -1;
+    for (i = 0; i < SPEED_LEVELS; i++) {
+        if (config->preset && strcmp(speed_levels[i].preset, config->preset) == 0)
+            sc->level = i;      /* The last one: the preset default lookahead */
+    }
+    if (sc->level < 0) {
+        pktav_log(NULL, 0, "Speed controller disabled: unknown preset %s\n", config->preset ? config->preset : "(none)");
+        return 0;
+    }
+    if (strcmp(tavc->encode_codec->name, "libx264") != 0 && strcmp(tavc->encode_codec->name, "libx265") != 0) {
+        pktav_log(NULL, 0, "Speed controller disabled: %s cannot repeat its headers\n", tavc->encode_codec->name);
+        return 0;
+    }
+    sc->next_level = sc->level;
+
+    sc->target = config->speed_target;
+    sc->deadline_us = config->deadline_ms > 0 ? start_us + (int64_t)config->deadline_ms * 1000 : 0;
+    sc->duration_ms = duration_ms;
+    sc->fps = av_q2d(config->framerate);
+    sc->lookahead = !tavc->low_delay;
+    sc->gop_frames = tavc->frames_sent;
+    sc->gop_start_us = av_gettime_relative();
+    sc->active = sc->fps > 0 && config->gop_size > 0 && config->fixed_gop;
+    if (!sc->active)
+        pktav_log(NULL, 0, "Speed controller disabled: %s\n", sc->fps > 0 ? "no fixed GOP" : "unknown frame rate");
+    return sc->active;
+}
+
+/*
+ * Speed needed to meet the deadline with the media left, with some margin.
+ */
+static double pktav_speed_target(TAVSpeedControl *sc, TAVContext *tavc, int64_t now_us) {
+    double target = sc->target, left_s, wall_s;
+
+    if (sc->deadline_us > 0) {
+        left_s = sc->duration_ms / 1000.0 - tavc->frames_sent / sc->fps;
+        wall_s = (sc->deadline_us - now_us) / 1000000.0;
+        if (left_s > 0)
+            target = FFMAX(target, wall_s > 0 ? SPEED_DEADLINE_MARGIN * left_s / wall_s : 1000.0);
+    }
+    return target;
+}
+
+/**
+ * @brief Measure the speed at the end of every GOP and step the preset/lookahead if needed.
+ *
+ * @param sc Pointer to the TAVSpeedControl structure.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param config Pointer to the TAVConfigVideo used to reopen the encoder. Its preset and lookahead are updated.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to an AVPacket used to receive the encoded data.
+ *
+ * @return Returns 0 on success, or a negative AVERROR code on failure.
+ *
+ * @note Must be called between input packets. The speed is measured after every gop_size frames, but 
+ *       a new level is only applied when the next frame is one of the keyframes of the fixed GOP, so the
+ *       reopened encoder (that starts with a keyframe) keeps the keyframe cadence. When a packet produces
+ *       several frames and one of them is the keyframe, the change waits for the next GOP.
+ */
+static int pktav_speed_control(TAVSpeedControl *sc, TAVContext *tavc, TAVConfigVideo *config, 
+                               TAVOutput *outs, int nb_outputs, AVPacket *packet) {
+    int64_t now_us, frames = tavc->frames_sent - sc->gop_frames;
+    double speed, target;
+    char *preset;
+    int level, error;
+
+    if (!sc->active)
+        return 0;
+
+    if (frames >= config->gop_size) {
+        now_us = av_gettime_relative();
+        speed = (frames / sc->fps) / FFMAX(now_us - sc->gop_start_us, 1) * 1000000.0;
+        sc->speed = sc->speed > 0 ? (sc->speed + speed) / 2 : speed;
+        sc->gop_frames = tavc->frames_sent;
+        sc->gop_start_us = now_us;
+
+        target = pktav_speed_target(sc, tavc, now_us);
+        level = sc->level;
+        if (sc->speed < target * SPEED_STEP_DOWN && level > 0)
+            level--;
+        else if (sc->speed > target * SPEED_STEP_UP && level < SPEED_LEVELS - 1)
+            level++;
+        /* In live mode only the preset changes */
+        while (!sc->lookahead && level != sc->level && strcmp(speed_levels[level].preset, speed_levels[sc->level].preset) == 0)
+            level += level > sc->level ? 1 : -1;
+        sc->next_level = level < 0 || level >= SPEED_LEVELS ? sc->level : level;
+    }
+
+    /* Only where the encoder puts a keyframe: the next frame starts a GOP */
+    level = sc->next_level;
+    if (level == sc->level || (tavc->frames_sent - tavc->gop_origin) % config->gop_size != 0)
+        return 0;
+    if ((preset = strdup(speed_levels[level].preset)) == NULL)
+        return AVERROR(ENOMEM);
+
+    /* Drain the encoder, the new one starts with a keyframe */
+    error = avcodec_send_frame(tavc->encode_ctx, NULL);
+    if (error < 0 && error != AVERROR_EOF)
+        return error;
+    if ((error = pktav_write_packets(tavc, outs, nb_outputs, packet)) < 0)
+        return error;
+
+    free(config->preset);
+    config->preset = preset;
+    if (sc->lookahead)
+        config->lookahead = speed_levels[level].lookahead;
+    pktav_log(NULL, 0, "Speed controller: %.2fx, preset %s -> %s, lookahead %d\n", sc->speed,
+                       speed_levels[sc->level].preset, config->preset, config->lookahead);
+    sc->level = level;
+    sc->changes++;
+
+    if ((error = pktav_reopen_video_encoder(config, tavc, tavc->encode_ctx->flags)) < 0)
+        return error;
+    sc->gop_start_us = av_gettime_relative();
+    return 0;
+}
+
+/*
+ * Report the state of the speed controller.
+ */
+static void pktav_status_speed(TAVStatus *status, TAVSpeedControl *sc, TAVConfigVideo *config) {
+    if (!sc->active || sc->speed <= 0)
+        return;
+    status->speed = sc->speed;
+    status->preset = config->preset;
+    status->lookahead = config->lookahead;
+    status->preset_changes = sc->changes;
+}
+
+/**
+ * @brief Initialize the pause/resume control of the job.
+ *
+ * @param ctl Pointer to the TAVControl structure to be initialized.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder (encoder already open).
+ * @param socket The socket of the client, where the control messages are received.
+ * @param enabled 0 if the job cannot be paused (live and smart-cut jobs), the pause messages are then ignored.
+ */
+static void pktav_control_init(TAVControl *ctl, TAVContext *tavc, int socket, int enabled) {
+    memset(ctl, 0, sizeof(TAVControl));
+    ctl->socket = socket;
+    ctl->enabled = enabled;
+    ctl->gop_frames = tavc->frames_sent;
+    ctl->poll_us = av_gettime_relative();
+}
+
+/**
+ * @brief Check the control messages of the client (at most every CONTROL_POLL_MS).
+ *
+ * @param ctl Pointer to the TAVControl structure.
+ *
+ * @return Returns 1 if the job must be cancelled (cancel message or client hang-up), 0 otherwise.
+ *
+ * @note A pause is only recorded here, the job is paused at the next GOP boundary (pktav_control_gop).
+ */
+static int pktav_control_poll(TAVControl *ctl) {
+    int64_t now_us = av_gettime_relative();
+    int ret, release = 0;
+
+    if (ctl->cancel || now_us - ctl->poll_us < CONTROL_POLL_MS * 1000)
+        return ctl->cancel;
+    ctl->poll_us = now_us;
+
+    ret = recv_control(ctl->socket, 0, &release);
+    if (ret < 0 || ret == CONTROL_CANCEL) {
+        pktav_log(NULL, 0, "Job cancelled: %s\n", ret < 0 ? "client hung up" : "cancel message");
+        ctl->cancel = 1;
+    } else if (ret == CONTROL_PAUSE && !ctl->enabled) {
+        pktav_log(NULL, 0, "Pause ignored: live and smart-cut jobs cannot be paused\n");
+    } else if (ret == CONTROL_PAUSE) {
+        ctl->pause = 1;
+        ctl->release = release;
+    } else if (ret == CONTROL_RESUME) {
+        ctl->pause = 0;         /* Not paused yet */
+    }
+    return ctl->cancel;
+}
+
+/*
+ * Paused by the client: release the cores of the job and wait for the resume.
+ */
+static int pktav_control_wait(TAVControl *ctl) {
+    TAVStatus status;
+    int ret;
+
+    pktav_sched_pause();
+    while (ctl->pause) {
+        memset(&status, 0, sizeof(TAVStatus));
+        status.status = 3;
+        status.status_desc = "PAUSED";
+        status.err_msg = "";
+        status.pauses = ctl->pauses + 1;
+        status.paused_ms = ctl->paused_us / 1000;
+        ret = send_status(ctl->socket, &status);
+        if (ret == 0)
+            ret = recv_control(ctl->socket, CONTROL_WAIT_MS, NULL);
+        if (ret < 0 || ret == CONTROL_CANCEL) {
+            pktav_log(NULL, 0, "Paused job cancelled: %s\n", ret < 0 ? "client hung up" : "cancel message");
+            ctl->cancel = 1;
+            return AVERROR_EXIT;
+        }
+        if (ret == CONTROL_RESUME)
+            ctl->pause = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Pause the job at a GOP boundary if the client or the scheduler asked for it.
+ *
+ * The encoder is drained and freed, so its threads (and its lookahead frames) are released while the 
+ * job is paused. With `release` the scaler and the duplicate frame reference are freed too and the 
+ * heap is trimmed. On resume the job is queued again in the scheduler, then a new encoder is opened, 
+ * so the output continues with a keyframe.
+ *
+ * Without a GOP size (the encoder picks its keyframes) the job pauses at the next call: the encoder is 
+ * drained there and the new one starts with a keyframe, which begins a new GOP.
+ *
+ * @param ctl Pointer to the TAVControl structure.
+ * @param tavc Pointer to the TAVContext structure of the video transcoder.
+ * @param config Pointer to the TAVConfigVideo used to reopen the encoder.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param packet Pointer to an AVPacket used to receive the encoded data.
+ *
+ * @return Returns 1 if the job was paused and resumed, 0 if it was not paused, or a negative AVERROR 
+ *         code on failure (AVERROR_EXIT if the job was cancelled while paused).
+ *
+ * @note Must be called between input packets. The decoder is kept: the input is read from where it was.
+ */
+static int pktav_control_gop(TAVControl *ctl, TAVContext *tavc, TAVConfigVideo *config, 
+                             TAVOutput *outs, int nb_outputs, AVPacket *packet) {
+    int64_t start_us;
+    int flags, error, preempted;
+
+    if (!ctl->enabled) {
+        if (!ctl->ignored && pktav_sched_preempted()) {
+            pktav_log(NULL, 0, "Preemption ignored: live and smart-cut jobs cannot be paused\n");
+            ctl->ignored = 1;
+        }
+        return 0;
+    }
+    if (config->gop_size > 0 && tavc->frames_sent - ctl->gop_frames < config->gop_size)
+        return 0;
+    ctl->gop_frames = tavc->frames_sent;
+
+    preempted = pktav_sched_preempted();
+    if (!ctl->pause && !preempted)
+        return 0;
+
+    /* Drain the encoder and free it with its threads */
+    error = avcodec_send_frame(tavc->encode_ctx, NULL);
+    if (error < 0 && error != AVERROR_EOF)
+        return error;
+    if ((error = pktav_write_packets(tavc, outs, nb_outputs, packet)) < 0)
+        return error;
+    flags = tavc->encode_ctx->flags;
+    avcodec_free_context(&tavc->encode_ctx);
+
+    if (ctl->release) {
+        if (tavc->sws_ctx) {
+            sws_freeContext(tavc->sws_ctx);
+            tavc->sws_ctx = NULL;
+        }
+        av_frame_free(&tavc->scale_frame);
+        if (tavc->prev_frame)
+            av_frame_unref(tavc->prev_frame);   /* The next frame is encoded */
+        malloc_trim(0);
+    }
+
+    start_us = av_gettime_relative();
+    pktav_log(NULL, 0, "Job paused (%s) after %" PRId64 " frames\n", ctl->pause ? "client" : "preempted", tavc->frames_sent);
+    if (ctl->pause)
+        error = pktav_control_wait(ctl);
+    else
+        pktav_sched_pause();
+    /* Queued again, with the same order it had */
+    if (error == 0 && pktav_sched_resume(ctl->socket) < 0) {
+        ctl->cancel = 1;
+        error = AVERROR_EXIT;
+    }
+    if (error < 0)
+        return error;
+
+    ctl->pauses++;
+    ctl->paused_us += av_gettime_relative() - start_us;
+    ctl->release = 0;
+    pktav_log(NULL, 0, "Job resumed after %" PRId64 " ms\n", (av_gettime_relative() - start_us) / 1000);
+
+    if ((error = pktav_reopen_video_encoder(config, tavc, flags)) < 0)
+        return error;
+    return 1;
+}
+
+/**
+ * @brief Check if a packet is past the end of the clip.
+ *
+ * @param tavc Pointer to the TAVContext structure.
+ * @param packet Pointer to the input AVPacket.
+ *
+ * @return Returns 1 if the packet and all the packets after it are past the end of the clip, 0 otherwise.
+ *
+ * @note The dts is used for video, since with B-frames the pts is not monotonic but all the frames 
+ *       decoded after a dts past the end point are presented after it too.
+ */
+static int pktav_trim_done(TAVContext *tavc, AVPacket *packet) {
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+    if (tavc->trim_end == AV_NOPTS_VALUE || ts == AV_NOPTS_VALUE)
+        return 0;
+    if (tavc->codec_type == AVMEDIA_TYPE_AUDIO && packet->pts != AV_NOPTS_VALUE)
+        ts = packet->pts;
+    return ts >= tavc->trim_end;
+}
+
+/**
+ * @brief Set the trimming window of a transcoder in the time base of its input stream.
+ *
+ * @param ifc Pointer to the input AVFormatContext.
+ * @param tavc Pointer to the TAVContext structure.
+ * @param start_ms Start of the clip in ms from the beginning of the input (0 = beginning).
+ * @param end_ms End of the clip in ms from the beginning of the input (0 = end of the input).
+ */
+static void pktav_trim_window(AVFormatContext *ifc, TAVContext *tavc, int start_ms, int end_ms) {
+    int64_t offset = ifc->start_time != AV_NOPTS_VALUE ? ifc->start_time : 0;
+    AVRational tb = tavc->input_stream->time_base;
+
+    if (start_ms > 0)
+        tavc->trim_start = av_rescale_q(offset + (int64_t)start_ms * 1000, AV_TIME_BASE_Q, tb);
+    if (end_ms > 0)
+        tavc->trim_end = av_rescale_q(offset + (int64_t)end_ms * 1000, AV_TIME_BASE_Q, tb);
+}
+
+/**
+ * @brief Get the progress of a job from the timestamp of a packet.
+ *
+ * @param ifc Pointer to the input AVFormatContext.
+ * @param packet Pointer to the AVPacket just read from the input.
+ * @param start_ms Start of the clip in ms from the beginning of the input (0 = beginning).
+ * @param end_ms End of the clip in ms from the beginning of the input (0 = end of the input).
+ *
+ * @return Returns the percentage (0-99) of the clip already read, or -1 if the packet has no timestamp 
+ *         or the end of the clip is unknown.
+ *
+ * @note The packet counts of the media info are of the whole input and of its first audio and video 
+ *       streams, so they do not apply to a clip or to a track selection.
+ */
+static int pktav_pts_progress(AVFormatContext *ifc, AVPacket *packet, int start_ms, int end_ms) {
+    int64_t offset = ifc->start_time != AV_NOPTS_VALUE ? ifc->start_time : 0;
+    int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    int64_t end_us, pos_us;
+
+    if (end_ms > 0)
+        end_us = (int64_t)end_ms * 1000;
+    else if (ifc->duration != AV_NOPTS_VALUE)
+        end_us = ifc->duration;
+    else
+        return -1;
+    if (ts == AV_NOPTS_VALUE || end_us <= (int64_t)start_ms * 1000)
+        return -1;
+
+    pos_us = av_rescale_q(ts, ifc->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q) - offset;
+    pos_us = av_clip64(pos_us - (int64_t)start_ms * 1000, 0, end_us - (int64_t)start_ms * 1000);
+    return FFMIN(pos_us * 100 / (end_us - (int64_t)start_ms * 1000), 99);
+}
+
+/**
+ * @brief Get the wall clock origin of the input in live mode.
+ *
+ * @param stream Pointer to the AVStream the packet belongs to.
+ * @param packet Pointer to the first AVPacket read from the input.
+ *
+ * @return Returns the wall clock (us) that corresponds to the input timestamp 0, or 0 if the packet has no timestamp.
+ */
+static int64_t pktav_live_origin(AVStream *stream, AVPacket *packet) {
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (ts == AV_NOPTS_VALUE)
+        return 0;
+    return av_gettime_relative() - av_rescale_q(ts, stream->time_base, AV_TIME_BASE_Q);
+}
+
+/**
+ * @brief Pace the input in live mode, so a packet is not processed before its time.
+ *
+ * @param origin_us Wall clock (us) of the input timestamp 0.
+ * @param stream Pointer to the AVStream the packet belongs to.
+ * @param packet Pointer to the AVPacket read from the input.
+ *
+ * @note A real live source never gets ahead of the wall clock, so this only waits when the input is a 
+ *       file or a FIFO used as a stand-in for a live source.
+ */
+static void pktav_live_pace(int64_t origin_us, AVStream *stream, AVPacket *packet) {
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    int64_t wait_us;
+
+    if (ts == AV_NOPTS_VALUE)
+        return;
+    wait_us = origin_us + av_rescale_q(ts, stream->time_base, AV_TIME_BASE_Q) - av_gettime_relative();
+    if (wait_us > 0)
+        av_usleep(wait_us);
+}
+
+/**
+ * @brief Count the outputs disabled after a muxing error.
+ *
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ *
+ * @return Returns the number of outputs with an error.
+ */
+static int pktav_count_failed_outputs(TAVOutput *outs, int nb_outputs) {
+    int i, failed = 0;
+    for (i = 0; i < nb_outputs; i++) {
+        if (pktav_output_error(&outs[i]) < 0)
+            failed++;
+    }
+    return failed;
+}
+
+/**
+ * @brief Fill the loudness fields of the final status.
+ *
+ * @param status Pointer to the TAVStatus to be filled.
+ * @param meter Pointer to the TAVLoudness meter of the audio transcoder.
+ * @param target Target integrated loudness in LUFS, 0 if there is no target.
+ *
+ * @note The gain is only reported when the loudness is outside of the tolerance of the target. It is 
+ *       limited so the true peak stays below LOUDNESS_MAX_TP.
+ */
+static void pktav_status_loudness(TAVStatus *status, TAVLoudness *meter, double target) {
+    status->loudness = 1;
+    status->loudness_i = pktav_loudness_integrated(meter);
+    status->loudness_lra = pktav_loudness_range(meter);
+    status->loudness_tp = pktav_loudness_true_peak(meter);
+    status->loudness_gain_db = 0.0;
+
+    if (target != 0.0 && isfinite(status->loudness_i) && 
+        fabs(target - status->loudness_i) > LOUDNESS_TOLERANCE_LU) {
+        status->loudness_gain_db = target - status->loudness_i;
+        if (isfinite(status->loudness_tp) && status->loudness_tp + status->loudness_gain_db > LOUDNESS_MAX_TP)
+            status->loudness_gain_db = LOUDNESS_MAX_TP - status->loudness_tp;
+    }
+    pktav_log(NULL, 0, "Loudness: I %.1f LUFS, LRA %.1f LU, TP %.1f dBTP, gain %.1f dB\n", status->loudness_i, 
+                       status->loudness_lra, status->loudness_tp, status->loudness_gain_db);
+}
+
+/**
+ * @brief Fill the job statistics of a status message.
+ *
+ * @param status Pointer to the TAVStatus to be filled.
+ * @param tvideo Pointer to the TAVContext of the video transcoder.
+ * @param outs Array of TAVOutput structures.
+ * @param nb_outputs Number of outputs in the array.
+ * @param outputs_failed Number of outputs that could not be opened.
+ */
+static void pktav_status_stats(TAVStatus *status, TAVContext *tvideo, TAVOutput *outs, int nb_outputs, int outputs_failed) {
+    status->outputs_failed = outputs_failed + pktav_count_failed_outputs(outs, nb_outputs);
+    status->frames_dropped = tvideo->frames_dropped;
+    status->frames_skipped = tvideo->frames_skipped;
+    status->thumbnails = tvideo->thumbs ? tvideo->thumbs->count : 0;
+    if (tvideo->quality && tvideo->quality->frames > 0) {
+        status->quality_frames = tvideo->quality->frames;
+        status->psnr = tvideo->quality->psnr_sum / tvideo->quality->frames;
+        status->psnr_y = tvideo->quality->psnr_y_sum / tvideo->quality->frames;
+        status->psnr_min = tvideo->quality->psnr_min;
+        status->ssim = tvideo->quality->ssim_sum / tvideo->quality->frames;
+        status->ssim_min = tvideo->quality->ssim_min;
+    }
+    pktav_output_latency(outs, nb_outputs, &status->latency_ms, &status->latency_max_ms);
 }
 
 /**
@@ -658,7 +2330,7 @@ static long current_time_ms() {
  * @return Returns 0 on success, or a negative AVERROR code on failure.
  * 
  * @note The function initializes both the audio and video transcoders, processes each packet, and writes 
- *       the transcoded data to the output context. It also calculates the current progress and sends 
+ *       the transcoded data to every output context (config_fmt and the outputs chained with `next`). It also calculates the current progress and sends 
  *       periodic status updates to the client.
  * @note In case of failure, the function ensures proper cleanup of all allocated resources, including 
  *       packet memory, format contexts, and transcoder contexts.
@@ -669,43 +2341,155 @@ int pktav_worker(int socket, const char *input, TAVInfo *mi, TAVConfigFormat *co
     AVStream *svideo = NULL;
     AVPacket *packet = NULL;
     AVFormatContext *ifc = NULL;    /* Input Format Context  */
+    AVDictionary *iopts = NULL;     /* Input options */
     AVFormatContext *ofc = NULL;    /* Output Format Context */
+    TAVOutput outputs[MAX_OUTPUTS]; /* Outputs, each one with its own muxing thread */
+    TAVConfigFormat *config_out;
     TAVContext tvideo;              /* Video Transcoder */
     TAVContext taudio;              /* Audio Transcoder */
     time_t start_time;
     int apkts = 0;
     int vpkts = 0;
     int current_pct = 0;
+    int pts_pct = -1;
     int counter = 0;
-
+    int gop_ms = 0;
+    int nb_outputs = 0;
+    int outputs_failed = 0;
+    int i, ret;
+    int64_t live_origin = 0;
+    int64_t seek_ts;
+    int video_done = 0;
+    int audio_done = 0;
+    TAVSegmentNotify notify[MAX_OUTPUTS]; /* HLS/DASH segment events */
+    TAVSmartCut smartcut;                 /* Clip: copy the GOPs inside the clip */
+    TAVThumbs thumbs;                     /* Thumbnails from the decoded frames */
+    TAVLoudness loudness;                 /* EBU R128 meter of the decoded audio */
+    TAVQuality quality;                   /* Sampled PSNR/SSIM of the encoded video */
+    TAVProbe probe;                       /* Complexity probe of the input */
+    TAVSpeedControl speedctl;             /* Preset/lookahead controller */
+    TAVControl control;                   /* Pause/resume (client and preemption) */
+    TAVFramePool decode_pool;             /* Huge page buffers of the decoded frames */
+    TAVFramePool scale_pool;              /* Huge page buffers of the scaled frames */
+    TAVStages stages;                     /* Per-frame latency and time of every stage */
+    TAVStageClock clock;
+    TAVUsage usage;                       /* Resources of the worker when the job started */
+    int64_t job_start_us = av_gettime_relative();
+    int64_t duration_ms;
+
+    /* Thumbnail job: no transcode, only the keyframes are decoded */
+    if (config_video->thumbs.only)
+        return pktav_thumbs_worker(socket, input, config_video);
+
+    memset(&smartcut, 0, sizeof(TAVSmartCut));
+    memset(&thumbs, 0, sizeof(TAVThumbs));
+    memset(&loudness, 0, sizeof(TAVLoudness));
+    memset(&quality, 0, sizeof(TAVQuality));
+    memset(&probe, 0, sizeof(TAVProbe));
+    memset(&speedctl, 0, sizeof(TAVSpeedControl));
+    memset(&control, 0, sizeof(TAVControl));
+    pktav_framepool_init(&decode_pool);
+    pktav_framepool_init(&scale_pool);
     init_TAVContext(&tvideo);
     init_TAVContext(&taudio);
+    pktav_stages_init(&stages);
+    pktav_usage_start(&usage);
+
+    /*
+     * Live mode: no input buffering, no decoder/encoder delay and late 
+     * frames are dropped instead of being queued.
+     */
+    if (config_fmt->live) {
+        av_dict_set(&iopts, "fflags", "nobuffer", 0);
+        tvideo.low_delay = 1;
+        tvideo.max_latency_us = (int64_t)(config_fmt->live_max_latency_ms > 0 ? 
+                                          config_fmt->live_max_latency_ms : LIVE_MAX_LATENCY_MS) * 1000;
+        if (!config_video->tune)
+            config_video->tune = "zerolatency";
+    }
+
+    /* Pipeline tracing, written when the job ends */
+    if (config_fmt->trace_file && pktav_trace_open(config_fmt->trace_file) < 0)
+        pktav_log(NULL, 0, "Tracing disabled, %s: %s\n", config_fmt->trace_file, strerror(pktav_errno));
+
     /*
      * Open input context
      */
-    error = pktav_open_input_context(input, &ifc, NULL);
+    error = pktav_open_input_context(input, &ifc, iopts);
     if (error < 0) {
+        pktav_trace_close();
         pktav_errno = error;
         return -AV_ERROR;
     }
 
-    if (pktva_get_video_stream(ifc, &svideo) == -1) {
+    if (pktva_get_video_stream(ifc, config_video->track, &svideo) == -1) {
         /* Video stream not found - Why ? */
         pktav_errno = PK_ERROR_VNOTFOUND;
-        return -PK_ERROR;
+        error = -PK_ERROR;
         goto cleanup_input;
     }
 
-    if (pktva_get_audio_stream(ifc, &saudio) == -1) {
+    if (pktva_get_audio_stream(ifc, config_audio->track, &saudio) == -1) {
         /* Audio stream not found - Why ? */
         pktav_errno = PK_ERROR_ANOTFOUND;
         error = -PK_ERROR;
         goto cleanup_input;
     }
 
+    pktav_discard_streams(ifc, svideo, saudio);
+
     config_video->framerate = av_guess_frame_rate(ifc, svideo, NULL);
+    if (config_video->output_framerate.num > 0 && av_cmp_q(config_video->output_framerate, config_video->framerate) != 0) {
+        /* Frame rate conversion before scaling */
+        config_video->framerate = config_video->output_framerate;
+        tvideo.frame_rate = config_video->output_framerate;
+    }
     config_video->pix_fmt = DEFAULT_PIX_FMT;
 
+    /* 
+     * Fragmented/segmented output: one GOP per fragment or segment, so every 
+     * fragment and segment starts with a keyframe. A GOP size set by the 
+     * client is kept (the fragments follow it).
+     */
+    for (config_out = config_fmt; config_out && gop_ms == 0; config_out = config_out->next)
+        gop_ms = config_out->frag_duration_ms > 0 ? config_out->frag_duration_ms : config_out->segment_duration_ms;
+    if (gop_ms > 0) {
+        int gop_size = (int)av_rescale(gop_ms, config_video->framerate.num, (int64_t)config_video->framerate.den * 1000);
+        if (gop_size < 1)
+            gop_size = 1;
+        if (config_video->gop_size <= 0)
+            config_video->gop_size = gop_size;
+        else if (config_video->gop_size != gop_size)
+            pktav_log(NULL, 0, "GOP size %d set by the client, fragments/segments of %d ms would need %d frames\n",
+                               config_video->gop_size, gop_ms, gop_size);
+        config_video->fixed_gop = 1;
+    }
+
+    /* 
+     * Speed controller: the encoder is reopened on its own keyframes, they must 
+     * be on a fixed GOP (of SPEED_GOP_MS if the client did not set one).
+     */
+    if (config_video->speed_target > 0 || config_video->deadline_ms > 0) {
+        if (config_video->gop_size <= 0 && config_video->framerate.num > 0)
+            config_video->gop_size = FFMAX(1, (int)av_rescale(SPEED_GOP_MS, config_video->framerate.num, 
+                                                              (int64_t)config_video->framerate.den * 1000));
+        if (config_video->gop_size > 0)
+            config_video->fixed_gop = 1;
+    }
+
+    /*
+     * Content-adaptive crf/bitrate: a failed probe keeps the configured values
+     */
+    if (config_video->probe.windows > 0 && !config_fmt->live) {
+        error = pktav_probe_complexity(input, config_video, &probe);
+        if (error < 0)
+            pktav_log(NULL, 0, "Complexity probe failed: %s\n", av_err2str(error));
+        else
+            pktav_probe_choose(config_video, &probe);
+        if (error >= 0)
+            pktav_metrics_probe(probe.time_ms);
+    }
+
     /*
      * Open the video transcoder
      */
@@ -716,6 +2500,38 @@ int pktav_worker(int socket, const char *input, TAVInfo *mi, TAVConfigFormat *co
         goto cleanup_input;
     }
 
+    /* The decoder must not have decoded any frame yet, the pool is used from the first one */
+    if (config_video->hugepages) {
+        pktav_framepool_attach(&decode_pool, tvideo.decode_ctx);
+        tvideo.scale_pool = &scale_pool;
+    }
+
+    if (config_video->dup_threshold > 0 && 
+        (error = pktav_dup_init(&tvideo, config_video->dup_threshold, config_video->dup_max_skip)) < 0) {
+        pktav_errno = error;
+        error = -AV_ERROR;
+        goto cleanup_tvideo;
+    }
+
+    if (config_video->thumbs.interval_ms > 0) {
+        error = pktav_thumbs_open(&thumbs, &config_video->thumbs, tvideo.decode_ctx->width, 
+                                  tvideo.decode_ctx->height, tvideo.decode_ctx->sample_aspect_ratio);
+        if (error < 0) {
+            pktav_errno = error;
+            error = -AV_ERROR;
+            goto cleanup_tvideo;
+        }
+        tvideo.thumbs = &thumbs;
+    }
+
+    if (config_video->quality_interval > 0) {
+        error = pktav_quality_init(&quality, config_video->quality_interval, tvideo.encode_ctx);
+        if (error < 0)
+            pktav_log(NULL, 0, "Quality metrics disabled: %s\n", av_err2str(error));
+        else
+            tvideo.quality = &quality;
+    }
+
     /*
      * Open the audio transcoder
      */
@@ -726,14 +2542,53 @@ int pktav_worker(int socket, const char *input, TAVInfo *mi, TAVConfigFormat *co
         goto cleanup_tvideo;
     }
 
-    /* Open output context */
-    error = pktva_open_output_context(config_fmt, &ofc, &tvideo, &taudio);
-    if (error < 0) {
+    taudio.gain_db = config_audio->gain_db;
+    tvideo.stages = &stages;
+    taudio.stages = &stages;
+    if (config_audio->loudness) {
+        error = pktav_loudness_init(&loudness, &taudio.decode_ctx->ch_layout, taudio.decode_ctx->sample_rate);
+        if (error < 0)
+            pktav_log(NULL, 0, "Loudness measurement disabled: %s\n", av_err2str(error));
+        else
+            taudio.loudness = &loudness;
+    }
+
+    /* 
+     * Open the output contexts. An output that cannot be opened is reported
+     * and skipped, the job only fails if none of them can be opened.
+     */
+    for (config_out = config_fmt; config_out && nb_outputs < MAX_OUTPUTS; config_out = config_out->next) {
+        memset(&notify[nb_outputs], 0, sizeof(TAVSegmentNotify));
+        notify[nb_outputs].socket = socket;
+        notify[nb_outputs].start_time = current_time_ms();
+        error = pktva_open_output_context(config_out, &ofc, &tvideo, &taudio, &notify[nb_outputs]);
+        if (error < 0) {
+            pktav_log(NULL, 0, "Error opening output %s: %s\n", config_out->dst, av_err2str(error));
+            outputs_failed++;
+            continue;
+        }
+        pktav_output_init(&outputs[nb_outputs++], config_out, ofc);
+    }
+    if (nb_outputs == 0) {
         pktav_errno = error;
         error = -AV_ERROR;
         goto cleanup_taudio;
     }
 
+    /* The encoded packets are rescaled to the streams of the first output */
+    tvideo.output_stream = outputs[0].ofc->streams[VIDEO_INDEX];
+    taudio.output_stream = outputs[0].ofc->streams[AUDIO_INDEX];
+
+    for (i = 0; i < nb_outputs; i++) {
+        if (config_fmt->live) {
+            /* Live: write the packets as soon as possible */
+            outputs[i].ofc->max_interleave_delta = tvideo.max_latency_us;
+            outputs[i].ofc->flush_packets = 1;
+        }
+        if ((error = pktav_output_start(&outputs[i])) < 0)
+            goto cleanup_output;
+    }
+
     /* Alloc the package to process A/V */
     if ((packet = av_packet_alloc()) == NULL) {
         pktav_errno = AVERROR(ENOMEM);
@@ -741,44 +2596,150 @@ int pktav_worker(int socket, const char *input, TAVInfo *mi, TAVConfigFormat *co
         goto cleanup_output;
     }
 
+    /*
+     * Clip: seek to the keyframe before the start point and only decode 
+     * from there, the frames outside of the clip are dropped after decoding.
+     */
+    if (config_fmt->start_ms > 0 || config_fmt->end_ms > 0) {
+        pktav_trim_window(ifc, &tvideo, config_fmt->start_ms, config_fmt->end_ms);
+        pktav_trim_window(ifc, &taudio, config_fmt->start_ms, config_fmt->end_ms);
+
+        if (config_fmt->start_ms > 0) {
+            seek_ts = (ifc->start_time != AV_NOPTS_VALUE ? ifc->start_time : 0) + (int64_t)config_fmt->start_ms * 1000;
+            error = avformat_seek_file(ifc, -1, INT64_MIN, seek_ts, seek_ts, 0);
+            if (error < 0)
+                pktav_log(NULL, 0, "Seek to %d ms failed (%s), reading from the beginning\n", 
+                                   config_fmt->start_ms, av_err2str(error));
+        }
+
+        if (config_fmt->smart_cut && (error = pktav_smartcut_init(&smartcut, &tvideo)) < 0) {
+            pktav_errno = error;
+            error = -AV_ERROR;
+            goto cleanup_packet;
+        }
+    }
+
+    /* 
+     * Speed controller: target speed or deadline. The smart-cut reopens the
+     * encoder on its own GOPs, so both cannot be used at the same time.
+     */
+    if (!smartcut.active) {
+        duration_ms = config_fmt->end_ms > 0 ? config_fmt->end_ms : 
+                      ifc->duration != AV_NOPTS_VALUE ? ifc->duration / 1000 : 0;
+        duration_ms = duration_ms > config_fmt->start_ms ? duration_ms - config_fmt->start_ms : 0;
+        pktav_speed_init(&speedctl, &tvideo, config_video, duration_ms, job_start_us);
+    }
+    pktav_control_init(&control, &tvideo, socket, !config_fmt->live && !smartcut.active);
+
     start_time = current_time_ms();
-    while ((error = av_read_frame(ifc, packet)) == 0) {
-
-        if (packet->stream_index == mi->video_index) {
-            vpkts++;
-            error = pktav_send_video_packet(&tvideo, packet);
-            if (error < 0) {
-                pktav_errno = error;
-                error = -AV_ERROR;
-                goto cleanup_packet;
+    while ((pktav_stage_begin(&stages, &clock), error = av_read_frame(ifc, packet)) == 0) {
+        pktav_stage_end(&stages, STAGE_DEMUX, &clock, 1);
+        PKTAV_TRACE_END(TRACE_DEMUX, clock.wall_us, packet->stream_index, packet->pts);
+        pktav_metrics_read(packet->size);
+
+        /* Cancelled: the outputs are aborted and the transcoders freed in the cleanup */
+        if (pktav_control_poll(&control)) {
+            pktav_errno = PK_ERROR_CANCELLED;
+            error = -PK_ERROR;
+            goto cleanup_packet;
+        }
+
+        if (config_fmt->live && (packet->stream_index == svideo->index || packet->stream_index == saudio->index)) {
+            if (live_origin == 0 && (live_origin = pktav_live_origin(ifc->streams[packet->stream_index], packet)) != 0) {
+                tvideo.live_origin_us = live_origin;
+                for (i = 0; i < nb_outputs; i++)
+                    outputs[i].latency_origin_us = live_origin;
             }
-            av_packet_unref(packet);
-            
-            while (pktav_recv_video_packet(&tvideo, packet) == 0){
-                av_interleaved_write_frame(ofc, packet);
+            pktav_live_pace(live_origin, ifc->streams[packet->stream_index], packet);
+        }
+
+        /* The progress is the position of the selected streams inside the clip (or the whole input) */
+        if (packet->stream_index == svideo->index || packet->stream_index == saudio->index)
+            pts_pct = FFMAX(pts_pct, pktav_pts_progress(ifc, packet, config_fmt->start_ms, config_fmt->end_ms));
+
+        if (packet->stream_index == svideo->index) {
+            if (pktav_trim_done(&tvideo, packet)) {
+                video_done = 1;
+            } else if (smartcut.active) {
+                vpkts++;
+                error = pktav_smartcut_packet(&smartcut, &tvideo, config_video, outputs, nb_outputs, packet);
+                if (error < 0) {
+                    pktav_errno = error;
+                    error = -AV_ERROR;
+                    goto cleanup_packet;
+                }
+                /* Cannot be paused, only a preemption is logged */
+                pktav_control_gop(&control, &tvideo, config_video, outputs, nb_outputs, packet);
+            } else {
+                vpkts++;
+                error = pktav_send_video_packet(&tvideo, packet);
+                if (error < 0) {
+                    pktav_errno = error;
+                    error = -AV_ERROR;
+                    goto cleanup_packet;
+                }
                 av_packet_unref(packet);
+
+                error = pktav_write_packets(&tvideo, outputs, nb_outputs, packet);
+                if (error < 0) {
+                    pktav_errno = error;
+                    error = -AV_ERROR;
+                    goto cleanup_packet;
+                }
+
+                error = pktav_speed_control(&speedctl, &tvideo, config_video, outputs, nb_outputs, packet);
+                if (error < 0) {
+                    pktav_errno = error;
+                    error = -AV_ERROR;
+                    goto cleanup_packet;
+                }
+
+                error = pktav_control_gop(&control, &tvideo, config_video, outputs, nb_outputs, packet);
+                if (error < 0 && control.cancel) {
+                    pktav_errno = PK_ERROR_CANCELLED;
+                    error = -PK_ERROR;
+                    goto cleanup_packet;
+                } else if (error < 0) {
+                    pktav_errno = error;
+                    error = -AV_ERROR;
+                    goto cleanup_packet;
+                }
+                if (error == 1)
+                    speedctl.gop_start_us = av_gettime_relative();  /* The pause is not encode time */
             }
-        } else if (packet->stream_index == mi->audio_index) {
-            apkts++;
-            error = pktav_send_audio_packet(&taudio, packet);
-            if (error < 0) {
-                pktav_errno = error;
-                error = -AV_ERROR;
-                goto cleanup_packet;
-            }
-            av_packet_unref(packet);
-            
-            while (pktav_recv_audio_packet(&taudio, packet) == 0) {
-                av_interleaved_write_frame(ofc, packet);
+        } else if (packet->stream_index == saudio->index) {
+            if (pktav_trim_done(&taudio, packet)) {
+                audio_done = 1;
+            } else {
+                apkts++;
+                error = pktav_send_audio_packet(&taudio, packet);
+                if (error < 0) {
+                    pktav_errno = error;
+                    error = -AV_ERROR;
+                    goto cleanup_packet;
+                }
                 av_packet_unref(packet);
+
+                error = pktav_write_packets(&taudio, outputs, nb_outputs, packet);
+                if (error < 0) {
+                    pktav_errno = error;
+                    error = -AV_ERROR;
+                    goto cleanup_packet;
+                }
             }
         }
+        av_packet_unref(packet);
+
         /*
          * Calculate the currect percentage
          */
-        current_pct = ((apkts + vpkts) * 100) / (mi->video_packets + mi->audio_packets);
+        if (pts_pct >= 0)
+            current_pct = pts_pct;
+        else if (mi->video_packets + mi->audio_packets > 0)
+            current_pct = FFMIN(((apkts + vpkts) * 100) / (mi->video_packets + mi->audio_packets), 99);
         if (current_pct > counter) {
             TAVStatus status;/* Update the status and send it to the client */
+            memset(&status, 0, sizeof(TAVStatus));
             counter = current_pct;
             status.audio_pkts_read = apkts;
             status.video_pkts_read = vpkts;
@@ -788,40 +2749,123 @@ int pktav_worker(int socket, const char *input, TAVInfo *mi, TAVConfigFormat *co
             status.err_msg = "";
             status.status = 0;
             status.status_desc = "TRANSCODING";
+            pktav_status_stats(&status, &tvideo, outputs, nb_outputs, outputs_failed);
+            pktav_status_speed(&status, &speedctl, config_video);
+            status.pauses = control.pauses;
+            status.paused_ms = control.paused_us / 1000;
+            pktav_sched_status(&status);
+            pktav_metrics_speed(status.proc_time_ms - status.paused_ms);
             error = send_status(socket, &status);
             if ( error < 0) 
                 goto cleanup_packet;
         }
+
+        /* Clip: both streams are past the end point */
+        if (video_done && audio_done)
+            break;
     }
-    error = av_write_trailer(ofc);
-    if (error < 0) {
+
+    /* 
+     * Drain the transcoders: the decoders and the encoders keep frames 
+     * until they are flushed.
+     */
+    if (smartcut.active && (error = pktav_smartcut_finish(&smartcut, &tvideo, config_video, outputs, nb_outputs)) < 0) {
+        pktav_errno = error;
+        error = -AV_ERROR;
+        goto cleanup_packet;
+    }
+    if ((error = pktav_flush_transcoder(&tvideo, outputs, nb_outputs, packet)) < 0 ||
+        (error = pktav_flush_transcoder(&taudio, outputs, nb_outputs, packet)) < 0) {
         pktav_errno = error;
         error = -AV_ERROR;
+        goto cleanup_packet;
+    }
+
+    if (tvideo.thumbs && (error = pktav_thumbs_finish(tvideo.thumbs)) < 0) {
+        pktav_errno = error;
+        error = -AV_ERROR;
+        goto cleanup_packet;
+    }
+
+    if (tvideo.quality && pktav_quality_flush(tvideo.quality) < 0)
+        pktav_log(NULL, 0, "Quality metrics: the last frames were not measured\n");
+
+    /* Write the trailers, the job is done if at least one output was completed */
+    error = AVERROR_EOF;
+    for (i = 0, ret = 0; i < nb_outputs; i++) {
+        if ((ret = pktav_output_finish(&outputs[i])) == 0)
+            error = 0;
+        pktav_segment_notify_flush(&notify[i]);
+    }
+    if (error < 0) {
+        pktav_errno = ret;
+        error = -AV_ERROR;
     } else {
         TAVStatus status;
+        memset(&status, 0, sizeof(TAVStatus));
         counter = current_pct;
         status.audio_pkts_read = apkts;
         status.video_pkts_read = vpkts;
         status.proc_time_ms = current_time_ms() - start_time;
-        status.progress_pct = current_pct;
-        status.time_left_ms = (status.proc_time_ms * (100 - status.progress_pct)) / status.progress_pct;
+        status.progress_pct = 100;
+        status.time_left_ms = 0;
         status.err_msg = "";
         status.status = 1;
         status.status_desc = "FINISH";
+        pktav_status_stats(&status, &tvideo, outputs, nb_outputs, outputs_failed);
+        pktav_status_speed(&status, &speedctl, config_video);
+        status.pauses = control.pauses;
+        status.paused_ms = control.paused_us / 1000;
+        pktav_sched_status(&status);
+        if (taudio.loudness)
+            pktav_status_loudness(&status, taudio.loudness, config_audio->loudness_target);
+        pktav_cgroup_status(&status);
+        status.frame_buffers = decode_pool.buffers + scale_pool.buffers;
+        status.frame_buffers_hugetlb = decode_pool.hugetlb + scale_pool.hugetlb;
+        status.frame_buffers_thp = decode_pool.thp + scale_pool.thp;
+        if (status.proc_time_ms - status.paused_ms > 0)
+            status.fps = tvideo.frames_sent * 1000.0 / (status.proc_time_ms - status.paused_ms);
+        pktav_output_stages(outputs, nb_outputs, &stages);
+        pktav_stages_status(&stages, &status);
+        pktav_usage_status(&usage, &status);
+        if (probe.frames > 0) {
+            status.probe = 1;
+            status.probe_bpp = probe.bpp;
+            status.probe_time_ms = probe.time_ms;
+            status.video_crf = config_video->crf;
+            status.video_bitrate_bps = config_video->crf != -1 ? 0 : config_video->bitrate_bps;
+        }
+        for (i = 0; i < nb_outputs; i++) {
+            if (outputs[i].config->checksum && outputs[i].error == 0) {
+                pktav_output_checksum(&outputs[i], &status.checksums[status.nb_checksums]);
+                for (config_out = config_fmt; config_out != outputs[i].config; config_out = config_out->next)
+                    status.checksums[status.nb_checksums].output++;
+                status.nb_checksums++;
+            }
+        }
         error = send_status(socket, &status);
     }
 
 cleanup_packet:
+    pktav_smartcut_close(&smartcut);
     av_packet_free(&packet);
 cleanup_output:
-    avformat_close_input(&ofc);
-    avformat_free_context(ofc);
+    for (i = 0; i < nb_outputs; i++) {
+        pktav_output_close(&outputs[i]);
+        av_freep(&notify[i].pending);
+    }
 cleanup_taudio:
     pktav_close_transcoder(&taudio);
+    pktav_loudness_close(&loudness);
 cleanup_tvideo:
     pktav_close_transcoder(&tvideo);
+    pktav_thumbs_close(&thumbs);
+    pktav_quality_close(&quality);
+    pktav_framepool_close(&decode_pool);
+    pktav_framepool_close(&scale_pool);
 cleanup_input:
     avformat_close_input(&ifc);
     avformat_free_context(ifc);
+    pktav_trace_close();
     return error;
 }
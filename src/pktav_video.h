@@ -4,6 +4,9 @@
 #include "pktav_types.h"
 #include "pktav_mediainfo.h"
 
+extern int pktav_open_input_context(const char *input_media, AVFormatContext **avfc, AVDictionary *options);
+extern int pktva_get_video_stream(AVFormatContext *avfc, const char *track, AVStream **stream);
+extern int pktva_get_audio_stream(AVFormatContext *avfc, const char *track, AVStream **stream);
 extern int pktav_worker(int socket, const char *input, TAVInfo *mi, TAVConfigFormat *config_fmt, TAVConfigAudio *config_audio, TAVConfigVideo *config_video);
 
 #endif
\ No newline at end of file
@@ -1,14 +1,34 @@
 #include <unistd.h>
 #include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <libavutil/time.h>
 #include "pktav_netutils.h"
 #include "pktav_proto.h"
 #include "pktav_video.h"
 #include "pktav_mediainfo.h"
 #include "pktav_sigchld.h"
+#include "pktav_sched.h"
+#include "pktav_cgroup.h"
+#include "pktav_metrics.h"
 #include "pktav_error.h"
 #include "pktav_log.h"
 #include "pktav_version.h"
 
+/*
+ * CANCELLED status, if the client is still there (it could have hung up).
+ */
+static void send_cancelled(int client) {
+    TAVStatus status;
+
+    memset(&status, 0, sizeof(TAVStatus));
+    status.err_msg = "";
+    status.status = 4;
+    status.status_desc = "CANCELLED";
+    send_status(client, &status);
+}
+
 int main(int argc, char *argv[]) {
     int socket;
     int err;
@@ -18,6 +38,18 @@ int main(int argc, char *argv[]) {
     TAVConfigVideo  video; 
     TAVConfigAudio  audio;
     TAVInfo *mi = NULL;
+    TAVScheduler *sched;
+    char *cores = getenv("PKTAV_CORES");
+    char *cgroup = getenv("PKTAV_CGROUP");
+    char *placement = getenv("PKTAV_PLACEMENT");
+    int batch = getenv("PKTAV_SCHED_BATCH") != NULL;
+    char *metrics_address = getenv("PKTAV_METRICS");
+    int metrics_socket = -1;
+    struct pollfd pfds[2];
+    int slot, priority;
+    double cost;
+    long queued_ms;
+    int64_t duration_ms;
     
     if (argc > 1 && strcmp(argv[1], "--version") == 0) {
         fprintf(stdout, "%s\n", VERSION);
@@ -51,12 +83,69 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    /* A client that hangs up cancels its job: write errors instead of SIGPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    /*
+     * Job scheduler shared by the workers (pktav_sched.c)
+     */
+    sched = pktav_sched_create(cores ? atof(cores) : (double)sysconf(_SC_NPROCESSORS_ONLN));
+    if (!sched) {
+        pktav_log(NULL, 0, "Error pktav_sched_create(): %s\n", strerror(pktav_errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* NUMA placement: each job pinned to cpus of one node */
+    if (placement && atoi(placement) > 0)
+        pktav_log(NULL, 0, "Job placement enabled: %d NUMA nodes\n", pktav_sched_placement(sched));
+
+    /*
+     * Per-job cgroup v2 leaves (pktav_cgroup.c), optional
+     */
+    if (cgroup && pktav_cgroup_init(cgroup) < 0)
+        pktav_log(NULL, 0, "Cgroups disabled, %s: %s\n", cgroup, strerror(pktav_errno));
+
+    /*
+     * Shared job counters (pktav_metrics.c), served in Prometheus text format
+     * on PKTAV_METRICS: a Unix socket path or a loopback TCP port.
+     */
+    if (!pktav_metrics_create(sched))
+        pktav_log(NULL, 0, "Metrics disabled: %s\n", strerror(pktav_errno));
+    else if (metrics_address && (metrics_socket = pktav_metrics_listener(metrics_address)) < 0)
+        pktav_log(NULL, 0, "Metrics endpoint disabled, %s: %s\n", metrics_address, strerror(pktav_errno));
+
     while(1) {
         pid_t wpid; /* Worker PID */
-        int client;
+        int client, ret;
         /*
-         * Ready to start accepting new connections
+         * Ready to start accepting new connections (jobs and scrapes)
          */
+        pfds[0].fd = socket;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = metrics_socket;    /* Ignored by poll() if disabled (-1) */
+        pfds[1].events = POLLIN;
+        ret = poll(pfds, 2, -1);
+        if (ret < 0 && errno != EINTR)
+            pktav_log(NULL, 0, "Error poll(): %s\n", strerror(errno));
+        /* The cgroups of the workers reaped by the SIGCHLD handler (it interrupts the poll) */
+        pktav_cgroup_remove_reaped();
+        if (ret < 0)
+            continue;
+        if (pfds[1].revents & POLLIN && (client = unix_accept(metrics_socket)) >= 0) {
+            /* Served by a child: a slow scraper does not delay the accept of the jobs */
+            wpid = fork();
+            if (wpid == 0) {
+                close(socket);
+                close(metrics_socket);
+                pktav_metrics_serve(client);
+                exit(EXIT_SUCCESS);
+            }
+            if (wpid < 0)
+                pktav_log(NULL, 0, "Error at fork() (metrics): %s\n", strerror(errno));
+            close(client);
+        }
+        if (!(pfds[0].revents & POLLIN))
+            continue;
         client = unix_accept(socket);
         if (client < 0) {
             pktav_log(NULL, 0, "Error unix_accept(): %s, return: %d\n", pktav_strerror(client), client);
@@ -67,7 +156,7 @@ int main(int argc, char *argv[]) {
         /*
          * Now the server is ready to fork a new worker to process the next job
          */
-        wpid = 0; /*fork(); */
+        wpid = fork();
         switch (wpid)
         {
         case -1: /* Error */
@@ -78,6 +167,8 @@ int main(int argc, char *argv[]) {
             
         case 0:  /* In the Child Process  */
             close(socket);
+            if (metrics_socket >= 0)
+                close(metrics_socket);
 
             err = recv_input(client, input_file, PATH_MAX+1);
             if (err < 0) {
@@ -93,6 +184,7 @@ int main(int argc, char *argv[]) {
                 pktav_log(NULL, 0, "Error extracting media information from file(%s): %s, return: %d - End process -\n", 
                                    input_file, pktav_strerror(err), err);
                 send_error(client, pktav_strerror(err));
+                pktav_metrics_result(METRICS_FAILED);
                 close(client);
                 exit(EXIT_FAILURE);
             }
@@ -120,20 +212,65 @@ int main(int argc, char *argv[]) {
                 close(client);
                 exit(EXIT_FAILURE);
             }
+            pktav_log_set_job(format.job_id);
 
             dump_TAVConfigFormat(&format);
             dump_TAVConfigVideo(&video);
             dump_TAVConfigAudio(&audio);
 
-            err = pktav_worker(client, input_file, mi, &format, &audio, &video);
+            /*
+             * Wait for a turn in the scheduler: priority class, deadline and 
+             * estimated cores of the job against the free cores.
+             */
+            duration_ms = (int64_t)(mi->duration * 1000);
+            if (format.end_ms > 0 && format.end_ms < duration_ms)
+                duration_ms = format.end_ms;
+            duration_ms = duration_ms > format.start_ms ? duration_ms - format.start_ms : 0;
+            priority = pktav_sched_class(format.priority, format.live);
+            cost = pktav_sched_cost(mi, &video);
+            slot = pktav_sched_submit(sched, priority, video.deadline_ms, cost, video.threads, duration_ms);
+            if (slot < 0) {
+                pktav_log(NULL, 0, "Error queuing the job: %s, return: %d - End process -\n", pktav_strerror(slot), slot);
+                send_error(client, pktav_strerror(slot));
+                pktav_metrics_result(METRICS_FAILED);
+                close(client);
+                exit(EXIT_FAILURE);
+            }
+            pktav_metrics_job(slot);
+            queued_ms = av_gettime_relative() / 1000;
+            err = pktav_sched_wait(sched, slot, client);
             if (err < 0) {
+                pktav_log(NULL, 0, "Client gone while queued: %s, return: %d - End process -\n", pktav_strerror(err), err);
+                send_cancelled(client);
+                pktav_metrics_result(METRICS_CANCELLED);
+                close(client);
+                exit(EXIT_FAILURE);
+            }
+            err = pktav_cgroup_enter(priority, cost, batch);
+            if (err < 0)
+                pktav_log(NULL, 0, "Job running without cgroup limits: %s\n", strerror(pktav_errno));
+
+            /* The deadline counts from the submission */
+            if (video.deadline_ms > 0)
+                video.deadline_ms = FFMAX(1, video.deadline_ms - (int)(av_gettime_relative() / 1000 - queued_ms));
+
+            err = pktav_worker(client, input_file, mi, &format, &audio, &video);
+            pktav_sched_done(sched, slot);
+            if (err == -PK_ERROR && pktav_errno == PK_ERROR_CANCELLED) {
+                pktav_log(NULL, 0, "Worker cancelled - End process -\n");
+                pktav_metrics_result(METRICS_CANCELLED);
+                send_cancelled(client);
+            } else if (err < 0) {
                 TAVStatus status;
                 memset(&status, 0, sizeof(TAVStatus));
                 pktav_log(NULL, 0, "Worker fail: %s, return: %d - End process -\n", pktav_strerror(err), err);
                 status.err_msg = (char *)pktav_strerror(err);
                 status.status  = -1;
                 status.status_desc = "FAILED";
+                pktav_metrics_result(METRICS_FAILED);
                 send_status(client, &status);
+            } else {
+                pktav_metrics_result(METRICS_FINISHED);
             }
             pktav_log(NULL, 0, "Worker finish - End process -\n");
             /* TODO: Limpiar Mediainfo struct */
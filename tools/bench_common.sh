@@ -0,0 +1,32 @@
+# Helpers of the benchmark scripts (sourced).
+#
+#   PKTAV_BIN   daemon binary (default: src/main of this tree, built with make)
+#   CONFIG      config kv string of the jobs, "{job}" is the job number
+
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+PKTAV_BIN=${PKTAV_BIN:-$TOOLS/../src/main}
+BENCH_DIR=${BENCH_DIR:-$(mktemp -d /tmp/pktav-bench.XXXXXX)}
+SOCKET=$BENCH_DIR/pktav.socket
+CONFIG=${CONFIG:-"format_dst:$BENCH_DIR/out-{job}.mp4;format_dst_type:mp4;video_codec:libx264;video_width:1920;video_height:1080;video_crf:23;video_preset:medium;video_profile:high;audio_codec:aac;audio_bitrate_bps:128000;audio_channels:2;audio_sample_rate:48000"}
+
+# Wait until the daemon listens on its socket
+wait_socket() {
+    i=0
+    while [ ! -S "$SOCKET" ] && [ $i -lt 100 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    [ -S "$SOCKET" ] || { echo "daemon did not start, see $BENCH_DIR/daemon.log" >&2; exit 1; }
+}
+
+# Run the jobs against the daemon, print the aggregate fps
+run_jobs() {
+    "$TOOLS/pktav_bench.py" --socket "$SOCKET" --jobs "$1" "$INPUT" "$2" | tee -a "$BENCH_DIR/jobs.log" |
+        sed -n 's/^aggregate: .*, \([0-9.]*\) fps$/\1/p'
+}
+
+stop_daemon() {
+    kill "$1" 2>/dev/null || true
+    wait "$1" 2>/dev/null || true
+    rm -f "$SOCKET"
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# dTLB misses and fps of a job with the huge page frame pools off and on
+# (video_hugepages), measured with perf stat over the daemon and its workers.
+#
+#   tools/bench_hugepages.sh INPUT [RUNS]
+#
+# Reserve huge pages first to test MAP_HUGETLB (sysctl vm.nr_hugepages=512),
+# otherwise the pools use transparent huge pages. Needs perf with access to
+# the hardware counters (kernel.perf_event_paranoid <= 1). See bench_common.sh
+# for the daemon binary and the config of the jobs.
+#
+set -e
+. "$(dirname "$0")/bench_common.sh"
+
+INPUT=$(realpath "$1")
+RUNS=${2:-3}
+EVENTS=dTLB-loads,dTLB-load-misses
+
+echo "input $INPUT, $RUNS runs, logs in $BENCH_DIR"
+printf "%-10s %-10s %-16s %-16s %s\n" hugepages run dTLB-loads dTLB-misses fps
+for hugepages in 0 1; do
+    for run in $(seq "$RUNS"); do
+        stat=$BENCH_DIR/perf-$hugepages-$run.csv
+        UNIX_SOCKET=$SOCKET perf stat -x, -e $EVENTS -o "$stat" -- "$PKTAV_BIN" >>"$BENCH_DIR/daemon.log" 2>&1 &
+        perf=$!
+        wait_socket
+        fps=$(run_jobs 1 "$CONFIG;video_hugepages:$hugepages")
+        # perf writes the counters when the daemon exits
+        stop_daemon "$(pgrep -P $perf)"
+        wait $perf 2>/dev/null || true
+        loads=$(awk -F, '$3 == "dTLB-loads" { print $1 }' "$stat")
+        misses=$(awk -F, '$3 == "dTLB-load-misses" { print $1 }' "$stat")
+        printf "%-10s %-10s %-16s %-16s %s\n" "$hugepages" "$run" "$loads" "$misses" "$fps"
+    done
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Aggregate fps of concurrent jobs with the NUMA placement off and on
+# (PKTAV_PLACEMENT). Every run starts a new daemon.
+#
+#   tools/bench_placement.sh INPUT [JOBS] [RUNS]
+#
+# JOBS defaults to 2 per NUMA node and every job gets nproc/JOBS threads
+# (THREADS), so the jobs fill the machine. See bench_common.sh for the
+# daemon binary and the config of the jobs.
+#
+set -e
+. "$(dirname "$0")/bench_common.sh"
+
+INPUT=$(realpath "$1")
+NODES=$(ls -d /sys/devices/system/node/node[0-9]* 2>/dev/null | wc -l)
+JOBS=${2:-$((2 * (NODES > 0 ? NODES : 1)))}
+RUNS=${3:-3}
+THREADS=${THREADS:-$(( $(nproc) / JOBS > 0 ? $(nproc) / JOBS : 1 ))}
+
+echo "input $INPUT, $NODES nodes, $JOBS jobs of $THREADS threads, $RUNS runs, logs in $BENCH_DIR"
+printf "%-10s %s\n" placement "aggregate fps"
+for placement in 0 1; do
+    results=""
+    for run in $(seq "$RUNS"); do
+        PKTAV_PLACEMENT=$placement UNIX_SOCKET=$SOCKET "$PKTAV_BIN" >>"$BENCH_DIR/daemon.log" 2>&1 &
+        daemon=$!
+        wait_socket
+        results="$results $(run_jobs "$JOBS" "$CONFIG;video_threads:$THREADS")"
+        stop_daemon $daemon
+    done
+    printf "%-10s %s\n" "$([ $placement = 1 ] && echo on || echo off)" "$results"
+done
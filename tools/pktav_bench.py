@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Run concurrent jobs against a running PkstAVtranscoder daemon and report the
+aggregate throughput.
+
+Protocol (NUL terminated kv strings, ';' between pairs and ':' between key and
+value): the client sends the input, receives the media info, sends the config
+and then reads the status messages until FINISH (1), FAILED (-1) or CANCELLED (4).
+
+    pktav_bench.py --socket unix.socket --jobs 4 input.mp4 \
+        "video_codec:libx264;video_preset:medium;..."
+
+"{job}" in the config is replaced by the job number, so every job can have its
+own destination. Prints one line per job and a final line with the aggregate
+fps (video frames of the finished jobs / wall time of the run).
+"""
+import argparse
+import socket
+import threading
+import time
+
+DONE = (1, -1, 4)
+
+
+def recv_msg(sock, pending):
+    while b"\0" not in pending:
+        data = sock.recv(65536)
+        if not data:
+            raise ConnectionError("daemon closed the connection")
+        pending += data
+    msg, _, rest = pending.partition(b"\0")
+    return msg.decode(), rest
+
+
+def parse_kv(msg):
+    kv = {}
+    for pair in msg.split(";"):
+        key, _, value = pair.partition(":")
+        if key:
+            kv[key] = value
+    return kv
+
+
+def run_job(path, input_file, config, job, results):
+    start = time.monotonic()
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(path)
+    pending = b""
+    try:
+        sock.sendall(("input_file:%s\0" % input_file).encode())
+        msg, pending = recv_msg(sock, pending)
+        info = parse_kv(msg)
+        sock.sendall((config.replace("{job}", str(job)) + "\0").encode())
+        status = {}
+        while int(status.get("status", 0)) not in DONE:
+            msg, pending = recv_msg(sock, pending)
+            status = parse_kv(msg)
+    finally:
+        sock.close()
+    results[job] = {
+        "start": start,
+        "end": time.monotonic(),
+        "frames": int(info.get("video_packets", 0)),
+        "status": status,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--socket", default="unix.socket", help="socket of the daemon (UNIX_SOCKET)")
+    parser.add_argument("--jobs", type=int, default=1, help="concurrent jobs")
+    parser.add_argument("input", help="input file of every job")
+    parser.add_argument("config", help="config kv string, {job} is replaced by the job number")
+    args = parser.parse_args()
+
+    results = {}
+    threads = [threading.Thread(target=run_job, args=(args.socket, args.input, args.config, i, results))
+               for i in range(args.jobs)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    frames = 0
+    for job in sorted(results):
+        r = results[job]
+        st = r["status"]
+        print("job %d: %s, %d frames in %.2f s, fps %s, node %s, cpus %s" % (
+            job, st.get("status_desc", "?"), r["frames"], r["end"] - r["start"],
+            st.get("fps", "-"), st.get("numa_node", "-"), st.get("cpus", "-")))
+        if st.get("status") == "1":
+            frames += r["frames"]
+    if results:
+        wall = max(r["end"] for r in results.values()) - min(r["start"] for r in results.values())
+        print("aggregate: %d jobs, %d frames in %.2f s, %.1f fps" % (len(results), frames, wall, frames / wall))
+
+
+if __name__ == "__main__":
+    main()